@@ -0,0 +1,341 @@
+#include <string.h>
+
+#include "archive.h"
+#include "presets.h"
+#include "debug.h"
+
+/* Archive header (all integers are little endian), followed by the base
+ * images, the offsets of each delta (plus the end of the last one), the
+ * deltas themselves and the names (index of the preset, and the name) */
+typedef struct dnafx_archive_header {
+	char magic[8];
+	uint16_t version;
+	uint16_t image_size;
+	uint16_t bases;
+	uint16_t reserved;
+	uint32_t count;
+	uint32_t deltas_size;
+	uint32_t names;
+} dnafx_archive_header;
+#define DNAFX_ARCHIVE_NAME_ENTRY	(sizeof(uint32_t) + DNAFX_PRESET_NAME_SIZE)
+
+/* An open archive */
+struct dnafx_archive {
+	GMappedFile *file;
+	guint bases, count, names;
+	const uint8_t *images;
+	const uint8_t *offsets;
+	const uint8_t *deltas;
+	size_t deltas_size;
+	const uint8_t *table;
+};
+
+/* Varints (LEB128) */
+static size_t dnafx_archive_put_varint(uint8_t *buf, guint value) {
+	size_t len = 0;
+	while(value >= 0x80) {
+		if(buf)
+			buf[len] = (value & 0x7F) | 0x80;
+		value >>= 7;
+		len++;
+	}
+	if(buf)
+		buf[len] = value;
+	return len + 1;
+}
+
+static int dnafx_archive_get_varint(const uint8_t *buf, size_t len, size_t *offset, guint *value) {
+	guint result = 0, shift = 0;
+	while(*offset < len && shift < 32) {
+		uint8_t byte = buf[(*offset)++];
+		result |= (guint)(byte & 0x7F) << shift;
+		if(!(byte & 0x80)) {
+			*value = result;
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
+
+/* Helper to encode an image as a delta against a base: if the buffer is
+ * NULL, this just returns how large the delta would be. Runs that are
+ * separated by less than three identical bytes are merged, as starting
+ * a new run would cost more than including those bytes */
+static size_t dnafx_archive_delta(const uint8_t *image, const uint8_t *base, guint index, uint8_t *buf) {
+	size_t len = dnafx_archive_put_varint(buf, index);
+	size_t i = 0, start = 0, end = 0, last = 0;
+	while(i < DNAFX_PRESET_SIZE) {
+		if(image[i] == base[i]) {
+			i++;
+			continue;
+		}
+		/* Find where this run ends */
+		start = i;
+		end = i + 1;
+		for(i=end; i<DNAFX_PRESET_SIZE; i++) {
+			if(image[i] != base[i])
+				end = i + 1;
+			else if(i - end >= 2)
+				break;
+		}
+		len += dnafx_archive_put_varint(buf ? buf + len : NULL, start - last);
+		len += dnafx_archive_put_varint(buf ? buf + len : NULL, end - start);
+		if(buf)
+			memcpy(buf + len, image + start, end - start);
+		len += end - start;
+		last = end;
+		i = end;
+	}
+	return len;
+}
+
+/* Saving and loading archives */
+int dnafx_archive_save(const char *filename) {
+	if(filename == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return -1;
+	}
+	gint64 start = g_get_monotonic_time();
+	GPtrArray *names = dnafx_presets_names();
+	guint nnames = names ? names->len : 0, i = 0, j = 0;
+	/* Each record is archived once, however many names it has */
+	GArray *handles = g_array_new(FALSE, FALSE, sizeof(dnafx_store_handle));
+	GHashTable *indexes = g_hash_table_new(NULL, NULL);
+	GByteArray *table = g_byte_array_sized_new(nnames * DNAFX_ARCHIVE_NAME_ENTRY);
+	uint8_t entry[DNAFX_ARCHIVE_NAME_ENTRY];
+	const char *name = NULL;
+	dnafx_store_handle handle = DNAFX_STORE_INVALID;
+	gpointer index = NULL;
+	uint32_t record = 0;
+	for(i=0; i<nnames; i++) {
+		name = g_ptr_array_index(names, i);
+		handle = dnafx_preset_handle_byname(name);
+		if(dnafx_store_image(handle) == NULL)
+			continue;
+		if(!g_hash_table_lookup_extended(indexes, GUINT_TO_POINTER(handle), NULL, &index)) {
+			index = GUINT_TO_POINTER(handles->len);
+			g_hash_table_insert(indexes, GUINT_TO_POINTER(handle), index);
+			g_array_append_val(handles, handle);
+		}
+		record = GUINT32_TO_LE(GPOINTER_TO_UINT(index));
+		memset(entry, 0, sizeof(entry));
+		memcpy(entry, &record, sizeof(record));
+		memcpy(entry + sizeof(record), name, MIN(strlen(name), DNAFX_PRESET_NAME_SIZE));
+		g_byte_array_append(table, entry, sizeof(entry));
+	}
+	g_hash_table_destroy(indexes);
+	guint count = handles->len;
+	nnames = table->len / DNAFX_ARCHIVE_NAME_ENTRY;
+	/* Pick the bases first, and the best base for each preset */
+	GByteArray *bases = g_byte_array_new();
+	guint *base = g_malloc0_n(count ? count : 1, sizeof(guint));
+	guint nbases = 0;
+	size_t size = 0, best = 0;
+	const uint8_t *image = NULL;
+	for(i=0; i<count; i++) {
+		image = dnafx_store_image(g_array_index(handles, dnafx_store_handle, i));
+		best = G_MAXSIZE;
+		for(j=0; j<nbases; j++) {
+			size = dnafx_archive_delta(image, bases->data + j*DNAFX_PRESET_SIZE, j, NULL);
+			if(size < best) {
+				best = size;
+				base[i] = j;
+			}
+		}
+		if(best > DNAFX_ARCHIVE_NEW_BASE && nbases < DNAFX_ARCHIVE_BASES) {
+			/* Too different from what we have, use it as a new base */
+			g_byte_array_append(bases, image, DNAFX_PRESET_SIZE);
+			base[i] = nbases++;
+		}
+	}
+	/* Encode the deltas */
+	GByteArray *offsets = g_byte_array_sized_new((count + 1) * sizeof(uint32_t));
+	GByteArray *deltas = g_byte_array_sized_new(count * 32);
+	uint8_t delta[2*DNAFX_PRESET_SIZE];
+	uint32_t offset = 0;
+	for(i=0; i<count; i++) {
+		image = dnafx_store_image(g_array_index(handles, dnafx_store_handle, i));
+		size = dnafx_archive_delta(image, bases->data + base[i]*DNAFX_PRESET_SIZE, base[i], delta);
+		offset = GUINT32_TO_LE(deltas->len);
+		g_byte_array_append(offsets, (const uint8_t *)&offset, sizeof(offset));
+		g_byte_array_append(deltas, delta, size);
+	}
+	offset = GUINT32_TO_LE(deltas->len);
+	g_byte_array_append(offsets, (const uint8_t *)&offset, sizeof(offset));
+	g_free(base);
+	g_array_free(handles, TRUE);
+	/* Put everything together */
+	dnafx_archive_header header = { 0 };
+	memcpy(header.magic, DNAFX_ARCHIVE_MAGIC, sizeof(header.magic));
+	header.version = GUINT16_TO_LE(DNAFX_ARCHIVE_VERSION);
+	header.image_size = GUINT16_TO_LE(DNAFX_PRESET_SIZE);
+	header.bases = GUINT16_TO_LE(nbases);
+	header.count = GUINT32_TO_LE(count);
+	header.deltas_size = GUINT32_TO_LE(deltas->len);
+	header.names = GUINT32_TO_LE(nnames);
+	GByteArray *archive = g_byte_array_sized_new(sizeof(header) + bases->len +
+		offsets->len + deltas->len + table->len);
+	g_byte_array_append(archive, (const uint8_t *)&header, sizeof(header));
+	g_byte_array_append(archive, bases->data, bases->len);
+	g_byte_array_append(archive, offsets->data, offsets->len);
+	g_byte_array_append(archive, deltas->data, deltas->len);
+	g_byte_array_append(archive, table->data, table->len);
+	g_byte_array_unref(bases);
+	g_byte_array_unref(offsets);
+	g_byte_array_unref(deltas);
+	g_byte_array_unref(table);
+	/* This writes to a temporary file first, and then renames it */
+	GError *error = NULL;
+	if(!g_file_set_contents(filename, (const gchar *)archive->data, archive->len, &error)) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Error saving archive %s: %s\n", filename,
+			error && error->message ? error->message : "??");
+		g_clear_error(&error);
+		g_byte_array_unref(archive);
+		return -1;
+	}
+	DNAFX_LOG(DNAFX_LOG_INFO, "Saved %u presets (%u names) to archive %s (%u bytes instead of %zu, %u bases, %"SCNi64"ms)\n",
+		count, nnames, filename, archive->len, (size_t)nnames * DNAFX_PRESET_SIZE, nbases,
+		(g_get_monotonic_time() - start) / 1000);
+	g_byte_array_unref(archive);
+	return count;
+}
+
+int dnafx_archive_load(const char *filename) {
+	gint64 start = g_get_monotonic_time();
+	dnafx_archive *archive = dnafx_archive_open(filename);
+	if(archive == NULL)
+		return -1;
+	/* Add all the presets in the archive to the library, with their names */
+	uint8_t image[DNAFX_PRESET_SIZE];
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	guint i = 0;
+	int count = 0, index = 0;
+	for(i=0; i<archive->names; i++) {
+		index = dnafx_archive_name(archive, i, name, sizeof(name));
+		if(index < 0 || dnafx_archive_get(archive, index, image) < 0)
+			continue;
+		if(dnafx_preset_add_named_image(image, name) != DNAFX_STORE_INVALID)
+			count++;
+	}
+	dnafx_archive_close(archive);
+	DNAFX_LOG(DNAFX_LOG_INFO, "Loaded %d presets from archive %s (%"SCNi64"ms)\n",
+		count, filename, (g_get_monotonic_time() - start) / 1000);
+	return count;
+}
+
+/* Random access to the presets in an archive */
+dnafx_archive *dnafx_archive_open(const char *filename) {
+	if(filename == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return NULL;
+	}
+	GError *error = NULL;
+	GMappedFile *file = g_mapped_file_new(filename, FALSE, &error);
+	if(file == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Error opening archive %s: %s\n", filename,
+			error && error->message ? error->message : "??");
+		g_clear_error(&error);
+		return NULL;
+	}
+	const uint8_t *data = (const uint8_t *)g_mapped_file_get_contents(file);
+	size_t size = g_mapped_file_get_length(file);
+	dnafx_archive_header header;
+	if(data == NULL || size < sizeof(header)) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid archive %s (too short)\n", filename);
+		g_mapped_file_unref(file);
+		return NULL;
+	}
+	memcpy(&header, data, sizeof(header));
+	if(memcmp(header.magic, DNAFX_ARCHIVE_MAGIC, sizeof(header.magic)) ||
+			GUINT16_FROM_LE(header.version) != DNAFX_ARCHIVE_VERSION ||
+			GUINT16_FROM_LE(header.image_size) != DNAFX_PRESET_SIZE) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid or unsupported archive %s\n", filename);
+		g_mapped_file_unref(file);
+		return NULL;
+	}
+	dnafx_archive *archive = g_malloc0(sizeof(dnafx_archive));
+	archive->file = file;
+	archive->bases = GUINT16_FROM_LE(header.bases);
+	archive->count = GUINT32_FROM_LE(header.count);
+	archive->deltas_size = GUINT32_FROM_LE(header.deltas_size);
+	archive->names = GUINT32_FROM_LE(header.names);
+	size_t expected = sizeof(header) + (size_t)archive->bases * DNAFX_PRESET_SIZE +
+		((size_t)archive->count + 1) * sizeof(uint32_t) + archive->deltas_size +
+		(size_t)archive->names * DNAFX_ARCHIVE_NAME_ENTRY;
+	if(size < expected) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid archive %s (truncated, %zu/%zu bytes)\n", filename, size, expected);
+		dnafx_archive_close(archive);
+		return NULL;
+	}
+	archive->images = data + sizeof(header);
+	archive->offsets = archive->images + (size_t)archive->bases * DNAFX_PRESET_SIZE;
+	archive->deltas = archive->offsets + ((size_t)archive->count + 1) * sizeof(uint32_t);
+	archive->table = archive->deltas + archive->deltas_size;
+	return archive;
+}
+
+guint dnafx_archive_count(dnafx_archive *archive) {
+	return archive ? archive->count : 0;
+}
+
+int dnafx_archive_get(dnafx_archive *archive, guint index, uint8_t *image) {
+	if(archive == NULL || index >= archive->count || image == NULL)
+		return -1;
+	uint32_t start = 0, end = 0;
+	memcpy(&start, archive->offsets + index*sizeof(uint32_t), sizeof(start));
+	memcpy(&end, archive->offsets + (index+1)*sizeof(uint32_t), sizeof(end));
+	start = GUINT32_FROM_LE(start);
+	end = GUINT32_FROM_LE(end);
+	if(start > end || end > archive->deltas_size)
+		goto invalid;
+	const uint8_t *delta = archive->deltas + start;
+	size_t len = end - start, offset = 0, position = 0;
+	guint base = 0, skip = 0, run = 0;
+	if(dnafx_archive_get_varint(delta, len, &offset, &base) < 0 || base >= archive->bases)
+		goto invalid;
+	memcpy(image, archive->images + base*DNAFX_PRESET_SIZE, DNAFX_PRESET_SIZE);
+	while(offset < len) {
+		if(dnafx_archive_get_varint(delta, len, &offset, &skip) < 0 ||
+				dnafx_archive_get_varint(delta, len, &offset, &run) < 0)
+			goto invalid;
+		position += skip;
+		if(position + run > DNAFX_PRESET_SIZE || offset + run > len)
+			goto invalid;
+		memcpy(image + position, delta + offset, run);
+		position += run;
+		offset += run;
+	}
+	return 0;
+
+invalid:
+	DNAFX_LOG(DNAFX_LOG_WARN, "Invalid delta for preset %u in archive\n", index);
+	return -1;
+}
+
+guint dnafx_archive_names(dnafx_archive *archive) {
+	return archive ? archive->names : 0;
+}
+
+int dnafx_archive_name(dnafx_archive *archive, guint index, char *name, size_t len) {
+	if(archive == NULL || index >= archive->names || name == NULL || len == 0)
+		return -1;
+	const uint8_t *entry = archive->table + (size_t)index * DNAFX_ARCHIVE_NAME_ENTRY;
+	uint32_t record = 0;
+	memcpy(&record, entry, sizeof(record));
+	record = GUINT32_FROM_LE(record);
+	if(record >= archive->count) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "Invalid name %u in archive\n", index);
+		return -1;
+	}
+	g_snprintf(name, len, "%.*s", DNAFX_PRESET_NAME_SIZE, (const char *)entry + sizeof(record));
+	return record;
+}
+
+void dnafx_archive_close(dnafx_archive *archive) {
+	if(archive == NULL)
+		return;
+	if(archive->file != NULL)
+		g_mapped_file_unref(archive->file);
+	g_free(archive);
+}
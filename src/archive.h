@@ -0,0 +1,39 @@
+#ifndef DNAFX_ARCHIVE
+#define DNAFX_ARCHIVE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+/* An archive file contains all the named presets in the library: each
+ * record is stored once, and a table maps all the names it has in the
+ * library (aliases and unique names included) to it. Records are stored
+ * as deltas: presets tend to differ from one another in a handful of
+ * bytes (the name and a few params), so each preset is encoded as the
+ * differences from one of a few base images, picked when saving (a preset
+ * that's too different from all the bases so far becomes a new base).
+ * Deltas are runs of bytes that differ from the base (varint offset from
+ * the previous run, varint length, and the new bytes), and an offsets
+ * table means any preset can be decoded without going through the others.
+ * The file can be mapped and used as it is, as bank files can */
+#define DNAFX_ARCHIVE_MAGIC		"DNAFXARC"
+#define DNAFX_ARCHIVE_VERSION	2
+#define DNAFX_ARCHIVE_BASES		64
+#define DNAFX_ARCHIVE_NEW_BASE	48
+
+/* Saving and loading archives */
+int dnafx_archive_save(const char *filename);
+int dnafx_archive_load(const char *filename);
+
+/* Random access to the presets in an archive */
+typedef struct dnafx_archive dnafx_archive;
+dnafx_archive *dnafx_archive_open(const char *filename);
+guint dnafx_archive_count(dnafx_archive *archive);
+int dnafx_archive_get(dnafx_archive *archive, guint index, uint8_t *image);
+/* Names in the library, sorted, each returning the index of its preset */
+guint dnafx_archive_names(dnafx_archive *archive);
+int dnafx_archive_name(dnafx_archive *archive, guint index, char *name, size_t len);
+void dnafx_archive_close(dnafx_archive *archive);
+
+#endif
@@ -0,0 +1,141 @@
+#include <string.h>
+
+#include "bank.h"
+#include "presets.h"
+#include "debug.h"
+
+/* Bank header (all integers are little endian) */
+typedef struct dnafx_bank_header {
+	char magic[8];
+	uint16_t version;
+	uint16_t slots;
+	uint16_t image_size;
+	uint16_t reserved;
+} dnafx_bank_header;
+#define DNAFX_BANK_INDEX		sizeof(dnafx_bank_header)
+#define DNAFX_BANK_IMAGES		(DNAFX_BANK_INDEX + DNAFX_PRESETS_NUM)
+#define DNAFX_BANK_SIZE			(DNAFX_BANK_IMAGES + DNAFX_PRESETS_NUM * DNAFX_PRESET_SIZE)
+
+/* Saving and loading banks */
+int dnafx_bank_save(const char *filename) {
+	if(filename == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return -1;
+	}
+	uint8_t *bank = g_malloc0(DNAFX_BANK_SIZE);
+	dnafx_bank_header header = { 0 };
+	memcpy(header.magic, DNAFX_BANK_MAGIC, sizeof(header.magic));
+	header.version = GUINT16_TO_LE(DNAFX_BANK_VERSION);
+	header.slots = GUINT16_TO_LE(DNAFX_PRESETS_NUM);
+	header.image_size = GUINT16_TO_LE(DNAFX_PRESET_SIZE);
+	memcpy(bank, &header, sizeof(header));
+	int i = 0, count = 0;
+	uint8_t *image = NULL;
+	for(i=1; i<=DNAFX_PRESETS_NUM; i++) {
+		image = dnafx_preset_slot_image(i);
+		if(image == NULL)
+			continue;
+		bank[DNAFX_BANK_INDEX + i - 1] = 1;
+		memcpy(bank + DNAFX_BANK_IMAGES + (i-1)*DNAFX_PRESET_SIZE, image, DNAFX_PRESET_SIZE);
+		count++;
+	}
+	/* This writes to a temporary file first, and then renames it */
+	GError *error = NULL;
+	if(!g_file_set_contents(filename, (const gchar *)bank, DNAFX_BANK_SIZE, &error)) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Error saving bank %s: %s\n", filename,
+			error && error->message ? error->message : "??");
+		g_clear_error(&error);
+		g_free(bank);
+		return -1;
+	}
+	g_free(bank);
+	DNAFX_LOG(DNAFX_LOG_INFO, "Saved %d presets to bank %s\n", count, filename);
+	return count;
+}
+
+/* Helper to map a bank file and check it's valid */
+static const uint8_t *dnafx_bank_map(const char *filename, GMappedFile **file) {
+	GError *error = NULL;
+	*file = g_mapped_file_new(filename, FALSE, &error);
+	if(*file == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Error opening bank %s: %s\n", filename,
+			error && error->message ? error->message : "??");
+		g_clear_error(&error);
+		return NULL;
+	}
+	const uint8_t *bank = (const uint8_t *)g_mapped_file_get_contents(*file);
+	size_t size = g_mapped_file_get_length(*file);
+	dnafx_bank_header header;
+	if(bank == NULL || size < sizeof(header)) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid bank %s (too short)\n", filename);
+		goto error;
+	}
+	memcpy(&header, bank, sizeof(header));
+	if(memcmp(header.magic, DNAFX_BANK_MAGIC, sizeof(header.magic))) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid bank %s (not a bank file)\n", filename);
+		goto error;
+	}
+	if(GUINT16_FROM_LE(header.version) != DNAFX_BANK_VERSION ||
+			GUINT16_FROM_LE(header.slots) != DNAFX_PRESETS_NUM ||
+			GUINT16_FROM_LE(header.image_size) != DNAFX_PRESET_SIZE) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Unsupported bank %s (version %"SCNu16", %"SCNu16" slots of %"SCNu16" bytes)\n",
+			filename, GUINT16_FROM_LE(header.version), GUINT16_FROM_LE(header.slots),
+			GUINT16_FROM_LE(header.image_size));
+		goto error;
+	}
+	if(size < DNAFX_BANK_SIZE) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid bank %s (truncated, %zu/%zu bytes)\n",
+			filename, size, (size_t)DNAFX_BANK_SIZE);
+		goto error;
+	}
+	return bank;
+
+error:
+	g_mapped_file_unref(*file);
+	*file = NULL;
+	return NULL;
+}
+
+int dnafx_bank_load(const char *filename) {
+	if(filename == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return -1;
+	}
+	GMappedFile *file = NULL;
+	const uint8_t *bank = dnafx_bank_map(filename, &file);
+	if(bank == NULL)
+		return -1;
+	/* Add all the presets in the bank to the library */
+	int i = 0, count = 0;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		if(!bank[DNAFX_BANK_INDEX + i])
+			continue;
+		if(dnafx_preset_add_image(bank + DNAFX_BANK_IMAGES + i*DNAFX_PRESET_SIZE, FALSE) != DNAFX_STORE_INVALID)
+			count++;
+	}
+	g_mapped_file_unref(file);
+	DNAFX_LOG(DNAFX_LOG_INFO, "Loaded %d presets from bank %s\n", count, filename);
+	return count;
+}
+
+GByteArray *dnafx_bank_images(const char *filename) {
+	if(filename == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return NULL;
+	}
+	GMappedFile *file = NULL;
+	const uint8_t *bank = dnafx_bank_map(filename, &file);
+	if(bank == NULL)
+		return NULL;
+	GByteArray *images = g_byte_array_sized_new(DNAFX_PRESETS_NUM * DNAFX_PRESET_SIZE);
+	int i = 0;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		if(!bank[DNAFX_BANK_INDEX + i])
+			continue;
+		g_byte_array_append(images, bank + DNAFX_BANK_IMAGES + i*DNAFX_PRESET_SIZE, DNAFX_PRESET_SIZE);
+		/* Make sure the image targets the slot it was in */
+		images->data[images->len - DNAFX_PRESET_SIZE] = i + 1;
+	}
+	g_mapped_file_unref(file);
+	return images;
+}
@@ -0,0 +1,22 @@
+#ifndef DNAFX_BANK
+#define DNAFX_BANK
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+/* A bank file contains all the device slots in a single file: a small
+ * header, an index telling which slots are filled, and the 184 bytes
+ * wire images of all slots packed one after the other (empty slots are
+ * all zeroes), which means it can be mapped and used as it is */
+#define DNAFX_BANK_MAGIC		"DNAFXBNK"
+#define DNAFX_BANK_VERSION		1
+
+/* Saving and loading banks */
+int dnafx_bank_save(const char *filename);
+int dnafx_bank_load(const char *filename);
+/* Wire images of the filled slots in a bank, with the slot as first byte */
+GByteArray *dnafx_bank_images(const char *filename);
+
+#endif
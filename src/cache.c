@@ -0,0 +1,284 @@
+#include <string.h>
+#include <errno.h>
+
+#include "cache.h"
+#include "presets.h"
+#include "utils.h"
+#include "debug.h"
+
+/* Cache file header (all integers are little endian), followed by the
+ * info block, the extras, an index of filled slots and all the images */
+typedef struct dnafx_cache_header {
+	char magic[8];
+	uint16_t version;
+	uint16_t slots;
+	uint16_t image_size;
+	uint16_t extras;
+} dnafx_cache_header;
+#define DNAFX_CACHE_INFO		sizeof(dnafx_cache_header)
+#define DNAFX_CACHE_EXTRAS_OFF	(DNAFX_CACHE_INFO + DNAFX_CACHE_INFO_SIZE)
+#define DNAFX_CACHE_INDEX		(DNAFX_CACHE_EXTRAS_OFF + DNAFX_CACHE_EXTRAS * DNAFX_CACHE_EXTRA_SIZE)
+#define DNAFX_CACHE_IMAGES		(DNAFX_CACHE_INDEX + DNAFX_PRESETS_NUM)
+#define DNAFX_CACHE_SIZE		(DNAFX_CACHE_IMAGES + DNAFX_PRESETS_NUM * DNAFX_PRESET_SIZE)
+
+/* Our copy of the state, as we last saw it */
+static struct {
+	char *folder, *filename;
+	gboolean loaded, invalidated, extras_changed;
+	/* Slots that changed since they were cached, once the device answers */
+	json_t *changes;
+	uint8_t info[DNAFX_CACHE_INFO_SIZE];
+	int extras;
+	uint8_t extra[DNAFX_CACHE_EXTRAS][DNAFX_CACHE_EXTRA_SIZE];
+	gboolean filled[DNAFX_PRESETS_NUM];
+	uint8_t images[DNAFX_PRESETS_NUM][DNAFX_PRESET_SIZE];
+} cache;
+
+/* Cache management */
+int dnafx_cache_init(const char *folder) {
+	memset(&cache, 0, sizeof(cache));
+	if(folder == NULL)
+		return 0;
+	if(dnafx_mkdir(folder, 0755) < 0) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "mkdir (%s) error: %d (%s)\n", folder, errno, g_strerror(errno));
+		return -1;
+	}
+	cache.folder = g_strdup(folder);
+	DNAFX_LOG(DNAFX_LOG_INFO, "Device cache folder: %s\n", cache.folder);
+	return 0;
+}
+
+void dnafx_cache_deinit(void) {
+	if(cache.changes != NULL)
+		json_decref(cache.changes);
+	g_free(cache.folder);
+	g_free(cache.filename);
+	memset(&cache, 0, sizeof(cache));
+}
+
+/* Helper to only keep characters that are safe in a file name */
+static void dnafx_cache_safe_name(const char *id, char *name, size_t len) {
+	size_t i = 0;
+	for(i=0; id[i] && i<len-1; i++)
+		name[i] = g_ascii_isalnum(id[i]) ? id[i] : '_';
+	name[i] = '\0';
+}
+
+void dnafx_cache_set_device(const char *serial, const char *product, const char *firmware) {
+	if(cache.folder == NULL)
+		return;
+	/* A different firmware means a different cache, presets may differ */
+	char name[64], version[16];
+	dnafx_cache_safe_name(serial ? serial : (product ? product : "device"), name, sizeof(name));
+	dnafx_cache_safe_name(firmware ? firmware : "0", version, sizeof(version));
+	g_free(cache.filename);
+	char *file = g_strdup_printf("dnafx-%s-%s.cache", name, version);
+	cache.filename = g_build_filename(cache.folder, file, NULL);
+	g_free(file);
+	DNAFX_LOG(DNAFX_LOG_VERB, "Device cache file: %s\n", cache.filename);
+}
+
+/* Helper to write the current state to the cache file */
+static void dnafx_cache_save(void) {
+	if(cache.filename == NULL)
+		return;
+	uint8_t *data = g_malloc0(DNAFX_CACHE_SIZE);
+	dnafx_cache_header header = { 0 };
+	memcpy(header.magic, DNAFX_CACHE_MAGIC, sizeof(header.magic));
+	header.version = GUINT16_TO_LE(DNAFX_CACHE_VERSION);
+	header.slots = GUINT16_TO_LE(DNAFX_PRESETS_NUM);
+	header.image_size = GUINT16_TO_LE(DNAFX_PRESET_SIZE);
+	header.extras = GUINT16_TO_LE(cache.extras);
+	memcpy(data, &header, sizeof(header));
+	memcpy(data + DNAFX_CACHE_INFO, cache.info, DNAFX_CACHE_INFO_SIZE);
+	memcpy(data + DNAFX_CACHE_EXTRAS_OFF, cache.extra, sizeof(cache.extra));
+	int i = 0;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		if(!cache.filled[i])
+			continue;
+		data[DNAFX_CACHE_INDEX + i] = 1;
+		memcpy(data + DNAFX_CACHE_IMAGES + i*DNAFX_PRESET_SIZE, cache.images[i], DNAFX_PRESET_SIZE);
+	}
+	GError *error = NULL;
+	if(!g_file_set_contents(cache.filename, (const gchar *)data, DNAFX_CACHE_SIZE, &error)) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "Error saving device cache %s: %s\n", cache.filename,
+			error && error->message ? error->message : "??");
+		g_clear_error(&error);
+	}
+	g_free(data);
+}
+
+/* Helper to print the info block, as we do when we get it from the device */
+static void dnafx_cache_print_info(const uint8_t *info) {
+	DNAFX_LOG(DNAFX_LOG_INFO, "  -- %.*s\n", 31, (const char *)info);
+	DNAFX_LOG(DNAFX_LOG_INFO, "  -- %.*s\n", 6, (const char *)info + 32);
+	DNAFX_LOG(DNAFX_LOG_INFO, "  -- %.*s\n", 6, (const char *)info + 39);
+	DNAFX_LOG(DNAFX_LOG_INFO, "  -- %.*s\n", 6, (const char *)info + 46);
+}
+
+int dnafx_cache_load(void) {
+	if(cache.filename == NULL)
+		return -1;
+	gchar *data = NULL;
+	gsize len = 0;
+	if(!g_file_get_contents(cache.filename, &data, &len, NULL)) {
+		DNAFX_LOG(DNAFX_LOG_INFO, "No cached state for this device yet\n");
+		return 0;
+	}
+	dnafx_cache_header header;
+	if(len != DNAFX_CACHE_SIZE) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "Invalid device cache %s (%zu/%zu bytes)\n",
+			cache.filename, (size_t)len, (size_t)DNAFX_CACHE_SIZE);
+		g_free(data);
+		return -1;
+	}
+	memcpy(&header, data, sizeof(header));
+	if(memcmp(header.magic, DNAFX_CACHE_MAGIC, sizeof(header.magic)) ||
+			GUINT16_FROM_LE(header.version) != DNAFX_CACHE_VERSION ||
+			GUINT16_FROM_LE(header.slots) != DNAFX_PRESETS_NUM ||
+			GUINT16_FROM_LE(header.image_size) != DNAFX_PRESET_SIZE ||
+			GUINT16_FROM_LE(header.extras) > DNAFX_CACHE_EXTRAS) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "Unsupported device cache %s\n", cache.filename);
+		g_free(data);
+		return -1;
+	}
+	const uint8_t *bytes = (const uint8_t *)data;
+	memcpy(cache.info, bytes + DNAFX_CACHE_INFO, DNAFX_CACHE_INFO_SIZE);
+	cache.extras = GUINT16_FROM_LE(header.extras);
+	memcpy(cache.extra, bytes + DNAFX_CACHE_EXTRAS_OFF, sizeof(cache.extra));
+	int i = 0, count = 0;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		cache.filled[i] = (bytes[DNAFX_CACHE_INDEX + i] != 0);
+		if(!cache.filled[i])
+			continue;
+		memcpy(cache.images[i], bytes + DNAFX_CACHE_IMAGES + i*DNAFX_PRESET_SIZE, DNAFX_PRESET_SIZE);
+		if(dnafx_preset_put_image(i + 1, cache.images[i]) == 0)
+			count++;
+	}
+	g_free(data);
+	cache.loaded = TRUE;
+	/* Serve what we know right away */
+	DNAFX_LOG(DNAFX_LOG_INFO, "Cached device state (%d presets, %d extras):\n", count, cache.extras);
+	dnafx_cache_print_info(cache.info);
+	for(i=0; i<cache.extras; i++)
+		DNAFX_LOG(DNAFX_LOG_INFO, "  -- %.*s\n", DNAFX_CACHE_EXTRA_SIZE, (const char *)cache.extra[i]);
+	return count;
+}
+
+gboolean dnafx_cache_is_warm(void) {
+	return cache.loaded;
+}
+
+json_t *dnafx_cache_status(void) {
+	json_t *status = json_object();
+	json_object_set_new(status, "enabled", json_boolean(cache.folder != NULL));
+	json_object_set_new(status, "warm", json_boolean(cache.loaded));
+	if(cache.invalidated)
+		json_object_set_new(status, "invalidated", json_true());
+	/* Until the device answers, we don't know what changed yet */
+	json_object_set_new(status, "revalidated", json_boolean(cache.changes != NULL));
+	if(cache.changes != NULL)
+		json_object_set(status, "changes", cache.changes);
+	if(cache.extras_changed)
+		json_object_set_new(status, "extras-changed", json_true());
+	return status;
+}
+
+/* Update the cached state with what we just got from the device */
+void dnafx_cache_update_info(const uint8_t *info, size_t len) {
+	if(info == NULL)
+		return;
+	uint8_t block[DNAFX_CACHE_INFO_SIZE] = { 0 };
+	memcpy(block, info, MIN(len, sizeof(block)));
+	if(!memcmp(block, cache.info, sizeof(block)))
+		return;
+	if(cache.loaded) {
+		/* What we cached can't be trusted anymore, start from scratch */
+		DNAFX_LOG(DNAFX_LOG_WARN, "The device info changed since it was cached (firmware update?), invalidating the cache\n");
+		int i = 0;
+		const uint8_t *image = NULL;
+		for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+			/* Don't keep serving the presets we put in the slots when loading */
+			image = dnafx_preset_slot_image(i + 1);
+			if(cache.filled[i] && image != NULL && !memcmp(image + 1, cache.images[i] + 1, DNAFX_PRESET_SIZE - 1))
+				dnafx_preset_clear_slot(i + 1);
+		}
+		cache.loaded = FALSE;
+		cache.invalidated = TRUE;
+		cache.extras = 0;
+		memset(cache.extra, 0, sizeof(cache.extra));
+		memset(cache.filled, 0, sizeof(cache.filled));
+		memset(cache.images, 0, sizeof(cache.images));
+	}
+	memcpy(cache.info, block, sizeof(block));
+	dnafx_cache_save();
+}
+
+static json_t *dnafx_cache_update_slots(gboolean report) {
+	int i = 0, changed = 0;
+	const uint8_t *image = NULL;
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	/* Only report what's different from what we had cached */
+	json_t *changes = (cache.loaded && report) ? json_array() : NULL, *change = NULL;
+	const char *what = NULL;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		image = dnafx_preset_slot_image(i + 1);
+		if(image == NULL && !cache.filled[i])
+			continue;
+		if(image != NULL && cache.filled[i] && !memcmp(image + 1, cache.images[i] + 1, DNAFX_PRESET_SIZE - 1))
+			continue;
+		changed++;
+		if(changes != NULL) {
+			dnafx_preset_image_name(image ? image : cache.images[i], name, sizeof(name));
+			what = image == NULL ? "removed" : (cache.filled[i] ? "modified" : "added");
+			DNAFX_LOG(DNAFX_LOG_INFO, "  -- [%03d] %-14s %s since it was cached\n", i + 1, name, what);
+			change = json_object();
+			json_object_set_new(change, "slot", json_integer(i + 1));
+			json_object_set_new(change, "name", json_string(name));
+			json_object_set_new(change, "change", json_string(what));
+			json_array_append_new(changes, change);
+		}
+		cache.filled[i] = (image != NULL);
+		if(image != NULL)
+			memcpy(cache.images[i], image, DNAFX_PRESET_SIZE);
+		else
+			memset(cache.images[i], 0, DNAFX_PRESET_SIZE);
+	}
+	if(changes != NULL) {
+		if(changed == 0)
+			DNAFX_LOG(DNAFX_LOG_INFO, "  -- Presets on the device match the cached ones\n");
+		/* Keep track of what changed, for whoever asks later */
+		if(cache.changes != NULL)
+			json_decref(cache.changes);
+		cache.changes = json_incref(changes);
+	}
+	if(changed > 0)
+		dnafx_cache_save();
+	return changes;
+}
+
+json_t *dnafx_cache_update_presets(void) {
+	return dnafx_cache_update_slots(TRUE);
+}
+
+void dnafx_cache_update_uploads(void) {
+	dnafx_cache_update_slots(FALSE);
+}
+
+void dnafx_cache_update_extras(const uint8_t *extras, int count) {
+	if(extras == NULL || count < 0)
+		return;
+	if(count > DNAFX_CACHE_EXTRAS)
+		count = DNAFX_CACHE_EXTRAS;
+	uint8_t block[DNAFX_CACHE_EXTRAS][DNAFX_CACHE_EXTRA_SIZE] = {{ 0 }};
+	memcpy(block, extras, count * DNAFX_CACHE_EXTRA_SIZE);
+	if(count == cache.extras && !memcmp(block, cache.extra, sizeof(block)))
+		return;
+	if(cache.loaded) {
+		DNAFX_LOG(DNAFX_LOG_INFO, "  -- Extras changed since they were cached (%d -> %d)\n", cache.extras, count);
+		cache.extras_changed = TRUE;
+	}
+	cache.extras = count;
+	memcpy(cache.extra, block, sizeof(block));
+	dnafx_cache_save();
+}
@@ -0,0 +1,46 @@
+#ifndef DNAFX_CACHE
+#define DNAFX_CACHE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <glib.h>
+#include <jansson.h>
+
+/* The last known state of a device (the info we get when initializing
+ * it, all the presets and the extras) can be cached to a file, named
+ * after the serial number and firmware version of the device, which is
+ * updated any time we retrieve that state again, or upload presets. At
+ * startup the cached state can be served right away (warm start), while
+ * the device is queried again as usual: requests that only need local
+ * state don't wait for that, and when the actual state arrives, what
+ * changed is kept track of, for whoever asks */
+#define DNAFX_CACHE_MAGIC		"DNAFXCCH"
+#define DNAFX_CACHE_VERSION		1
+#define DNAFX_CACHE_INFO_SIZE	64
+#define DNAFX_CACHE_EXTRAS		20
+#define DNAFX_CACHE_EXTRA_SIZE	16
+
+/* Cache management */
+int dnafx_cache_init(const char *folder);
+void dnafx_cache_deinit(void);
+
+/* Which device we're talking to, from its USB descriptors */
+void dnafx_cache_set_device(const char *serial, const char *product, const char *firmware);
+/* Load the cached state of the device, and put the presets in their
+ * slots, returning how many presets were loaded (or -1 on errors) */
+int dnafx_cache_load(void);
+/* Whether the cached state is what we're serving (warm start) */
+gboolean dnafx_cache_is_warm(void);
+/* What we know about the cached state, and what the device changed */
+json_t *dnafx_cache_status(void);
+
+/* Update the cached state with what we just got from the device */
+void dnafx_cache_update_info(const uint8_t *info, size_t len);
+/* Returns the slots that changed since they were cached, if warm */
+json_t *dnafx_cache_update_presets(void);
+/* Same as above, but silently, after we uploaded presets ourselves */
+void dnafx_cache_update_uploads(void);
+void dnafx_cache_update_extras(const uint8_t *extras, int count);
+
+#endif
@@ -0,0 +1,340 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "diff.h"
+#include "bank.h"
+#include "presets.h"
+#include "session.h"
+#include "debug.h"
+
+/* The slots of one side of the diff */
+typedef struct dnafx_diff_side {
+	const uint8_t *slots[DNAFX_PRESETS_NUM];
+	GByteArray *images;
+} dnafx_diff_side;
+
+static int dnafx_diff_load(const char *source, dnafx_diff_side *side) {
+	memset(side, 0, sizeof(*side));
+	int i = 0;
+	if(!strcasecmp(source, "device")) {
+		/* No copies needed, we use the images in the store */
+		for(i=0; i<DNAFX_PRESETS_NUM; i++)
+			side->slots[i] = dnafx_preset_slot_image(i + 1);
+		return 0;
+	}
+	if(!strcasecmp(source, "session")) {
+		/* The device presets, as changed in the edit session */
+		for(i=0; i<DNAFX_PRESETS_NUM; i++)
+			side->slots[i] = dnafx_session_slot_image(i + 1);
+		return 0;
+	}
+	if(g_file_test(source, G_FILE_TEST_IS_DIR))
+		side->images = dnafx_presets_folder_images(source);
+	else
+		side->images = dnafx_bank_images(source);
+	if(side->images == NULL)
+		return -1;
+	const uint8_t *image = NULL;
+	guint offset = 0;
+	for(offset=0; offset + DNAFX_PRESET_SIZE <= side->images->len; offset += DNAFX_PRESET_SIZE) {
+		image = side->images->data + offset;
+		if(image[0] >= 1 && image[0] <= DNAFX_PRESETS_NUM)
+			side->slots[image[0]-1] = image;
+	}
+	return 0;
+}
+
+json_t *dnafx_diff(const char *from, const char *to) {
+	if(from == NULL || to == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return NULL;
+	}
+	gint64 start = g_get_monotonic_time();
+	dnafx_diff_side a, b;
+	if(dnafx_diff_load(from, &a) < 0)
+		return NULL;
+	if(dnafx_diff_load(to, &b) < 0) {
+		if(a.images != NULL)
+			g_byte_array_unref(a.images);
+		return NULL;
+	}
+	json_t *result = json_object();
+	json_t *slots = json_array();
+	int i = 0, same = 0;
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		const uint8_t *ia = a.slots[i], *ib = b.slots[i];
+		/* Identical images (or the same record) are skipped right away */
+		if(ia == ib || (ia != NULL && ib != NULL && !memcmp(ia + 1, ib + 1, DNAFX_PRESET_SIZE - 1))) {
+			if(ia != NULL)
+				same++;
+			continue;
+		}
+		json_t *slot = NULL;
+		if(ia == NULL || ib == NULL) {
+			slot = json_object();
+			json_object_set_new(slot, "change", json_string(ia == NULL ? "added" : "removed"));
+			dnafx_preset_image_name(ia ? ia : ib, name, sizeof(name));
+			json_object_set_new(slot, "name", json_string(name));
+		} else {
+			slot = dnafx_preset_image_diff(ia, ib);
+			json_object_set_new(slot, "change", json_string("modified"));
+			if(json_object_get(slot, "name") == NULL) {
+				dnafx_preset_image_name(ia, name, sizeof(name));
+				json_object_set_new(slot, "name", json_string(name));
+			}
+		}
+		json_object_set_new(slot, "slot", json_integer(i + 1));
+		json_array_append_new(slots, slot);
+	}
+	if(a.images != NULL)
+		g_byte_array_unref(a.images);
+	if(b.images != NULL)
+		g_byte_array_unref(b.images);
+	json_object_set_new(result, "from", json_string(from));
+	json_object_set_new(result, "to", json_string(to));
+	json_object_set_new(result, "same", json_integer(same));
+	json_object_set_new(result, "changed", json_integer(json_array_size(slots)));
+	json_object_set_new(result, "slots", slots);
+	json_object_set_new(result, "elapsed-us", json_integer(g_get_monotonic_time() - start));
+	return result;
+}
+
+json_t *dnafx_diff_sync(const char *source, GByteArray **uploads) {
+	if(source == NULL || uploads == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return NULL;
+	}
+	*uploads = NULL;
+	dnafx_diff_side desired;
+	if(dnafx_diff_load(source, &desired) < 0)
+		return NULL;
+	/* Only slots that differ from what we know the device has need an
+	 * upload: we go through them in order, so it's a single batch */
+	*uploads = g_byte_array_new();
+	json_t *report = json_object();
+	json_t *slots = json_array();
+	int i = 0, unchanged = 0, unknown = 0;
+	const uint8_t *device = NULL;
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		if(desired.slots[i] == NULL)
+			continue;
+		device = dnafx_preset_slot_image(i + 1);
+		if(device != NULL && !memcmp(device + 1, desired.slots[i] + 1, DNAFX_PRESET_SIZE - 1)) {
+			unchanged++;
+			continue;
+		}
+		if(device == NULL)
+			unknown++;
+		g_byte_array_append(*uploads, desired.slots[i], DNAFX_PRESET_SIZE);
+		(*uploads)->data[(*uploads)->len - DNAFX_PRESET_SIZE] = i + 1;
+		json_t *slot = json_object();
+		json_object_set_new(slot, "slot", json_integer(i + 1));
+		dnafx_preset_image_name(desired.slots[i], name, sizeof(name));
+		json_object_set_new(slot, "name", json_string(name));
+		if(device != NULL) {
+			dnafx_preset_image_name(device, name, sizeof(name));
+			json_object_set_new(slot, "replaces", json_string(name));
+		}
+		json_array_append_new(slots, slot);
+	}
+	if(desired.images != NULL)
+		g_byte_array_unref(desired.images);
+	if(unknown > 0) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "We don't know what's in %d of the slots to sync, did you retrieve the presets first?\n", unknown);
+	}
+	json_object_set_new(report, "source", json_string(source));
+	json_object_set_new(report, "unchanged", json_integer(unchanged));
+	json_object_set_new(report, "uploads", slots);
+	return report;
+}
+
+/* Permutations */
+static void dnafx_diff_identity(int *target) {
+	int i = 0;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++)
+		target[i] = i + 1;
+}
+
+int dnafx_diff_move(int *target, int from, int to, int count) {
+	if(target == NULL || count < 1 || from < 1 || to < 1 ||
+			from + count - 1 > DNAFX_PRESETS_NUM || to + count - 1 > DNAFX_PRESETS_NUM) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return -1;
+	}
+	/* Take the block out, and insert it back where it should start:
+	 * the presets in between shift to fill the gap it left */
+	int order[DNAFX_PRESETS_NUM];
+	int i = 0, n = 0;
+	for(i=1; i<=DNAFX_PRESETS_NUM; i++) {
+		if(i < from || i >= from + count)
+			order[n++] = i;
+	}
+	memmove(order + to - 1 + count, order + to - 1, (n - (to - 1)) * sizeof(int));
+	for(i=0; i<count; i++)
+		order[to - 1 + i] = from + i;
+	memcpy(target, order, sizeof(order));
+	return 0;
+}
+
+int dnafx_diff_swap(int *target, int a, int b) {
+	if(target == NULL || a < 1 || a > DNAFX_PRESETS_NUM || b < 1 || b > DNAFX_PRESETS_NUM) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return -1;
+	}
+	dnafx_diff_identity(target);
+	target[a-1] = b;
+	target[b-1] = a;
+	return 0;
+}
+
+int dnafx_diff_reorder(int *target, const char *slots) {
+	if(target == NULL || slots == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return -1;
+	}
+	dnafx_diff_identity(target);
+	/* The listed slots, in the order we want, go to the same slots sorted */
+	gboolean listed[DNAFX_PRESETS_NUM] = { 0 };
+	int order[DNAFX_PRESETS_NUM];
+	int i = 0, n = 0, slot = 0;
+	char **list = g_strsplit_set(slots, " ,", -1);
+	for(i=0; list[i] != NULL; i++) {
+		if(*list[i] == '\0')
+			continue;
+		slot = atoi(list[i]);
+		if(slot < 1 || slot > DNAFX_PRESETS_NUM || listed[slot-1]) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Invalid or repeated slot '%s'\n", list[i]);
+			g_strfreev(list);
+			return -1;
+		}
+		listed[slot-1] = TRUE;
+		order[n++] = slot;
+	}
+	g_strfreev(list);
+	int next = 0;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		if(listed[i])
+			target[i] = order[next++];
+	}
+	return n > 0 ? 0 : -1;
+}
+
+json_t *dnafx_diff_permute(const int *target, GByteArray **uploads) {
+	if(target == NULL || uploads == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return NULL;
+	}
+	*uploads = NULL;
+	int i = 0, unknown = 0;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		if(target[i] < 1 || target[i] > DNAFX_PRESETS_NUM) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Invalid permutation\n");
+			return NULL;
+		}
+		if(target[i] != i + 1 && (dnafx_preset_slot_image(i + 1) == NULL || dnafx_preset_slot_image(target[i]) == NULL))
+			unknown++;
+	}
+	if(unknown > 0) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "We don't know what's in %d of the slots to reorder, did you retrieve the presets first?\n", unknown);
+		return NULL;
+	}
+	/* Each cycle is uploaded in one go: we take the images from the store
+	 * before we start, so no slot needs to be parked anywhere meanwhile.
+	 * Fixed points and slots that end up with the same content are skipped */
+	*uploads = g_byte_array_new();
+	json_t *report = json_object();
+	json_t *cycles = json_array();
+	json_t *slots = json_array();
+	gboolean visited[DNAFX_PRESETS_NUM] = { 0 };
+	int slot = 0, unchanged = 0;
+	const uint8_t *image = NULL, *current = NULL;
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		if(visited[i])
+			continue;
+		if(target[i] == i + 1) {
+			visited[i] = TRUE;
+			continue;
+		}
+		json_t *cycle = json_array();
+		for(slot=i+1; !visited[slot-1]; slot=target[slot-1]) {
+			visited[slot-1] = TRUE;
+			json_array_append_new(cycle, json_integer(slot));
+			image = dnafx_preset_slot_image(target[slot-1]);
+			current = dnafx_preset_slot_image(slot);
+			if(!memcmp(image + 1, current + 1, DNAFX_PRESET_SIZE - 1)) {
+				unchanged++;
+				continue;
+			}
+			g_byte_array_append(*uploads, image, DNAFX_PRESET_SIZE);
+			(*uploads)->data[(*uploads)->len - DNAFX_PRESET_SIZE] = slot;
+			json_t *upload = json_object();
+			json_object_set_new(upload, "slot", json_integer(slot));
+			json_object_set_new(upload, "from", json_integer(target[slot-1]));
+			dnafx_preset_image_name(image, name, sizeof(name));
+			json_object_set_new(upload, "name", json_string(name));
+			dnafx_preset_image_name(current, name, sizeof(name));
+			json_object_set_new(upload, "replaces", json_string(name));
+			json_array_append_new(slots, upload);
+		}
+		json_array_append_new(cycles, cycle);
+	}
+	json_object_set_new(report, "unchanged", json_integer(DNAFX_PRESETS_NUM - json_array_size(slots)));
+	json_object_set_new(report, "same-content", json_integer(unchanged));
+	json_object_set_new(report, "cycles", cycles);
+	json_object_set_new(report, "uploads", slots);
+	return report;
+}
+
+/* Helper to print a "from -> to" change */
+static void dnafx_diff_print_change(GString *line, const char *what, json_t *change) {
+	json_t *from = json_object_get(change, "from"), *to = json_object_get(change, "to");
+	if(json_is_string(from)) {
+		g_string_append_printf(line, "%s%s '%s' -> '%s'", line->len ? ", " : "", what,
+			json_string_value(from), json_string_value(to));
+	} else {
+		g_string_append_printf(line, "%s%s %"JSON_INTEGER_FORMAT" -> %"JSON_INTEGER_FORMAT, line->len ? ", " : "", what,
+			json_integer_value(from), json_integer_value(to));
+	}
+}
+
+void dnafx_diff_print(json_t *diff) {
+	if(diff == NULL)
+		return;
+	DNAFX_LOG(DNAFX_LOG_INFO, "Diff between %s and %s: %"JSON_INTEGER_FORMAT" slots changed, %"JSON_INTEGER_FORMAT" the same (%"JSON_INTEGER_FORMAT"us)\n",
+		json_string_value(json_object_get(diff, "from")), json_string_value(json_object_get(diff, "to")),
+		json_integer_value(json_object_get(diff, "changed")), json_integer_value(json_object_get(diff, "same")),
+		json_integer_value(json_object_get(diff, "elapsed-us")));
+	size_t i = 0, j = 0, k = 0;
+	json_t *slot = NULL, *section = NULL, *param = NULL, *change = NULL;
+	GString *line = g_string_new(NULL);
+	json_array_foreach(json_object_get(diff, "slots"), i, slot) {
+		change = json_object_get(slot, "name");
+		DNAFX_LOG(DNAFX_LOG_INFO, "   [%03d] %-14s %s\n", (int)json_integer_value(json_object_get(slot, "slot")),
+			json_string_value(json_is_object(change) ? json_object_get(change, "from") : change),
+			json_string_value(json_object_get(slot, "change")));
+		if(json_is_object(change)) {
+			g_string_truncate(line, 0);
+			dnafx_diff_print_change(line, "name", change);
+			DNAFX_LOG(DNAFX_LOG_INFO, "         %s\n", line->str);
+		}
+		json_array_foreach(json_object_get(slot, "sections"), j, section) {
+			g_string_truncate(line, 0);
+			if((change = json_object_get(section, "switch")) != NULL)
+				dnafx_diff_print_change(line, "switch", change);
+			if((change = json_object_get(section, "effect")) != NULL)
+				dnafx_diff_print_change(line, "effect", change);
+			json_array_foreach(json_object_get(section, "params"), k, param)
+				dnafx_diff_print_change(line, json_string_value(json_object_get(param, "param")), param);
+			DNAFX_LOG(DNAFX_LOG_INFO, "         %-8s %s\n", json_string_value(json_object_get(section, "section")), line->str);
+		}
+		g_string_truncate(line, 0);
+		json_array_foreach(json_object_get(slot, "expressions"), j, change)
+			dnafx_diff_print_change(line, json_string_value(json_object_get(change, "expression")), change);
+		if(line->len > 0)
+			DNAFX_LOG(DNAFX_LOG_INFO, "         %-8s %s\n", "EXP", line->str);
+	}
+	g_string_free(line, TRUE);
+}
@@ -0,0 +1,38 @@
+#ifndef DNAFX_DIFF
+#define DNAFX_DIFF
+
+#include <glib.h>
+#include <jansson.h>
+
+/* Differences between two sets of presets, slot by slot: each side can be
+ * "device" (the presets we retrieved from the device), "session" (the
+ * same, with the changes in the edit session), a bank file, or a folder
+ * of presets (e.g., the one we save presets to). Slots that have
+ * the same image on both sides are skipped without decoding anything,
+ * while for the others the result lists what changed, e.g.:
+ *
+ * 	{ "slot": 12, "change": "modified", "sections": [
+ * 		{ "section": "AMP", "params": [ { "param": "GAIN", "from": 50, "to": 70 } ] } ] }
+ *
+ * where change is one of "added", "removed" or "modified" */
+json_t *dnafx_diff(const char *from, const char *to);
+/* Compare a bank file or folder to what we last retrieved from the device,
+ * and return the images (with the slot as first byte) of the slots that
+ * need to be uploaded for the device to match, plus a report on them */
+json_t *dnafx_diff_sync(const char *source, GByteArray **uploads);
+/* Reordering the presets on the device: a permutation lists, for each
+ * slot, the slot whose preset should end up there. Permutations can be
+ * built out of a move (a block of slots moves to a new position, and the
+ * presets in between shift to make room), a swap, or a list of slots to
+ * put in that order (in the same slots, sorted, e.g., "7 3 5" puts 7 in
+ * 3, 3 in 5 and 5 in 7). The plan is split in cycles, using the images we
+ * retrieved from the device, and only slots whose content changes need
+ * an upload; the report lists the cycles and the uploads, as sync does */
+int dnafx_diff_move(int *target, int from, int to, int count);
+int dnafx_diff_swap(int *target, int a, int b);
+int dnafx_diff_reorder(int *target, const char *slots);
+json_t *dnafx_diff_permute(const int *target, GByteArray **uploads);
+/* Print a diff in a human readable format */
+void dnafx_diff_print(json_t *diff);
+
+#endif
@@ -14,10 +14,17 @@
 #include "usb.h"
 #include "tasks.h"
 #include "presets.h"
+#include "bank.h"
+#include "archive.h"
+#include "query.h"
+#include "cache.h"
+#include "session.h"
+#include "journal.h"
 #include "utils.h"
 #include "options.h"
 #include "embedded_cli.h"
 #include "httpws.h"
+#include "pipe.h"
 #include "debug.h"
 
 /* Command line options */
@@ -41,6 +48,9 @@ static struct embedded_cli cli = { 0 };
 static void dnafx_putch(void *data, char ch, bool is_last);
 static char dnafx_getch(void);
 
+/* Print handler used when stdout is taken (pipe mode) */
+static void dnafx_print_stderr(const gchar *string);
+
 /* Polling */
 #define DNAFX_POLL_TIMEOUT	250;
 
@@ -49,15 +59,11 @@ int main(int argc, char *argv[]) {
 	int res = 0;
 	dnafx_tasks_init();
 
-	DNAFX_PRINT("\nOpen source DNAfx GiT editor (experimental and WIP)\n\n");
-	DNAFX_PRINT("  ####################################################################\n");
-	DNAFX_PRINT("  #                                                                  #\n");
-	DNAFX_PRINT("  #  NOTE WELL: Not affiliated with, nor endorsed by, Harley Benton  #\n");
-	DNAFX_PRINT("  #                                                                  #\n");
-	DNAFX_PRINT("  ####################################################################\n\n");
-
 	/* Initialize some command line options defaults */
 	options.debug_level = DNAFX_LOG_INFO;
+	options.http_threads = 1;
+	options.http_queue_messages = DNAFX_HTTPWS_QUEUE_MESSAGES;
+	options.http_queue_bytes = DNAFX_HTTPWS_QUEUE_BYTES;
 	/* Let's call our cmdline parser */
 	if(!dnafx_options_parse(&options, argc, argv)) {
 		dnafx_options_show_usage();
@@ -65,6 +71,18 @@ int main(int argc, char *argv[]) {
 		res = 1;
 		goto done;
 	}
+	/* In pipe mode stdout is for presets only, so we log to stderr */
+	gboolean pipe_mode = (options.pipe_in != NULL || options.pipe_out != NULL);
+	if(pipe_mode) {
+		g_set_print_handler(dnafx_print_stderr);
+	} else {
+		DNAFX_PRINT("\nOpen source DNAfx GiT editor (experimental and WIP)\n\n");
+		DNAFX_PRINT("  ####################################################################\n");
+		DNAFX_PRINT("  #                                                                  #\n");
+		DNAFX_PRINT("  #  NOTE WELL: Not affiliated with, nor endorsed by, Harley Benton  #\n");
+		DNAFX_PRINT("  #                                                                  #\n");
+		DNAFX_PRINT("  ####################################################################\n\n");
+	}
 	/* Logging level */
 	dnafx_log_level = options.debug_level;
 	dnafx_log_timestamps = options.debug_timestamps;
@@ -76,6 +94,40 @@ int main(int argc, char *argv[]) {
 		goto done;
 	}
 
+	/* Device state cache */
+	if(options.warm_start && options.cache_folder == NULL) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "No cache folder, disabling warm start\n");
+		options.warm_start = FALSE;
+	}
+	if(!pipe_mode && dnafx_cache_init(options.cache_folder) < 0) {
+		res = 1;
+		goto done;
+	}
+
+	/* Journal of all uploads */
+	if(!pipe_mode && dnafx_journal_init(options.journal) < 0) {
+		res = 1;
+		goto done;
+	}
+
+	/* In pipe mode we just convert presets from stdin to stdout, and leave */
+	if(pipe_mode) {
+		res = dnafx_pipe_run(options.pipe_in, options.pipe_out) != 0 ? 1 : 0;
+		goto done;
+	}
+
+	/* Check if we need to import presets from a bank */
+	if(options.load_bank != NULL && dnafx_bank_load(options.load_bank) < 0) {
+		res = 1;
+		goto done;
+	}
+
+	/* Check if we need to import presets from an archive */
+	if(options.load_archive != NULL && dnafx_archive_load(options.load_archive) < 0) {
+		res = 1;
+		goto done;
+	}
+
 	/* Check if we need to parse a preset file */
 	if(options.preset_file_in != NULL && options.phb_file_in != NULL) {
 		DNAFX_LOG(DNAFX_LOG_FATAL, "Can't provide both binary and PHB file as preset input\n");
@@ -141,6 +193,12 @@ int main(int argc, char *argv[]) {
 		if(!options.no_get_presets) {
 			char *command[] = { "get-presets" };
 			dnafx_tasks_add(dnafx_task_new(1, command));
+			if(options.save_bank != NULL) {
+				char *save[] = { "save-bank", (char *)options.save_bank };
+				dnafx_tasks_add(dnafx_task_new(2, save));
+			}
+		} else if(options.save_bank != NULL) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Not retrieving presets, won't save a bank\n");
 		}
 		if(!options.no_get_extras) {
 			char *command[] = { "get-extras" };
@@ -172,7 +230,7 @@ int main(int argc, char *argv[]) {
 	if(options.interactive) {
 		char *command[] = { "cli" };
 		dnafx_tasks_add(dnafx_task_new(1, command));
-	} else if(options.http_port < 1) {
+	} else if(options.http_port < 1 && options.http_unix == NULL) {
 		char *command[] = { "quit" };
 		dnafx_tasks_add(dnafx_task_new(1, command));
 	}
@@ -182,7 +240,11 @@ int main(int argc, char *argv[]) {
 		DNAFX_LOG(DNAFX_LOG_WARN, "Invalid port '%d', disabling HTTP/WebSocket server\n", options.http_port);
 		options.http_port = 0;
 	}
-	dnafx_httpws_init(options.http_port);
+	if(dnafx_httpws_set_queue_limits(options.http_queue_messages,
+			options.http_queue_bytes, options.http_queue_policy) < 0) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "Keeping the default outgoing queue limits\n");
+	}
+	dnafx_httpws_init(options.http_port, options.http_unix, options.http_threads);
 
 	/* Handle SIGINT (CTRL-C), SIGTERM (from service managers) */
 	signal(SIGINT, dnafx_handle_signal);
@@ -193,6 +255,9 @@ int main(int argc, char *argv[]) {
 		res = 1;
 		goto done;
 	}
+	/* Serve the cached state right away: the startup tasks will revalidate it */
+	if(!options.offline && options.warm_start)
+		dnafx_cache_load();
 
 	/* Loop */
 	int fds_num = 0, i = 0, ret = 0, timeout = 0;
@@ -268,12 +333,17 @@ done:
 	dnafx_quit();
 	dnafx_httpws_deinit();
 	dnafx_tasks_deinit();
+	dnafx_query_deinit();
+	dnafx_session_discard();
+	dnafx_journal_deinit();
 	dnafx_presets_deinit();
+	dnafx_cache_deinit();
 	dnafx_usb_deinit();
 
 	/* Done */
+	if(options.pipe_in == NULL && options.pipe_out == NULL)
+		DNAFX_PRINT("\nBye!\n");
 	dnafx_options_destroy();
-	DNAFX_PRINT("\nBye!\n");
 	exit(res);
 }
 
@@ -286,6 +356,11 @@ void dnafx_cli(void) {
 	}
 }
 
+/* Print handler used when stdout is taken (pipe mode) */
+static void dnafx_print_stderr(const gchar *string) {
+	fputs(string, stderr);
+}
+
 /* Helper to output a single character to stdout (copied from the EmbeddedCLI example) */
 static void dnafx_putch(void *data, char ch, bool is_last) {
 	FILE *fp = data;
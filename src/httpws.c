@@ -1,3 +1,11 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+
 #include <libwebsockets.h>
 #include <glib.h>
 #include <jansson.h>
@@ -108,11 +116,23 @@ static const char *dnafx_httpws_error_str(dnafx_httpws_error type) {
 	}
 };
 
-/* libwebsockets WS context and thread */
+/* libwebsockets WS context and service threads */
 static const char *user_agent = "dnafx-editor/0.0.1";
 static struct lws_context *wsc = NULL;
-static GThread *ws_thread = NULL;
+#ifdef LWS_MAX_SMP
+#define DNAFX_HTTPWS_MAX_THREADS	LWS_MAX_SMP
+#else
+#define DNAFX_HTTPWS_MAX_THREADS	1
+#endif
+static int ws_threads_num = 0;
+static GThread *ws_threads[DNAFX_HTTPWS_MAX_THREADS];
 static void *dnafx_httpws_thread(void *data);
+#if (LWS_LIBRARY_VERSION_MAJOR == 3 && LWS_LIBRARY_VERSION_MINOR >= 2) || (LWS_LIBRARY_VERSION_MAJOR > 3)
+/* Since 3.2, 0 means waiting until the next event or scheduled timer */
+#define DNAFX_HTTPWS_SERVICE_TIMEOUT	0
+#else
+#define DNAFX_HTTPWS_SERVICE_TIMEOUT	1000
+#endif
 /* Callbacks for HTTP */
 static int dnafx_httpws_callback_http(struct lws *wsi,
 	enum lws_callback_reasons reason, void *user, void *in, size_t len);
@@ -123,21 +143,112 @@ static int dnafx_httpws_callback_ws(struct lws *wsi,
 /* JSON serialization options */
 static size_t json_format = JSON_PRESERVE_ORDER;
 
+/* Pooled I/O buffers: the payload always starts LWS_PRE bytes into the
+ * allocation, so that what we serialize there can be passed to lws_write
+ * as it is, without any further copy; buffers grow geometrically, and
+ * are recycled across requests and connections via a shared pool */
+typedef struct dnafx_httpws_buffer {
+	uint8_t *data;
+	size_t size;
+	size_t len;
+	/* When the task this is a response to completed, if any */
+	gint64 completed;
+	/* Request and arguments this is a response to (compact JSON), if any */
+	char *topic;
+} dnafx_httpws_buffer;
+#define DNAFX_HTTPWS_BUFFER_MIN		1024
+#define DNAFX_HTTPWS_BUFFER_POOLED	65536
+#define DNAFX_HTTPWS_POOL_SIZE		64
+static GQueue buffers_pool = G_QUEUE_INIT;
+static dnafx_mutex buffers_mutex = DNAFX_MUTEX_INITIALIZER;
+static dnafx_httpws_buffer *dnafx_httpws_buffer_get(void);
+static int dnafx_httpws_buffer_reserve(dnafx_httpws_buffer *buffer, size_t needed);
+static int dnafx_httpws_buffer_append(dnafx_httpws_buffer *buffer, const void *data, size_t len);
+static void dnafx_httpws_buffer_put(dnafx_httpws_buffer *buffer);
+#define DNAFX_HTTPWS_PAYLOAD(buffer) ((buffer)->data + LWS_PRE)
+
 /* Client session */
+struct dnafx_httpws_session;
 typedef struct dnafx_httpws_client {
 	struct lws *wsi;
+	struct dnafx_httpws_session *session;
 	gboolean websocket;
-	char *buffer;
-	size_t offset;
-	size_t size;
-	GAsyncQueue *outgoing;
-	unsigned char *outbuffer;
-	size_t outbuflen;
-	size_t outbufpending;
-	size_t outbufoffset;
+	dnafx_httpws_buffer *inbuf;
+	GQueue outgoing;
+	size_t outgoing_bytes;
+	gboolean overflow;
+	dnafx_httpws_buffer *outbuf;
+	size_t outoffset;
 } dnafx_httpws_client;
-static GHashTable *clients = NULL, *writable_clients = NULL;
+static void dnafx_httpws_client_enqueue(dnafx_httpws_client *client, dnafx_httpws_buffer *response);
+static dnafx_httpws_buffer *dnafx_httpws_client_dequeue(dnafx_httpws_client *client);
+/* Tasks don't reference clients directly, since the connection may go
+ * away before they complete: they reference a refcounted session, that
+ * knows which service thread owns the connection, and whose client is
+ * only set/cleared/accessed by that thread, which means no locking */
+typedef struct dnafx_httpws_session {
+	volatile gint refcount;
+	int tsi;
+	dnafx_httpws_client *client;
+} dnafx_httpws_session;
+static void dnafx_httpws_session_unref(dnafx_httpws_session *session);
+/* What a task triggered by the API carries as its context */
+typedef struct dnafx_httpws_request {
+	dnafx_httpws_session *session;
+	char *topic;
+} dnafx_httpws_request;
+
+/* Outgoing queues are bounded: what happens when a slow client exceeds
+ * its budget depends on the configured policy */
+typedef enum dnafx_httpws_overflow {
+	DNAFX_HTTPWS_OVERFLOW_DROP_OLDEST = 0,
+	DNAFX_HTTPWS_OVERFLOW_COALESCE,
+	DNAFX_HTTPWS_OVERFLOW_DISCONNECT,
+} dnafx_httpws_overflow;
+static const char *dnafx_httpws_overflow_str(dnafx_httpws_overflow policy) {
+	switch(policy) {
+		case DNAFX_HTTPWS_OVERFLOW_DROP_OLDEST:
+			return "drop-oldest";
+		case DNAFX_HTTPWS_OVERFLOW_COALESCE:
+			return "coalesce";
+		case DNAFX_HTTPWS_OVERFLOW_DISCONNECT:
+			return "disconnect";
+		default:
+			break;
+	}
+	return NULL;
+}
+static guint queue_max_messages = DNAFX_HTTPWS_QUEUE_MESSAGES;
+static size_t queue_max_bytes = DNAFX_HTTPWS_QUEUE_BYTES;
+static dnafx_httpws_overflow queue_policy = DNAFX_HTTPWS_OVERFLOW_DROP_OLDEST;
+static GHashTable *clients = NULL;
 static dnafx_mutex clients_mutex = DNAFX_MUTEX_INITIALIZER;
+static void dnafx_httpws_client_setup(dnafx_httpws_client *client, struct lws *wsi, gboolean websocket);
+static void dnafx_httpws_client_cleanup(dnafx_httpws_client *client);
+
+/* Completed tasks are handed to the service thread owning the connection
+ * via a lock-free, multiple producers/single consumer list per thread:
+ * producers push to the head, while the owner detaches the whole list
+ * at once when woken up, and delivers everything in a single batch */
+typedef struct dnafx_httpws_completion {
+	struct dnafx_httpws_completion *next;
+	dnafx_httpws_session *session;
+	dnafx_httpws_buffer *response;
+} dnafx_httpws_completion;
+static dnafx_httpws_completion *completions[DNAFX_HTTPWS_MAX_THREADS];
+static void dnafx_httpws_completions_drain(struct lws *wsi);
+
+/* Statistics (latency is from task completion to the last byte written) */
+static dnafx_mutex stats_mutex = DNAFX_MUTEX_INITIALIZER;
+static struct {
+	guint64 responses;
+	gint64 latency_total, latency_max;
+	guint64 wakeups, batched;
+	gint64 queued, queued_bytes;
+	guint64 queued_max;
+	guint64 dropped, coalesced, disconnected;
+} stats;
+static void dnafx_httpws_stats_sent(dnafx_httpws_buffer *response);
 
 /* Protocol mappings */
 #define WS_LIST_TERM 0, NULL, 0
@@ -202,49 +313,167 @@ static const char *dnafx_httpws_reason_string(enum lws_callback_reasons reason)
 }
 
 /* Server management */
-int dnafx_httpws_init(uint16_t port) {
-	if(port == 0)
+/* Outgoing queues budget and policy */
+int dnafx_httpws_set_queue_limits(int max_messages, int max_bytes, const char *policy) {
+	if(max_messages < 1 || max_bytes < 1) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid outgoing queue limits (%d messages, %d bytes)\n", max_messages, max_bytes);
+		return -1;
+	}
+	if(policy != NULL) {
+		if(!strcasecmp(policy, "drop-oldest")) {
+			queue_policy = DNAFX_HTTPWS_OVERFLOW_DROP_OLDEST;
+		} else if(!strcasecmp(policy, "coalesce")) {
+			queue_policy = DNAFX_HTTPWS_OVERFLOW_COALESCE;
+		} else if(!strcasecmp(policy, "disconnect")) {
+			queue_policy = DNAFX_HTTPWS_OVERFLOW_DISCONNECT;
+		} else {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Unsupported outgoing queue policy '%s'\n", policy);
+			return -1;
+		}
+	}
+	queue_max_messages = max_messages;
+	queue_max_bytes = max_bytes;
+	DNAFX_LOG(DNAFX_LOG_VERB, "Outgoing queues limited to %u messages and %zu bytes (%s)\n",
+		queue_max_messages, queue_max_bytes, dnafx_httpws_overflow_str(queue_policy));
+	return 0;
+}
+
+/* Path of the Unix domain socket, if any, to clean up when we're done */
+static char *unix_socket = NULL;
+#if defined(LWS_WITH_UNIX_SOCK)
+/* Helper to check if someone is still listening on a Unix domain socket */
+static gboolean dnafx_httpws_unix_in_use(const char *path) {
+	struct sockaddr_un addr = { 0 };
+	if(strlen(path) >= sizeof(addr.sun_path))
+		return FALSE;
+	addr.sun_family = AF_UNIX;
+	g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0)
+		return FALSE;
+	gboolean in_use = (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+	close(fd);
+	return in_use;
+}
+#endif
+
+/* How many service threads the libwebsockets we're built against supports */
+int dnafx_httpws_max_threads(void) {
+	return DNAFX_HTTPWS_MAX_THREADS;
+}
+
+int dnafx_httpws_init(uint16_t port, const char *unix_path, int threads) {
+	if(port == 0 && unix_path == NULL)
 		return 0;
-	DNAFX_LOG(DNAFX_LOG_INFO, "Starting HTTP/WebSocket server on port %"SCNu16"\n", port);
+#if !defined(LWS_WITH_UNIX_SOCK)
+	if(unix_path != NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "libwebsockets was built without Unix domain sockets support\n");
+		return -1;
+	}
+#endif
+	if(threads < 1) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "Invalid number of threads '%d', using 1\n", threads);
+		threads = 1;
+	} else if(threads > DNAFX_HTTPWS_MAX_THREADS) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "libwebsockets supports at most %d service threads, using that\n",
+			DNAFX_HTTPWS_MAX_THREADS);
+		threads = DNAFX_HTTPWS_MAX_THREADS;
+	}
+	if(port > 0) {
+		DNAFX_LOG(DNAFX_LOG_INFO, "Starting HTTP/WebSocket server on port %"SCNu16" (%d thread%s)\n",
+			port, threads, threads == 1 ? "" : "s");
+	}
+	if(unix_path != NULL) {
+		DNAFX_LOG(DNAFX_LOG_INFO, "Starting HTTP/WebSocket server on Unix socket %s (%d thread%s)\n",
+			unix_path, threads, threads == 1 ? "" : "s");
+	}
 	/* Initialize hashtables and mutex */
 	clients = g_hash_table_new(NULL, NULL);
-	writable_clients = g_hash_table_new(NULL, NULL);
+	memset(completions, 0, sizeof(completions));
+	int i = 0;
 	/* Logging */
 	lws_set_log_level(ws_log_level, dnafx_httpws_log_emit_function);
 	/* Prepare the common context */
 	struct lws_context_creation_info wscinfo;
 	memset(&wscinfo, 0, sizeof wscinfo);
 	wscinfo.options |= LWS_SERVER_OPTION_EXPLICIT_VHOSTS;
-	wscinfo.count_threads = 1;
+	wscinfo.count_threads = threads;
 	/* Create the base context */
 	wsc = lws_create_context(&wscinfo);
 	if(wsc == NULL) {
 		DNAFX_LOG(DNAFX_LOG_ERR, "Error creating libwebsockets context\n");
 		return -1;
 	}
-	/* Prepare the server context */
-	struct lws_context_creation_info info = { 0 };
-	info.port = port;
-	info.protocols = protocols;
-	info.gid = -1;
-	info.uid = -1;
+	if(port > 0) {
+		/* Prepare the server context */
+		struct lws_context_creation_info info = { 0 };
+		info.port = port;
+		info.protocols = protocols;
+		info.gid = -1;
+		info.uid = -1;
 #if (LWS_LIBRARY_VERSION_MAJOR == 3 && LWS_LIBRARY_VERSION_MINOR >= 2) || (LWS_LIBRARY_VERSION_MAJOR > 3)
-	info.options |= LWS_SERVER_OPTION_FAIL_UPON_UNABLE_TO_BIND;
+		info.options |= LWS_SERVER_OPTION_FAIL_UPON_UNABLE_TO_BIND;
 #endif
-	/* Create the server context */
-	struct lws_vhost *server = lws_create_vhost(wsc, &info);
-	if(server == NULL) {
-		DNAFX_LOG(DNAFX_LOG_FATAL, "Error creating HTTP/WebSocket server\n");
-		return -1;
+		/* Create the server context */
+		struct lws_vhost *server = lws_create_vhost(wsc, &info);
+		if(server == NULL) {
+			DNAFX_LOG(DNAFX_LOG_FATAL, "Error creating HTTP/WebSocket server\n");
+			return -1;
+		}
+	}
+#if defined(LWS_WITH_UNIX_SOCK)
+	if(unix_path != NULL) {
+		/* Get rid of stale sockets from previous runs, but nothing else */
+		struct stat st;
+		if(lstat(unix_path, &st) == 0) {
+			if(!S_ISSOCK(st.st_mode)) {
+				DNAFX_LOG(DNAFX_LOG_FATAL, "Error creating Unix socket: %s exists and is not a socket\n", unix_path);
+				return -1;
+			}
+			if(dnafx_httpws_unix_in_use(unix_path)) {
+				DNAFX_LOG(DNAFX_LOG_FATAL, "Error creating Unix socket: %s is in use by another process\n", unix_path);
+				return -1;
+			}
+			unlink(unix_path);
+		}
+		/* Same API, but served on a Unix domain socket for local controllers */
+		struct lws_context_creation_info info = { 0 };
+		info.vhost_name = "dnafx-unix";
+		info.iface = unix_path;
+		info.port = 0;
+		info.protocols = protocols;
+		info.gid = -1;
+		info.uid = -1;
+		info.options |= LWS_SERVER_OPTION_UNIX_SOCK;
+#if (LWS_LIBRARY_VERSION_MAJOR == 3 && LWS_LIBRARY_VERSION_MINOR >= 2) || (LWS_LIBRARY_VERSION_MAJOR > 3)
+		info.options |= LWS_SERVER_OPTION_FAIL_UPON_UNABLE_TO_BIND;
+#endif
+		struct lws_vhost *server = lws_create_vhost(wsc, &info);
+		if(server == NULL) {
+			DNAFX_LOG(DNAFX_LOG_FATAL, "Error creating HTTP/WebSocket server on Unix socket %s\n", unix_path);
+			return -1;
+		}
+		unix_socket = g_strdup(unix_path);
+		/* Access is controlled by filesystem permissions: owner and group only */
+		if(chmod(unix_path, 0660) < 0) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Couldn't change permissions of %s: %s\n",
+				unix_path, g_strerror(errno));
+		}
 	}
-	/* Start the service thread */
+#endif
+	/* Start the service threads, one per libwebsockets service thread index */
 	GError *error = NULL;
-	ws_thread = g_thread_try_new("dnafx-ws", &dnafx_httpws_thread, NULL, &error);
-	if(error != NULL) {
-		DNAFX_LOG(DNAFX_LOG_ERR, "Got error %d (%s) trying to launch the WebSockets thread...\n",
-			error->code, error->message ? error->message : "??");
-		g_error_free(error);
-		return -1;
+	char tname[16];
+	for(i=0; i<threads; i++) {
+		g_snprintf(tname, sizeof(tname), "dnafx-ws-%d", i);
+		ws_threads[i] = g_thread_try_new(tname, &dnafx_httpws_thread, GINT_TO_POINTER(i), &error);
+		if(error != NULL) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Got error %d (%s) trying to launch the WebSockets thread #%d...\n",
+				error->code, error->message ? error->message : "??", i);
+			g_error_free(error);
+			return -1;
+		}
+		ws_threads_num++;
 	}
 	/* Done */
 	return 0;
@@ -256,43 +485,344 @@ void dnafx_httpws_deinit(void) {
 #if ((LWS_LIBRARY_VERSION_MAJOR == 3 && LWS_LIBRARY_VERSION_MINOR >= 2) || LWS_LIBRARY_VERSION_MAJOR >= 4)
 	lws_cancel_service(wsc);
 #endif
-	/* Stop the service thread */
-	if(ws_thread != NULL) {
-		g_thread_join(ws_thread);
-		ws_thread = NULL;
+	/* Stop the service threads */
+	int i = 0;
+	for(i=0; i<ws_threads_num; i++) {
+		g_thread_join(ws_threads[i]);
+		ws_threads[i] = NULL;
 	}
 	/* Destroy the context */
 	if(wsc != NULL) {
 		lws_context_destroy(wsc);
 		wsc = NULL;
 	}
+	if(unix_socket != NULL) {
+		unlink(unix_socket);
+		g_free(unix_socket);
+		unix_socket = NULL;
+	}
 
 	dnafx_mutex_lock(&clients_mutex);
 	g_hash_table_destroy(clients);
 	clients = NULL;
-	g_hash_table_destroy(writable_clients);
-	writable_clients = NULL;
 	dnafx_mutex_unlock(&clients_mutex);
+	/* Drop completions nobody will deliver anymore */
+	for(i=0; i<ws_threads_num; i++) {
+		dnafx_httpws_completion *c = g_atomic_pointer_exchange(&completions[i], NULL), *next = NULL;
+		while(c != NULL) {
+			next = c->next;
+			dnafx_httpws_buffer_put(c->response);
+			dnafx_httpws_session_unref(c->session);
+			g_free(c);
+			c = next;
+		}
+	}
+	ws_threads_num = 0;
+
+	/* Get rid of the buffers we pooled */
+	dnafx_mutex_lock(&buffers_mutex);
+	dnafx_httpws_buffer *buffer = NULL;
+	while((buffer = g_queue_pop_head(&buffers_pool)) != NULL) {
+		g_free(buffer->data);
+		g_free(buffer);
+	}
+	dnafx_mutex_unlock(&buffers_mutex);
 }
 
 /* Loop thread */
 static void *dnafx_httpws_thread(void *data) {
+	int tsi = GPOINTER_TO_INT(data);
 	if(wsc == NULL) {
 		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid service\n");
 		return NULL;
 	}
-	DNAFX_LOG(DNAFX_LOG_INFO, "HTTP/WebSocket server started\n");
+	DNAFX_LOG(DNAFX_LOG_INFO, "HTTP/WebSocket server thread #%d started\n", tsi);
+	/* No polling: we sleep until there's network activity, or until
+	 * lws_cancel_service() is called for completions or to shut down */
 	while(dnafx_is_running())
-		lws_service(wsc, 50);
+		lws_service_tsi(wsc, DNAFX_HTTPWS_SERVICE_TIMEOUT, tsi);
 	/* Done */
 	lws_cancel_service(wsc);
-	DNAFX_LOG(DNAFX_LOG_INFO, "HTTP/WebSocket server stopped\n");
+	DNAFX_LOG(DNAFX_LOG_INFO, "HTTP/WebSocket server thread #%d stopped\n", tsi);
 	return NULL;
 
 }
 
-/* Helper to write responses (HTTP) */
-static int dnafx_httpws_write_http_response(struct lws *wsi, int code, const char *text, const char *ctype) {
+/* Pooled buffers management */
+static dnafx_httpws_buffer *dnafx_httpws_buffer_get(void) {
+	dnafx_mutex_lock(&buffers_mutex);
+	dnafx_httpws_buffer *buffer = g_queue_pop_head(&buffers_pool);
+	dnafx_mutex_unlock(&buffers_mutex);
+	if(buffer == NULL) {
+		buffer = g_malloc0(sizeof(dnafx_httpws_buffer));
+		buffer->size = LWS_PRE + DNAFX_HTTPWS_BUFFER_MIN;
+		buffer->data = g_malloc(buffer->size);
+	}
+	buffer->len = 0;
+	buffer->completed = 0;
+	buffer->topic = NULL;
+	return buffer;
+}
+
+static int dnafx_httpws_buffer_reserve(dnafx_httpws_buffer *buffer, size_t needed) {
+	if(buffer == NULL)
+		return -1;
+	if(LWS_PRE + needed <= buffer->size)
+		return 0;
+	/* Grow geometrically, so that large payloads only cause a few reallocations */
+	size_t size = buffer->size;
+	while(size < LWS_PRE + needed) {
+		if(size > G_MAXSIZE / 2)
+			return -1;
+		size *= 2;
+	}
+	buffer->data = g_realloc(buffer->data, size);
+	buffer->size = size;
+	return 0;
+}
+
+static int dnafx_httpws_buffer_append(dnafx_httpws_buffer *buffer, const void *data, size_t len) {
+	if(buffer == NULL || len > G_MAXSIZE - LWS_PRE - buffer->len - 1)
+		return -1;
+	/* We always leave room for a null terminator, in case it's text */
+	if(dnafx_httpws_buffer_reserve(buffer, buffer->len + len + 1) < 0)
+		return -1;
+	memcpy(DNAFX_HTTPWS_PAYLOAD(buffer) + buffer->len, data, len);
+	buffer->len += len;
+	*(DNAFX_HTTPWS_PAYLOAD(buffer) + buffer->len) = '\0';
+	return 0;
+}
+
+static void dnafx_httpws_buffer_put(dnafx_httpws_buffer *buffer) {
+	if(buffer == NULL)
+		return;
+	g_free(buffer->topic);
+	buffer->topic = NULL;
+	if(buffer->size <= LWS_PRE + DNAFX_HTTPWS_BUFFER_POOLED) {
+		dnafx_mutex_lock(&buffers_mutex);
+		if(g_queue_get_length(&buffers_pool) < DNAFX_HTTPWS_POOL_SIZE) {
+			g_queue_push_head(&buffers_pool, buffer);
+			buffer = NULL;
+		}
+		dnafx_mutex_unlock(&buffers_mutex);
+	}
+	if(buffer != NULL) {
+		/* Pool is full, or the buffer grew too large to keep around */
+		g_free(buffer->data);
+		g_free(buffer);
+	}
+}
+
+/* Client sessions */
+static void dnafx_httpws_client_setup(dnafx_httpws_client *client, struct lws *wsi, gboolean websocket) {
+	client->wsi = wsi;
+	client->websocket = websocket;
+	client->inbuf = NULL;
+	g_queue_init(&client->outgoing);
+	client->outgoing_bytes = 0;
+	client->overflow = FALSE;
+	client->outbuf = NULL;
+	client->outoffset = 0;
+	/* Create the session tasks will reference, and track it */
+	client->session = g_malloc0(sizeof(dnafx_httpws_session));
+	client->session->refcount = 1;
+	client->session->tsi = lws_get_tsi(wsi);
+	client->session->client = client;
+	dnafx_mutex_lock(&clients_mutex);
+	g_hash_table_insert(clients, client->session, client->session);
+	dnafx_mutex_unlock(&clients_mutex);
+}
+
+static void dnafx_httpws_session_unref(dnafx_httpws_session *session) {
+	if(session != NULL && g_atomic_int_dec_and_test(&session->refcount))
+		g_free(session);
+}
+
+/* Called on a service thread when lws_cancel_service() woke it up: we
+ * detach the whole list of completions for this thread in one go, and
+ * deliver them to the clients that are still there in arrival order */
+static void dnafx_httpws_completions_drain(struct lws *wsi) {
+	int tsi = wsi ? lws_get_tsi(wsi) : 0;
+	if(tsi < 0 || tsi >= ws_threads_num)
+		return;
+	dnafx_httpws_completion *list = g_atomic_pointer_exchange(&completions[tsi], NULL);
+	if(list == NULL)
+		return;
+	/* The list is LIFO, reverse it first */
+	dnafx_httpws_completion *c = list, *prev = NULL, *next = NULL;
+	while(c != NULL) {
+		next = c->next;
+		c->next = prev;
+		prev = c;
+		c = next;
+	}
+	guint64 count = 0;
+	c = prev;
+	while(c != NULL) {
+		next = c->next;
+		dnafx_httpws_client *client = c->session->client;
+		if(client != NULL) {
+			dnafx_httpws_client_enqueue(client, c->response);
+			lws_callback_on_writable(client->wsi);
+		} else {
+			/* Connection went away in the meanwhile */
+			dnafx_httpws_buffer_put(c->response);
+		}
+		dnafx_httpws_session_unref(c->session);
+		g_free(c);
+		count++;
+		c = next;
+	}
+	dnafx_mutex_lock(&stats_mutex);
+	stats.wakeups++;
+	stats.batched += count;
+	dnafx_mutex_unlock(&stats_mutex);
+}
+
+static void dnafx_httpws_stats_sent(dnafx_httpws_buffer *response) {
+	if(response == NULL || response->completed == 0)
+		return;
+	gint64 latency = g_get_monotonic_time() - response->completed;
+	DNAFX_LOG(DNAFX_LOG_VERB, "Response delivered %"SCNi64"us after the task completed\n", latency);
+	dnafx_mutex_lock(&stats_mutex);
+	stats.responses++;
+	stats.latency_total += latency;
+	if(latency > stats.latency_max)
+		stats.latency_max = latency;
+	dnafx_mutex_unlock(&stats_mutex);
+}
+
+/* Outgoing queues management, only ever invoked by the owning thread */
+static void dnafx_httpws_client_enqueue(dnafx_httpws_client *client, dnafx_httpws_buffer *response) {
+	if(client == NULL || response == NULL)
+		return;
+	guint64 dropped = 0, coalesced = 0, disconnected = 0;
+	gint64 queued = 1, queued_bytes = response->len;
+	g_queue_push_tail(&client->outgoing, response);
+	client->outgoing_bytes += response->len;
+	/* Enforce the budget, but always keep the latest message */
+	while(g_queue_get_length(&client->outgoing) > 1 &&
+			(g_queue_get_length(&client->outgoing) > queue_max_messages ||
+			client->outgoing_bytes > queue_max_bytes)) {
+		if(queue_policy == DNAFX_HTTPWS_OVERFLOW_DISCONNECT) {
+			if(!client->overflow)
+				disconnected++;
+			client->overflow = TRUE;
+			break;
+		}
+		GList *victim = NULL;
+		if(queue_policy == DNAFX_HTTPWS_OVERFLOW_COALESCE && response->topic != NULL) {
+			/* The latest response supersedes an older one to the exact same
+			 * request (same arguments too), if that's still queued */
+			GList *l = client->outgoing.head;
+			while(l != NULL && l->data != response) {
+				dnafx_httpws_buffer *queued_response = (dnafx_httpws_buffer *)l->data;
+				if(queued_response->topic != NULL && !strcmp(queued_response->topic, response->topic)) {
+					victim = l;
+					break;
+				}
+				l = l->next;
+			}
+		}
+		dnafx_httpws_buffer *old = NULL;
+		if(victim != NULL) {
+			old = (dnafx_httpws_buffer *)victim->data;
+			g_queue_delete_link(&client->outgoing, victim);
+			coalesced++;
+		} else {
+			old = g_queue_pop_head(&client->outgoing);
+			dropped++;
+		}
+		client->outgoing_bytes -= old->len;
+		queued--;
+		queued_bytes -= old->len;
+		dnafx_httpws_buffer_put(old);
+	}
+	if(dropped > 0) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "[%s-%p] Outgoing queue budget exceeded, dropped %"SCNu64" message(s)\n",
+			client->websocket ? "WS" : "HTTP", client->wsi, dropped);
+	}
+	dnafx_mutex_lock(&stats_mutex);
+	stats.queued += queued;
+	stats.queued_bytes += queued_bytes;
+	if(g_queue_get_length(&client->outgoing) > stats.queued_max)
+		stats.queued_max = g_queue_get_length(&client->outgoing);
+	stats.dropped += dropped;
+	stats.coalesced += coalesced;
+	stats.disconnected += disconnected;
+	dnafx_mutex_unlock(&stats_mutex);
+}
+
+static dnafx_httpws_buffer *dnafx_httpws_client_dequeue(dnafx_httpws_client *client) {
+	dnafx_httpws_buffer *response = client ? g_queue_pop_head(&client->outgoing) : NULL;
+	if(response == NULL)
+		return NULL;
+	client->outgoing_bytes -= response->len;
+	dnafx_mutex_lock(&stats_mutex);
+	stats.queued--;
+	stats.queued_bytes -= response->len;
+	dnafx_mutex_unlock(&stats_mutex);
+	return response;
+}
+
+json_t *dnafx_httpws_stats(void) {
+	json_t *json = json_object();
+	dnafx_mutex_lock(&clients_mutex);
+	json_object_set_new(json, "clients", json_integer(clients ? g_hash_table_size(clients) : 0));
+	dnafx_mutex_unlock(&clients_mutex);
+	json_object_set_new(json, "threads", json_integer(ws_threads_num));
+	dnafx_mutex_lock(&stats_mutex);
+	json_object_set_new(json, "responses", json_integer(stats.responses));
+	json_object_set_new(json, "latency-avg-us",
+		json_integer(stats.responses ? stats.latency_total / (gint64)stats.responses : 0));
+	json_object_set_new(json, "latency-max-us", json_integer(stats.latency_max));
+	json_object_set_new(json, "wakeups", json_integer(stats.wakeups));
+	json_object_set_new(json, "completions", json_integer(stats.batched));
+	json_t *queues = json_object();
+	json_object_set_new(queues, "policy", json_string(dnafx_httpws_overflow_str(queue_policy)));
+	json_object_set_new(queues, "max-messages", json_integer(queue_max_messages));
+	json_object_set_new(queues, "max-bytes", json_integer(queue_max_bytes));
+	json_object_set_new(queues, "queued", json_integer(stats.queued));
+	json_object_set_new(queues, "queued-bytes", json_integer(stats.queued_bytes));
+	json_object_set_new(queues, "queued-max", json_integer(stats.queued_max));
+	json_object_set_new(queues, "dropped", json_integer(stats.dropped));
+	json_object_set_new(queues, "coalesced", json_integer(stats.coalesced));
+	json_object_set_new(queues, "disconnected", json_integer(stats.disconnected));
+	json_object_set_new(json, "queues", queues);
+	dnafx_mutex_unlock(&stats_mutex);
+	return json;
+}
+
+static void dnafx_httpws_client_cleanup(dnafx_httpws_client *client) {
+	if(client == NULL)
+		return;
+	dnafx_httpws_buffer_put(client->inbuf);
+	client->inbuf = NULL;
+	dnafx_httpws_buffer_put(client->outbuf);
+	client->outbuf = NULL;
+	client->outoffset = 0;
+	if(client->outgoing_bytes > 0 || !g_queue_is_empty(&client->outgoing)) {
+		dnafx_mutex_lock(&stats_mutex);
+		stats.queued -= g_queue_get_length(&client->outgoing);
+		stats.queued_bytes -= client->outgoing_bytes;
+		dnafx_mutex_unlock(&stats_mutex);
+	}
+	g_queue_clear_full(&client->outgoing, (GDestroyNotify)dnafx_httpws_buffer_put);
+	client->outgoing_bytes = 0;
+	if(client->session != NULL) {
+		/* Tasks still in flight will find out the client is gone */
+		dnafx_mutex_lock(&clients_mutex);
+		if(clients != NULL)
+			g_hash_table_remove(clients, client->session);
+		dnafx_mutex_unlock(&clients_mutex);
+		client->session->client = NULL;
+		dnafx_httpws_session_unref(client->session);
+		client->session = NULL;
+	}
+}
+
+/* Helper to write responses (HTTP): the buffer must be LWS_PRE-padded */
+static int dnafx_httpws_write_http_response(struct lws *wsi, int code, dnafx_httpws_buffer *body, const char *ctype) {
 	uint8_t payload[LWS_PRE + 256];
 	uint8_t *start = &payload[LWS_PRE], *p = start,
 		*end = &payload[sizeof(payload) - LWS_PRE];
@@ -307,8 +837,8 @@ static int dnafx_httpws_write_http_response(struct lws *wsi, int code, const cha
 		(unsigned char *)ctype, strlen(ctype), &p, end);
 	if(res != 0)
 		return res;
-	char cl[10];
-	g_snprintf(cl, sizeof(cl), "%zu", strlen(text));
+	char cl[24];
+	g_snprintf(cl, sizeof(cl), "%zu", body->len);
 	res |= lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_LENGTH,
 		(unsigned char *)cl, strlen(cl), &p, end);
 	if(res != 0)
@@ -320,14 +850,42 @@ static int dnafx_httpws_write_http_response(struct lws *wsi, int code, const cha
 	res = lws_write(wsi, start, len, LWS_WRITE_HTTP_HEADERS);
 	if(res != len)
 		return res;
-	len = strlen(text);
-	res = lws_write(wsi, (void *)text, len, LWS_WRITE_HTTP);
-	if(res != len)
+	res = lws_write(wsi, DNAFX_HTTPWS_PAYLOAD(body), body->len, LWS_WRITE_HTTP);
+	if(res != body->len)
 		return res;
 	return 0;
 }
 
-static char *dnafx_httpws_create_reason(int code, const char *text) {
+static int dnafx_httpws_write_http_text(struct lws *wsi, int code, const char *text, const char *ctype) {
+	dnafx_httpws_buffer *body = dnafx_httpws_buffer_get();
+	dnafx_httpws_buffer_append(body, text, strlen(text));
+	int res = dnafx_httpws_write_http_response(wsi, code, body, ctype);
+	dnafx_httpws_buffer_put(body);
+	return res;
+}
+
+/* Serialize a JSON object directly in the LWS_PRE-padded area of a pooled buffer */
+static dnafx_httpws_buffer *dnafx_httpws_serialize(json_t *response) {
+	dnafx_httpws_buffer *buffer = dnafx_httpws_buffer_get();
+	size_t available = buffer->size - LWS_PRE;
+	size_t needed = json_dumpb(response, (char *)DNAFX_HTTPWS_PAYLOAD(buffer), available, json_format);
+	if(needed == 0) {
+		dnafx_httpws_buffer_put(buffer);
+		return NULL;
+	}
+	if(needed > available) {
+		/* Not enough room, grow the buffer and serialize again */
+		if(dnafx_httpws_buffer_reserve(buffer, needed) < 0) {
+			dnafx_httpws_buffer_put(buffer);
+			return NULL;
+		}
+		needed = json_dumpb(response, (char *)DNAFX_HTTPWS_PAYLOAD(buffer), buffer->size - LWS_PRE, json_format);
+	}
+	buffer->len = needed;
+	return buffer;
+}
+
+static dnafx_httpws_buffer *dnafx_httpws_create_reason(int code, const char *text) {
 	json_t *response = json_object();
 	json_object_set_new(response, "code", json_integer(code));
 	if(text != NULL) {
@@ -335,27 +893,27 @@ static char *dnafx_httpws_create_reason(int code, const char *text) {
 		json_object_set_new(body, "reason", json_string(text));
 		json_object_set_new(response, "payload", body);
 	}
-	char *json = json_dumps(response, json_format);
+	dnafx_httpws_buffer *buffer = dnafx_httpws_serialize(response);
 	json_decref(response);
-	return json;
+	return buffer;
 }
 
-static char *dnafx_httpws_create_payload(int code, json_t *body) {
+static dnafx_httpws_buffer *dnafx_httpws_create_payload(int code, json_t *body) {
 	json_t *response = json_object();
 	json_object_set_new(response, "code", json_integer(code));
 	if(body != NULL)
 		json_object_set_new(response, "payload", body);
-	char *json = json_dumps(response, json_format);
+	dnafx_httpws_buffer *buffer = dnafx_httpws_serialize(response);
 	json_decref(response);
-	return json;
+	return buffer;
 }
 
 /* Helper to process an incoming command */
 static dnafx_httpws_error dnafx_httpws_handle_request(dnafx_httpws_client *client) {
-	if(client == NULL || client->buffer == NULL)
+	if(client == NULL || client->session == NULL || client->inbuf == NULL)
 		return DNAFX_HTTPWS_GENERIC_ERROR;
 	json_error_t error;
-	json_t *json = json_loads(client->buffer, 0, &error);
+	json_t *json = json_loadb((char *)DNAFX_HTTPWS_PAYLOAD(client->inbuf), client->inbuf->len, 0, &error);
 	if(json == NULL) {
 		DNAFX_LOG(DNAFX_LOG_ERR, "JSON error: on line %d: %s\n", error.line, error.text);
 		return DNAFX_HTTPWS_INVALID_JSON;
@@ -393,12 +951,27 @@ static dnafx_httpws_error dnafx_httpws_handle_request(dnafx_httpws_client *clien
 	}
 	dnafx_task *task = dnafx_task_new(argc, argv);
 	g_free(argv);
+	char *topic = NULL;
+	if(task != NULL) {
+		/* Responses are only ever coalesced with ones to the same request */
+		json_t *key = args ? json_deep_copy(args) : json_array();
+		json_array_insert(key, 0, request);
+		char *text = json_dumps(key, JSON_COMPACT);
+		topic = g_strdup(text);
+		free(text);
+		json_decref(key);
+	}
 	json_decref(json);
 	if(task == NULL) {
 		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid command\n");
 		return DNAFX_HTTPWS_INVALID_COMMAND;
 	}
-	dnafx_task_add_context(task, client, &dnafx_httpws_task_done);
+	/* The task holds a reference to the session until it completes */
+	dnafx_httpws_request *context = g_malloc(sizeof(dnafx_httpws_request));
+	g_atomic_int_inc(&client->session->refcount);
+	context->session = client->session;
+	context->topic = topic;
+	dnafx_task_add_context(task, context, &dnafx_httpws_task_done);
 	dnafx_tasks_add(task);
 	return DNAFX_HTTPWS_OK;
 }
@@ -410,45 +983,37 @@ static int dnafx_httpws_callback_http(struct lws *wsi,
 	switch(reason) {
 		case LWS_CALLBACK_HTTP:
 			if(lws_hdr_total_length(wsi, WSI_TOKEN_POST_URI)) {
-				client->wsi = wsi;
-				client->websocket = FALSE;
-				client->buffer = NULL;
-				client->offset = 0;
-				client->size = 0;
-				client->outgoing = g_async_queue_new_full((GDestroyNotify)g_free);
-				client->outbuffer = NULL;
 				/* Track this connection */
-				dnafx_mutex_lock(&clients_mutex);
-				g_hash_table_insert(clients, client, client);
-				dnafx_mutex_unlock(&clients_mutex);
+				dnafx_httpws_client_setup(client, wsi, FALSE);
 				lws_callback_on_writable(wsi);
 				return 0;
 			}
 			/* If we got here, we reject it */
-			dnafx_httpws_write_http_response(wsi, 404, "Use POST", "text/html");
+			dnafx_httpws_write_http_text(wsi, 404, "Use POST", "text/html");
 			/* Close and free connection */
 			return -1;
 		case LWS_CALLBACK_HTTP_BODY: {
-			if(client->buffer == NULL) {
-				client->size = 1024;
-				client->buffer = g_malloc0(client->size);
-			}
-			while((len + 1) > client->size) {
-				client->size += 1024;
-				client->buffer = g_realloc(client->buffer, client->size);
+			if(client->inbuf == NULL)
+				client->inbuf = dnafx_httpws_buffer_get();
+			if(dnafx_httpws_buffer_append(client->inbuf, in, len) < 0) {
+				DNAFX_LOG(DNAFX_LOG_ERR, "[HTTP-%p] Error buffering request body\n", wsi);
+				return -1;
 			}
-			memcpy(client->buffer + client->offset, in, len);
-			client->offset += len;
 			return 0;
 		}
 		case LWS_CALLBACK_HTTP_BODY_COMPLETION: {
-			*(client->buffer + client->offset) = '\0';
-			DNAFX_LOG(DNAFX_LOG_INFO, "[HTTP] %s\n", client->buffer);
+			if(client->inbuf == NULL)
+				client->inbuf = dnafx_httpws_buffer_get();
+			DNAFX_LOG(DNAFX_LOG_INFO, "[HTTP] %.*s\n", (int)client->inbuf->len, DNAFX_HTTPWS_PAYLOAD(client->inbuf));
 			dnafx_httpws_error res = dnafx_httpws_handle_request(client);
+			/* We don't need the request anymore */
+			dnafx_httpws_buffer_put(client->inbuf);
+			client->inbuf = NULL;
 			if(res != DNAFX_HTTPWS_OK) {
-				char *json = dnafx_httpws_create_reason(400, dnafx_httpws_error_str(res));
-				dnafx_httpws_write_http_response(wsi, 200, json, "application/json");
-				free(json);
+				dnafx_httpws_buffer *response = dnafx_httpws_create_reason(400, dnafx_httpws_error_str(res));
+				if(response != NULL)
+					dnafx_httpws_write_http_response(wsi, 200, response, "application/json");
+				dnafx_httpws_buffer_put(response);
 				/* Close and free connection */
 				return 1;
 			}
@@ -456,44 +1021,28 @@ static int dnafx_httpws_callback_http(struct lws *wsi,
 			return 0;
 		}
 		case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
-			dnafx_mutex_lock(&clients_mutex);
-			/* We iterate on all the clients we marked as writable and act on them */
-			GHashTableIter iter;
-			gpointer value;
-			g_hash_table_iter_init(&iter, writable_clients);
-			while(g_hash_table_iter_next(&iter, NULL, &value)) {
-				dnafx_httpws_client *client = value;
-				if(client == NULL || client->wsi == NULL)
-					continue;
-				lws_callback_on_writable(client->wsi);
-			}
-			g_hash_table_remove_all(writable_clients);
-			dnafx_mutex_unlock(&clients_mutex);
+			/* Deliver the completions for clients of this thread */
+			dnafx_httpws_completions_drain(wsi);
 			return 0;
 		}
 		case LWS_CALLBACK_HTTP_WRITEABLE: {
 			/* See if there's a message to send */
-			char *response = g_async_queue_try_pop(client->outgoing);
+			dnafx_httpws_buffer *response = dnafx_httpws_client_dequeue(client);
 			if(response == NULL)
 				return 0;
 			dnafx_httpws_write_http_response(wsi, 200, response, "application/json");
-			g_free(response);
+			dnafx_httpws_stats_sent(response);
+			dnafx_httpws_buffer_put(response);
 			/* Close and free connection */
 			return 1;
 		}
 		case LWS_CALLBACK_GET_THREAD_ID:
 			return (uint64_t)pthread_self();
 		case LWS_CALLBACK_CLOSED:
+		case LWS_CALLBACK_CLOSED_HTTP:
 		case LWS_CALLBACK_WSI_DESTROY: {
-			if(client != NULL) {
-				g_free(client->buffer);
-				client->buffer = NULL;
-				g_free(client->outbuffer);
-				client->outbuffer = NULL;
-				if(client->outgoing != NULL)
-					g_async_queue_unref(client->outgoing);
-				client->outgoing = NULL;
-			}
+			/* Make sure a task completing later won't find this client */
+			dnafx_httpws_client_cleanup(client);
 			return 0;
 		}
 		default:
@@ -513,17 +1062,8 @@ static int dnafx_httpws_callback_ws(struct lws *wsi,
 	dnafx_httpws_client *client = (dnafx_httpws_client *)user;
 	switch(reason) {
 		case LWS_CALLBACK_ESTABLISHED: {
-			client->wsi = wsi;
-			client->websocket = TRUE;
-			client->buffer = NULL;
-			client->offset = 0;
-			client->size = 0;
-			client->outgoing = g_async_queue_new_full((GDestroyNotify)g_free);
-			client->outbuffer = NULL;
 			/* Let us know when the WebSocket channel becomes writeable */
-			dnafx_mutex_lock(&clients_mutex);
-			g_hash_table_insert(clients, client, client);
-			dnafx_mutex_unlock(&clients_mutex);
+			dnafx_httpws_client_setup(client, wsi, TRUE);
 			lws_callback_on_writable(wsi);
 			return 0;
 		}
@@ -538,53 +1078,38 @@ static int dnafx_httpws_callback_ws(struct lws *wsi,
 		}
 		case LWS_CALLBACK_RECEIVE: {
 			const size_t remaining = lws_remaining_packet_payload(wsi);
-			if(client->buffer == NULL) {
-				client->size = 1024;
-				client->buffer = g_malloc0(client->size);
-			}
-			while((len + 1) > client->size) {
-				client->size += 1024;
-				client->buffer = g_realloc(client->buffer, client->size);
+			if(client->inbuf == NULL)
+				client->inbuf = dnafx_httpws_buffer_get();
+			if(dnafx_httpws_buffer_append(client->inbuf, in, len) < 0) {
+				DNAFX_LOG(DNAFX_LOG_ERR, "[WS-%p] Error buffering message\n", wsi);
+				return -1;
 			}
-			memcpy(client->buffer + client->offset, in, len);
-			client->offset += len;
 			if(remaining > 0 || !lws_is_final_fragment(wsi)) {
 				/* Still waiting for some more fragments */
 				DNAFX_LOG(DNAFX_LOG_INFO, "[WS-%p] Waiting for more fragments\n", wsi);
 				lws_callback_on_writable(wsi);
 				return 0;
 			}
-			*(client->buffer + client->offset) = '\0';
-			DNAFX_LOG(DNAFX_LOG_INFO, "[WS] %s\n", client->buffer);
+			DNAFX_LOG(DNAFX_LOG_INFO, "[WS] %.*s\n", (int)client->inbuf->len, DNAFX_HTTPWS_PAYLOAD(client->inbuf));
 			dnafx_httpws_error res = dnafx_httpws_handle_request(client);
+			/* We're done with this message, recycle the buffer */
+			dnafx_httpws_buffer_put(client->inbuf);
+			client->inbuf = NULL;
+			dnafx_httpws_buffer *response = NULL;
 			if(res != DNAFX_HTTPWS_OK) {
-				char *json = dnafx_httpws_create_reason(400, dnafx_httpws_error_str(res));
-				g_async_queue_push(client->outgoing, g_strdup(json));
-				free(json);
+				response = dnafx_httpws_create_reason(400, dnafx_httpws_error_str(res));
 			} else {
 				/* FIXME */
-				char *json = dnafx_httpws_create_reason(200, "Command queued");
-				g_async_queue_push(client->outgoing, g_strdup(json));
-				free(json);
+				response = dnafx_httpws_create_reason(200, "Command queued");
 			}
-			client->offset = 0;
+			if(response != NULL)
+				dnafx_httpws_client_enqueue(client, response);
 			lws_callback_on_writable(wsi);
 			return 0;
 		}
 		case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
-			dnafx_mutex_lock(&clients_mutex);
-			/* We iterate on all the clients we marked as writable and act on them */
-			GHashTableIter iter;
-			gpointer value;
-			g_hash_table_iter_init(&iter, writable_clients);
-			while(g_hash_table_iter_next(&iter, NULL, &value)) {
-				dnafx_httpws_client *client = value;
-				if(client == NULL || client->wsi == NULL)
-					continue;
-				lws_callback_on_writable(client->wsi);
-			}
-			g_hash_table_remove_all(writable_clients);
-			dnafx_mutex_unlock(&clients_mutex);
+			/* Deliver the completions for clients of this thread */
+			dnafx_httpws_completions_drain(wsi);
 			return 0;
 		}
 		case LWS_CALLBACK_SERVER_WRITEABLE: {
@@ -592,14 +1117,20 @@ static int dnafx_httpws_callback_ws(struct lws *wsi,
 				DNAFX_LOG(DNAFX_LOG_ERR, "[WS-%p] Invalid WebSocket client instance\n", wsi);
 				return -1;
 			}
+			if(client->overflow) {
+				/* Too slow for what we have to send, get rid of it */
+				DNAFX_LOG(DNAFX_LOG_WARN, "[WS-%p] Outgoing queue budget exceeded, closing connection\n", wsi);
+				return -1;
+			}
 			/* Check if Websockets send pipe is choked */
 			if(lws_send_pipe_choked(wsi)) {
-				if(client->outbuffer && client->outbufpending > 0 && client->outbufoffset > 0) {
-					DNAFX_LOG(DNAFX_LOG_WARN, "[WS-%p] Websockets choked with buffer: %zu, trying again\n", wsi, client->outbufpending);
+				if(client->outbuf != NULL) {
+					DNAFX_LOG(DNAFX_LOG_VERB, "[WS-%p] Websockets choked with buffer: %zu, trying again\n",
+						wsi, client->outbuf->len - client->outoffset);
 					lws_callback_on_writable(wsi);
 				} else {
-					gint qlen = g_async_queue_length(client->outgoing);
-					DNAFX_LOG(DNAFX_LOG_WARN, "[WS-%p] Websockets choked with queue: %d, trying again\n", wsi, qlen);
+					guint qlen = g_queue_get_length(&client->outgoing);
+					DNAFX_LOG(DNAFX_LOG_VERB, "[WS-%p] Websockets choked with queue: %u, trying again\n", wsi, qlen);
 					if(qlen > 0) {
 						lws_callback_on_writable(wsi);
 					}
@@ -607,34 +1138,33 @@ static int dnafx_httpws_callback_ws(struct lws *wsi,
 				return 0;
 			}
 			/* Check if we have a pending/partial write to complete first */
-			if(client->outbuffer && client->outbufpending > 0 && client->outbufoffset > 0) {
+			if(client->outbuf != NULL) {
 				DNAFX_LOG(DNAFX_LOG_INFO, "[WS-%p] Completing pending WebSocket write (still need to write last %zu bytes)...\n",
-					wsi, client->outbufpending);
+					wsi, client->outbuf->len - client->outoffset);
 			} else {
-				/* Shoot all the pending messages */
-				char *response = g_async_queue_try_pop(client->outgoing);
-				if(response == NULL)
+				/* Shoot all the pending messages: responses were serialized
+				 * after LWS_PRE already, so we can send them as they are */
+				client->outbuf = dnafx_httpws_client_dequeue(client);
+				if(client->outbuf == NULL)
 					return 0;
-				size_t buflen = LWS_PRE + strlen(response);
-				if(buflen > client->outbuflen) {
-					client->outbuflen = buflen;
-					client->outbuffer = g_realloc(client->outbuffer, buflen);
-				}
-				memcpy(client->outbuffer + LWS_PRE, response, strlen(response));
-				client->outbufpending = strlen(response);
-				client->outbufoffset = LWS_PRE;
-				g_free(response);
+				client->outoffset = 0;
 			}
-			int amount = client->outbufpending <= MESSAGE_CHUNK_SIZE ? client->outbufpending : MESSAGE_CHUNK_SIZE;
-			int flags = lws_write_ws_flags(LWS_WRITE_TEXT, client->outbufoffset == LWS_PRE, client->outbufpending <= (size_t)amount);
-			int sent = lws_write(wsi, client->outbuffer + client->outbufoffset, (size_t)amount, flags);
+			size_t pending = client->outbuf->len - client->outoffset;
+			int amount = pending <= MESSAGE_CHUNK_SIZE ? pending : MESSAGE_CHUNK_SIZE;
+			int flags = lws_write_ws_flags(LWS_WRITE_TEXT, client->outoffset == 0, pending <= (size_t)amount);
+			int sent = lws_write(wsi, DNAFX_HTTPWS_PAYLOAD(client->outbuf) + client->outoffset, (size_t)amount, flags);
 			if(sent < amount) {
 				DNAFX_LOG(DNAFX_LOG_WARN, "[WS] Only sent %d bytes (expected %d)\n", sent, amount);
-				client->outbufpending = 0;
-				client->outbufoffset = 0;
+				client->outoffset = client->outbuf->len;
 			} else {
-				client->outbufpending -= amount;
-				client->outbufoffset += amount;
+				client->outoffset += amount;
+			}
+			if(client->outoffset >= client->outbuf->len) {
+				/* Done with this message, recycle the buffer */
+				dnafx_httpws_stats_sent(client->outbuf);
+				dnafx_httpws_buffer_put(client->outbuf);
+				client->outbuf = NULL;
+				client->outoffset = 0;
 			}
 			lws_callback_on_writable(wsi);
 			return 0;
@@ -643,19 +1173,7 @@ static int dnafx_httpws_callback_ws(struct lws *wsi,
 			return (uint64_t)pthread_self();
 		case LWS_CALLBACK_CLOSED:
 		case LWS_CALLBACK_WSI_DESTROY: {
-			if(client != NULL) {
-				dnafx_mutex_lock(&clients_mutex);
-				g_hash_table_remove(clients, client);
-				g_hash_table_remove(writable_clients, client);
-				dnafx_mutex_unlock(&clients_mutex);
-				g_free(client->buffer);
-				client->buffer = NULL;
-				g_free(client->outbuffer);
-				client->outbuffer = NULL;
-				if(client->outgoing != NULL)
-					g_async_queue_unref(client->outgoing);
-				client->outgoing = NULL;
-			}
+			dnafx_httpws_client_cleanup(client);
 			return 0;
 		}
 		default:
@@ -669,18 +1187,40 @@ static int dnafx_httpws_callback_ws(struct lws *wsi,
 	return 0;
 }
 
-/* Task completion */
+/* Task completion: no locking here, the response is serialized on the
+ * calling thread and pushed to the completions of the owning thread */
 void dnafx_httpws_task_done(int code, void *result, void *user_data) {
-	dnafx_httpws_client *client = (dnafx_httpws_client *)user_data;
-	if(client == NULL)
+	dnafx_httpws_request *request = (dnafx_httpws_request *)user_data;
+	if(request == NULL)
+		return;
+	dnafx_httpws_session *session = request->session;
+	char *topic = request->topic;
+	g_free(request);
+	if(wsc == NULL || session->tsi < 0 || session->tsi >= ws_threads_num) {
+		if(result != NULL)
+			json_decref(result);
+		g_free(topic);
+		dnafx_httpws_session_unref(session);
 		return;
-	dnafx_mutex_lock(&clients_mutex);
-	if(g_hash_table_lookup(clients, client) == client) {
-		char *json = dnafx_httpws_create_payload(code, result);
-		g_async_queue_push(client->outgoing, g_strdup(json));
-		free(json);
-		g_hash_table_insert(writable_clients, client, client);
 	}
-	dnafx_mutex_unlock(&clients_mutex);
-	lws_cancel_service(wsc);
+	dnafx_httpws_buffer *response = dnafx_httpws_create_payload(code, result);
+	if(response == NULL) {
+		g_free(topic);
+		dnafx_httpws_session_unref(session);
+		return;
+	}
+	response->completed = g_get_monotonic_time();
+	response->topic = topic;
+	dnafx_httpws_completion *c = g_malloc(sizeof(dnafx_httpws_completion));
+	c->session = session;
+	c->response = response;
+	dnafx_httpws_completion *head = NULL;
+	do {
+		head = g_atomic_pointer_get(&completions[session->tsi]);
+		c->next = head;
+	} while(!g_atomic_pointer_compare_and_exchange(&completions[session->tsi], head, c));
+	/* Only wake the service up if the list was empty: if it wasn't, a
+	 * wakeup is already pending, and that will deliver this one too */
+	if(head == NULL)
+		lws_cancel_service(wsc);
 }
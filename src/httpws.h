@@ -1,11 +1,24 @@
 #ifndef DNAFX_HTTPWS
 #define DNAFX_HTTPWS
 
+#include <stdint.h>
+
+#include <jansson.h>
+
+/* Default budget for the outgoing queue of each client */
+#define DNAFX_HTTPWS_QUEUE_MESSAGES	256
+#define DNAFX_HTTPWS_QUEUE_BYTES	(1024*1024)
+
 /* Server management */
-int dnafx_httpws_init(uint16_t port);
+int dnafx_httpws_set_queue_limits(int max_messages, int max_bytes, const char *policy);
+int dnafx_httpws_init(uint16_t port, const char *unix_path, int threads);
+int dnafx_httpws_max_threads(void);
 void dnafx_httpws_deinit(void);
 
 /* Task completion */
 void dnafx_httpws_task_done(int code, void *result, void *user_data);
 
+/* Statistics on how API responses are delivered */
+json_t *dnafx_httpws_stats(void);
+
 #endif
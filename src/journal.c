@@ -0,0 +1,551 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "presets.h"
+#include "debug.h"
+
+/* Journal file header and entries (all integers are little endian): the
+ * header of a change is followed by the new image, while the header of
+ * a snapshot is followed by an index of the filled slots and their images */
+typedef struct dnafx_journal_header {
+	char magic[8];
+	uint16_t version;
+	uint16_t slots;
+	uint16_t image_size;
+	uint16_t reserved;
+} dnafx_journal_header;
+typedef struct dnafx_journal_entry_header {
+	uint8_t type;
+	uint8_t kind;
+	uint8_t slot;
+	uint8_t flags;
+	uint32_t count;
+	int64_t time;
+	uint64_t hash;
+} dnafx_journal_entry_header;
+#define DNAFX_JOURNAL_CHANGE	1
+#define DNAFX_JOURNAL_SNAPSHOT_ENTRY	2
+/* The change belongs to the same batch (and undo step) as the previous one */
+#define DNAFX_JOURNAL_GROUPED	0x01
+
+/* What a change was for */
+typedef enum dnafx_journal_kind {
+	DNAFX_JOURNAL_DO = 0,
+	DNAFX_JOURNAL_UNDO,
+	DNAFX_JOURNAL_REDO,
+	DNAFX_JOURNAL_RESTORE
+} dnafx_journal_kind;
+static const char *dnafx_journal_kind_str(int kind) {
+	switch(kind) {
+		case DNAFX_JOURNAL_DO:
+			return "upload";
+		case DNAFX_JOURNAL_UNDO:
+			return "undo";
+		case DNAFX_JOURNAL_REDO:
+			return "redo";
+		case DNAFX_JOURNAL_RESTORE:
+			return "restore";
+		default:
+			break;
+	}
+	return NULL;
+}
+
+/* Entries are kept in memory too, pointing to their data */
+typedef struct dnafx_journal_entry {
+	uint8_t type, kind, slot, flags;
+	gint64 time;
+	guint64 hash;
+	size_t offset;
+} dnafx_journal_entry;
+
+static char *journal_filename = NULL;
+static FILE *journal_file = NULL;
+static GByteArray *journal_data = NULL;
+static GArray *records = NULL;
+/* Indexes of the first change of the steps that can be undone, and of
+ * the ones that can be redone (a step is all the changes of a batch) */
+static GArray *undo_stack = NULL, *redo_stack = NULL;
+static int since_snapshot = 0;
+static gboolean snapshot_taken = FALSE;
+/* Whether a batch is in progress, and if we recorded anything for it yet */
+static gboolean batch_open = FALSE, batch_empty = TRUE;
+/* The undo, redo or restore we're waiting to see uploaded, in order */
+typedef struct dnafx_journal_expected {
+	uint8_t slot;
+	guint64 hash;
+} dnafx_journal_expected;
+static struct {
+	gboolean set;
+	uint8_t kind;
+	GArray *expected;
+	guint next;
+} pending;
+
+/* Helper to hash an image, ignoring the slot and the name (which may
+ * be changed locally, e.g., when it's the same as another preset's) */
+static guint64 dnafx_journal_hash(const uint8_t *image) {
+	if(image == NULL)
+		return 0;
+	/* FNV-1a */
+	guint64 hash = 0xcbf29ce484222325ULL;
+	size_t i = 0;
+	for(i=1+DNAFX_PRESET_NAME_SIZE; i<DNAFX_PRESET_SIZE; i++) {
+		hash ^= image[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* Helper to update the undo and redo stacks after a change */
+static void dnafx_journal_apply(guint index) {
+	dnafx_journal_entry *r = &g_array_index(records, dnafx_journal_entry, index);
+	if(r->type != DNAFX_JOURNAL_CHANGE || (r->flags & DNAFX_JOURNAL_GROUPED))
+		return;
+	/* Only the first change of a batch moves steps around */
+	guint original = 0;
+	if(r->kind == DNAFX_JOURNAL_UNDO && undo_stack->len > 0) {
+		original = g_array_index(undo_stack, guint, undo_stack->len - 1);
+		g_array_set_size(undo_stack, undo_stack->len - 1);
+		g_array_append_val(redo_stack, original);
+	} else if(r->kind == DNAFX_JOURNAL_REDO && redo_stack->len > 0) {
+		original = g_array_index(redo_stack, guint, redo_stack->len - 1);
+		g_array_set_size(redo_stack, redo_stack->len - 1);
+		g_array_append_val(undo_stack, original);
+	} else {
+		g_array_append_val(undo_stack, index);
+		g_array_set_size(redo_stack, 0);
+	}
+}
+
+/* Helper to parse the entry at an offset in the data, returning the
+ * offset of the next one, or 0 if the entry is invalid or truncated */
+static size_t dnafx_journal_parse(size_t offset) {
+	dnafx_journal_entry_header header;
+	if(offset + sizeof(header) > journal_data->len)
+		return 0;
+	memcpy(&header, journal_data->data + offset, sizeof(header));
+	dnafx_journal_entry r = { 0 };
+	r.type = header.type;
+	r.kind = header.kind;
+	r.slot = header.slot;
+	r.flags = header.flags;
+	r.time = GINT64_FROM_LE(header.time);
+	r.hash = GUINT64_FROM_LE(header.hash);
+	r.offset = offset + sizeof(header);
+	size_t size = 0;
+	if(r.type == DNAFX_JOURNAL_CHANGE && r.slot >= 1 && r.slot <= DNAFX_PRESETS_NUM) {
+		size = DNAFX_PRESET_SIZE;
+	} else if(r.type == DNAFX_JOURNAL_SNAPSHOT_ENTRY && GUINT32_FROM_LE(header.count) <= DNAFX_PRESETS_NUM) {
+		size = DNAFX_PRESETS_NUM + GUINT32_FROM_LE(header.count) * DNAFX_PRESET_SIZE;
+	} else {
+		return 0;
+	}
+	if(r.offset + size > journal_data->len)
+		return 0;
+	g_array_append_val(records, r);
+	if(r.type == DNAFX_JOURNAL_CHANGE) {
+		dnafx_journal_apply(records->len - 1);
+		since_snapshot++;
+	} else {
+		since_snapshot = 0;
+	}
+	return r.offset + size;
+}
+
+/* Helper to append an entry to the file, and to our copy */
+static int dnafx_journal_append(dnafx_journal_entry_header *header, const uint8_t *payload, size_t len) {
+	if(fwrite(header, 1, sizeof(*header), journal_file) != sizeof(*header) ||
+			fwrite(payload, 1, len, journal_file) != len || fflush(journal_file) != 0) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Error writing to journal %s: %d (%s)\n",
+			journal_filename, errno, g_strerror(errno));
+		return -1;
+	}
+	size_t offset = journal_data->len;
+	g_byte_array_append(journal_data, (const uint8_t *)header, sizeof(*header));
+	g_byte_array_append(journal_data, payload, len);
+	return dnafx_journal_parse(offset) > 0 ? 0 : -1;
+}
+
+/* Helper to take a snapshot of all the device slots */
+static void dnafx_journal_snapshot(void) {
+	GByteArray *payload = g_byte_array_sized_new(DNAFX_PRESETS_NUM * (DNAFX_PRESET_SIZE + 1));
+	g_byte_array_set_size(payload, DNAFX_PRESETS_NUM);
+	memset(payload->data, 0, DNAFX_PRESETS_NUM);
+	uint32_t count = 0;
+	const uint8_t *image = NULL;
+	int i = 0;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		image = dnafx_preset_slot_image(i + 1);
+		if(image == NULL)
+			continue;
+		payload->data[i] = 1;
+		g_byte_array_append(payload, image, DNAFX_PRESET_SIZE);
+		count++;
+	}
+	dnafx_journal_entry_header header = { 0 };
+	header.type = DNAFX_JOURNAL_SNAPSHOT_ENTRY;
+	header.count = GUINT32_TO_LE(count);
+	header.time = GINT64_TO_LE(g_get_real_time());
+	if(dnafx_journal_append(&header, payload->data, payload->len) == 0)
+		snapshot_taken = TRUE;
+	g_byte_array_unref(payload);
+}
+
+/* Journal management */
+int dnafx_journal_init(const char *filename) {
+	if(filename == NULL)
+		return 0;
+	journal_data = g_byte_array_new();
+	records = g_array_new(FALSE, FALSE, sizeof(dnafx_journal_entry));
+	undo_stack = g_array_new(FALSE, FALSE, sizeof(guint));
+	redo_stack = g_array_new(FALSE, FALSE, sizeof(guint));
+	memset(&pending, 0, sizeof(pending));
+	pending.expected = g_array_new(FALSE, FALSE, sizeof(dnafx_journal_expected));
+	batch_open = FALSE;
+	batch_empty = TRUE;
+	since_snapshot = 0;
+	snapshot_taken = FALSE;
+	journal_filename = g_strdup(filename);
+	dnafx_journal_header header = { 0 };
+	gchar *contents = NULL;
+	gsize len = 0;
+	if(g_file_get_contents(filename, &contents, &len, NULL) && len > 0) {
+		memcpy(&header, contents, MIN(len, sizeof(header)));
+		if(len < sizeof(header) || memcmp(header.magic, DNAFX_JOURNAL_MAGIC, sizeof(header.magic)) ||
+				GUINT16_FROM_LE(header.version) != DNAFX_JOURNAL_VERSION ||
+				GUINT16_FROM_LE(header.slots) != DNAFX_PRESETS_NUM ||
+				GUINT16_FROM_LE(header.image_size) != DNAFX_PRESET_SIZE) {
+			DNAFX_LOG(DNAFX_LOG_FATAL, "Invalid or unsupported journal %s\n", filename);
+			g_free(contents);
+			dnafx_journal_deinit();
+			return -1;
+		}
+		g_byte_array_append(journal_data, (const uint8_t *)contents + sizeof(header), len - sizeof(header));
+		g_free(contents);
+		size_t offset = 0, next = 0;
+		while(offset < journal_data->len && (next = dnafx_journal_parse(offset)) > 0)
+			offset = next;
+		if(offset < journal_data->len) {
+			/* Probably a write that was interrupted, drop what's left */
+			DNAFX_LOG(DNAFX_LOG_WARN, "Dropping %u bytes of truncated entries at the end of journal %s\n",
+				journal_data->len - (guint)offset, filename);
+			g_byte_array_set_size(journal_data, offset);
+			if(truncate(filename, sizeof(header) + offset) < 0) {
+				DNAFX_LOG(DNAFX_LOG_ERR, "Error truncating journal %s: %d (%s)\n", filename, errno, g_strerror(errno));
+			}
+		}
+		journal_file = fopen(filename, "ab");
+	} else {
+		g_free(contents);
+		journal_file = fopen(filename, "wb");
+		if(journal_file != NULL) {
+			memcpy(header.magic, DNAFX_JOURNAL_MAGIC, sizeof(header.magic));
+			header.version = GUINT16_TO_LE(DNAFX_JOURNAL_VERSION);
+			header.slots = GUINT16_TO_LE(DNAFX_PRESETS_NUM);
+			header.image_size = GUINT16_TO_LE(DNAFX_PRESET_SIZE);
+			if(fwrite(&header, 1, sizeof(header), journal_file) != sizeof(header) || fflush(journal_file) != 0) {
+				fclose(journal_file);
+				journal_file = NULL;
+			}
+		}
+	}
+	if(journal_file == NULL) {
+		DNAFX_LOG(DNAFX_LOG_FATAL, "Error opening journal %s: %d (%s)\n", filename, errno, g_strerror(errno));
+		dnafx_journal_deinit();
+		return -1;
+	}
+	DNAFX_LOG(DNAFX_LOG_INFO, "Journal: %s (%u entries, %u changes can be undone)\n",
+		filename, records->len, undo_stack->len);
+	return 0;
+}
+
+gboolean dnafx_journal_enabled(void) {
+	return journal_file != NULL;
+}
+
+void dnafx_journal_deinit(void) {
+	if(journal_file != NULL)
+		fclose(journal_file);
+	journal_file = NULL;
+	g_free(journal_filename);
+	journal_filename = NULL;
+	if(journal_data != NULL)
+		g_byte_array_unref(journal_data);
+	journal_data = NULL;
+	if(records != NULL)
+		g_array_free(records, TRUE);
+	records = NULL;
+	if(undo_stack != NULL)
+		g_array_free(undo_stack, TRUE);
+	undo_stack = NULL;
+	if(redo_stack != NULL)
+		g_array_free(redo_stack, TRUE);
+	redo_stack = NULL;
+	if(pending.expected != NULL)
+		g_array_free(pending.expected, TRUE);
+	memset(&pending, 0, sizeof(pending));
+}
+
+/* Helper to forget about the undo, redo or restore we were waiting for */
+static void dnafx_journal_pending_clear(void) {
+	pending.set = FALSE;
+	pending.next = 0;
+	if(pending.expected != NULL)
+		g_array_set_size(pending.expected, 0);
+}
+
+/* Helper to check if an upload is the next one we're waiting for */
+static gboolean dnafx_journal_pending_match(int slot, const uint8_t *image) {
+	if(!pending.set || pending.next >= pending.expected->len)
+		return FALSE;
+	dnafx_journal_expected *e = &g_array_index(pending.expected, dnafx_journal_expected, pending.next);
+	if(e->slot != slot || e->hash != dnafx_journal_hash(image)) {
+		/* Something else got uploaded, this isn't what we were waiting for */
+		dnafx_journal_pending_clear();
+		return FALSE;
+	}
+	pending.next++;
+	return TRUE;
+}
+
+void dnafx_journal_batch_begin(void) {
+	batch_open = TRUE;
+	batch_empty = TRUE;
+}
+
+void dnafx_journal_batch_end(gboolean success) {
+	if(!success && pending.set && pending.next < pending.expected->len) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "Journal %s interrupted, %u/%u presets uploaded\n",
+			dnafx_journal_kind_str(pending.kind), pending.next, pending.expected->len);
+	}
+	batch_open = FALSE;
+	batch_empty = TRUE;
+	dnafx_journal_pending_clear();
+}
+
+void dnafx_journal_record(int slot, const uint8_t *old_image, const uint8_t *new_image) {
+	if(journal_file == NULL || new_image == NULL || slot < 1 || slot > DNAFX_PRESETS_NUM)
+		return;
+	/* Undo and redo are recorded even when the slot was unchanged, or
+	 * their step would never be moved from one stack to the other */
+	gboolean expected = dnafx_journal_pending_match(slot, new_image);
+	if(old_image != NULL && !memcmp(old_image + 1, new_image + 1, DNAFX_PRESET_SIZE - 1) &&
+			(!expected || pending.kind == DNAFX_JOURNAL_RESTORE))
+		return;
+	/* Make sure we can always find what was there before */
+	if(!snapshot_taken || since_snapshot >= DNAFX_JOURNAL_SNAPSHOT)
+		dnafx_journal_snapshot();
+	dnafx_journal_entry_header header = { 0 };
+	header.type = DNAFX_JOURNAL_CHANGE;
+	header.kind = expected ? pending.kind : DNAFX_JOURNAL_DO;
+	if(pending.set && pending.next >= pending.expected->len)
+		dnafx_journal_pending_clear();
+	if(batch_open && !batch_empty)
+		header.flags = DNAFX_JOURNAL_GROUPED;
+	header.slot = slot;
+	header.time = GINT64_TO_LE(g_get_real_time());
+	header.hash = GUINT64_TO_LE(dnafx_journal_hash(old_image));
+	uint8_t image[DNAFX_PRESET_SIZE];
+	memcpy(image, new_image, DNAFX_PRESET_SIZE);
+	image[0] = slot;
+	if(dnafx_journal_append(&header, image, sizeof(image)) == 0)
+		batch_empty = FALSE;
+}
+
+/* Helper to find the image a slot had before an entry (and not after a time) */
+static const uint8_t *dnafx_journal_image_before(guint index, int slot, gint64 when) {
+	dnafx_journal_entry *r = NULL;
+	const uint8_t *snapshot = NULL;
+	int i = 0, rank = 0;
+	while(index > 0) {
+		index--;
+		r = &g_array_index(records, dnafx_journal_entry, index);
+		if(when >= 0 && r->time > when)
+			continue;
+		if(r->type == DNAFX_JOURNAL_CHANGE) {
+			if(r->slot == slot)
+				return journal_data->data + r->offset;
+			continue;
+		}
+		/* Snapshots are an index of filled slots, followed by their images */
+		snapshot = journal_data->data + r->offset;
+		if(!snapshot[slot-1])
+			return NULL;
+		for(i=0; i<slot-1; i++)
+			rank += snapshot[i] ? 1 : 0;
+		return snapshot + DNAFX_PRESETS_NUM + rank*DNAFX_PRESET_SIZE;
+	}
+	return NULL;
+}
+
+/* Helper to collect the changes of the step starting at an index */
+static GArray *dnafx_journal_step(guint index) {
+	GArray *step = g_array_new(FALSE, FALSE, sizeof(guint));
+	dnafx_journal_entry *r = NULL;
+	guint i = 0;
+	for(i=index; i<records->len; i++) {
+		r = &g_array_index(records, dnafx_journal_entry, i);
+		if(r->type != DNAFX_JOURNAL_CHANGE)
+			continue;
+		if(i > index && !(r->flags & DNAFX_JOURNAL_GROUPED))
+			break;
+		g_array_append_val(step, i);
+	}
+	return step;
+}
+
+/* Helper to add an image to the uploads, and remember what it's for */
+static void dnafx_journal_upload(GByteArray *uploads, const uint8_t *image, int slot, dnafx_journal_kind kind) {
+	g_byte_array_append(uploads, image, DNAFX_PRESET_SIZE);
+	uploads->data[uploads->len - DNAFX_PRESET_SIZE] = slot;
+	pending.set = TRUE;
+	pending.kind = kind;
+	dnafx_journal_expected e = { .slot = slot, .hash = dnafx_journal_hash(image) };
+	g_array_append_val(pending.expected, e);
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	dnafx_preset_image_name(image, name, sizeof(name));
+	DNAFX_LOG(DNAFX_LOG_INFO, "Journal %s: preset '%s' back to slot %d\n", dnafx_journal_kind_str(kind), name, slot);
+}
+
+GByteArray *dnafx_journal_undo(void) {
+	dnafx_journal_pending_clear();
+	if(journal_file == NULL || undo_stack->len == 0) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "Nothing to undo\n");
+		return NULL;
+	}
+	guint index = g_array_index(undo_stack, guint, undo_stack->len - 1);
+	GArray *step = dnafx_journal_step(index);
+	GByteArray *uploads = g_byte_array_sized_new(step->len * DNAFX_PRESET_SIZE);
+	dnafx_journal_entry *r = NULL;
+	const uint8_t *image = NULL, *current = NULL;
+	guint i = step->len;
+	while(i > 0) {
+		/* Go backwards, in case the same slot changed more than once */
+		i--;
+		index = g_array_index(step, guint, i);
+		r = &g_array_index(records, dnafx_journal_entry, index);
+		image = dnafx_journal_image_before(index, r->slot, -1);
+		if(image == NULL || dnafx_journal_hash(image) != r->hash) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Can't undo, what was in slot %d isn't in the journal\n", r->slot);
+			g_byte_array_unref(uploads);
+			uploads = NULL;
+			dnafx_journal_pending_clear();
+			break;
+		}
+		current = dnafx_preset_slot_image(r->slot);
+		if(current != NULL && dnafx_journal_hash(current) != dnafx_journal_hash(journal_data->data + r->offset)) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Slot %d changed since, undoing anyway\n", r->slot);
+		}
+		dnafx_journal_upload(uploads, image, r->slot, DNAFX_JOURNAL_UNDO);
+	}
+	g_array_free(step, TRUE);
+	return uploads;
+}
+
+GByteArray *dnafx_journal_redo(void) {
+	dnafx_journal_pending_clear();
+	if(journal_file == NULL || redo_stack->len == 0) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "Nothing to redo\n");
+		return NULL;
+	}
+	guint index = g_array_index(redo_stack, guint, redo_stack->len - 1);
+	GArray *step = dnafx_journal_step(index);
+	GByteArray *uploads = g_byte_array_sized_new(step->len * DNAFX_PRESET_SIZE);
+	dnafx_journal_entry *r = NULL;
+	guint i = 0;
+	for(i=0; i<step->len; i++) {
+		r = &g_array_index(records, dnafx_journal_entry, g_array_index(step, guint, i));
+		dnafx_journal_upload(uploads, journal_data->data + r->offset, r->slot, DNAFX_JOURNAL_REDO);
+	}
+	g_array_free(step, TRUE);
+	return uploads;
+}
+
+gint64 dnafx_journal_parse_time(const char *text) {
+	if(text == NULL || *text == '\0')
+		return -1;
+	char *end = NULL;
+	gint64 value = 0;
+	if(*text == '-') {
+		/* Relative to now */
+		value = g_ascii_strtoll(text + 1, &end, 10);
+		if(end == text + 1 || value < 0)
+			return -1;
+		gint64 unit = 0;
+		if(*end == 's' || *end == '\0')
+			unit = 1;
+		else if(*end == 'm')
+			unit = 60;
+		else if(*end == 'h')
+			unit = 3600;
+		else if(*end == 'd')
+			unit = 86400;
+		if(unit == 0 || (*end != '\0' && *(end + 1) != '\0'))
+			return -1;
+		return g_get_real_time() - value * unit * G_USEC_PER_SEC;
+	}
+	value = g_ascii_strtoll(text, &end, 10);
+	if(end != text && *end == '\0')
+		return value * G_USEC_PER_SEC;
+	GTimeZone *tz = g_time_zone_new_local();
+	GDateTime *dt = g_date_time_new_from_iso8601(text, tz);
+	g_time_zone_unref(tz);
+	if(dt == NULL)
+		return -1;
+	value = g_date_time_to_unix(dt) * G_USEC_PER_SEC + g_date_time_get_microsecond(dt);
+	g_date_time_unref(dt);
+	return value;
+}
+
+GByteArray *dnafx_journal_restore(int slot, gint64 when) {
+	dnafx_journal_pending_clear();
+	if(journal_file == NULL || slot < 1 || slot > DNAFX_PRESETS_NUM || when < 0) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return NULL;
+	}
+	const uint8_t *image = dnafx_journal_image_before(records->len, slot, when);
+	if(image == NULL) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "The journal doesn't know what was in slot %d at that time\n", slot);
+		return NULL;
+	}
+	const uint8_t *current = dnafx_preset_slot_image(slot);
+	if(current != NULL && !memcmp(current + 1, image + 1, DNAFX_PRESET_SIZE - 1)) {
+		DNAFX_LOG(DNAFX_LOG_INFO, "Slot %d is the same as it was then, nothing to restore\n", slot);
+		return g_byte_array_new();
+	}
+	GByteArray *uploads = g_byte_array_sized_new(DNAFX_PRESET_SIZE);
+	dnafx_journal_upload(uploads, image, slot, DNAFX_JOURNAL_RESTORE);
+	return uploads;
+}
+
+json_t *dnafx_journal_history(int slot, int limit) {
+	if(journal_file == NULL)
+		return NULL;
+	if(limit <= 0)
+		limit = DNAFX_JOURNAL_HISTORY_LIMIT;
+	json_t *history = json_array();
+	dnafx_journal_entry *r = NULL;
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	guint index = records->len;
+	while(index > 0 && json_array_size(history) < (size_t)limit) {
+		index--;
+		r = &g_array_index(records, dnafx_journal_entry, index);
+		if(r->type != DNAFX_JOURNAL_CHANGE || (slot > 0 && r->slot != slot))
+			continue;
+		json_t *change = json_object();
+		json_object_set_new(change, "slot", json_integer(r->slot));
+		dnafx_preset_image_name(journal_data->data + r->offset, name, sizeof(name));
+		json_object_set_new(change, "name", json_string(name));
+		json_object_set_new(change, "change", json_string(dnafx_journal_kind_str(r->kind)));
+		json_object_set_new(change, "time", json_integer(r->time / G_USEC_PER_SEC));
+		if(r->flags & DNAFX_JOURNAL_GROUPED)
+			json_object_set_new(change, "batch", json_true());
+		json_array_append_new(history, change);
+	}
+	return history;
+}
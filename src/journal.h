@@ -0,0 +1,48 @@
+#ifndef DNAFX_JOURNAL
+#define DNAFX_JOURNAL
+
+#include <stdint.h>
+
+#include <glib.h>
+#include <jansson.h>
+
+/* The journal is an append-only file keeping track of every preset we
+ * upload to a device slot: each entry has the slot, a hash of the image
+ * that was there before (ignoring its name), and the new image. Changes
+ * made by the same batch (e.g., a sync or a move) are flagged as a group,
+ * so that they're undone and redone as one step. A snapshot of all slots
+ * is added the first time something changes after startup, and then again
+ * every DNAFX_JOURNAL_SNAPSHOT changes, so that the image that was in a
+ * slot at any time can be found without a bank download, and without
+ * going through the whole journal. Changes can be undone and redone (the
+ * undo and redo stacks are rebuilt from the journal at startup), and a
+ * slot can be restored as it was at a specific time, which can be a Unix
+ * timestamp, an ISO 8601 date or a relative time (e.g., -2h, -30m, -1d) */
+#define DNAFX_JOURNAL_MAGIC		"DNAFXJNL"
+#define DNAFX_JOURNAL_VERSION	1
+#define DNAFX_JOURNAL_SNAPSHOT	64
+#define DNAFX_JOURNAL_HISTORY_LIMIT	20
+
+/* Journal management */
+int dnafx_journal_init(const char *filename);
+gboolean dnafx_journal_enabled(void);
+void dnafx_journal_deinit(void);
+
+/* Keep track of an upload to a slot, before the local view is updated */
+void dnafx_journal_record(int slot, const uint8_t *old_image, const uint8_t *new_image);
+/* Changes recorded between these belong to the same undo step: ending a
+ * batch also forgets about any undo, redo or restore that didn't complete */
+void dnafx_journal_batch_begin(void);
+void dnafx_journal_batch_end(gboolean success);
+
+/* The images to upload (with the slot as first byte) to undo the last
+ * step, redo the last undone one, or restore a slot as it was */
+GByteArray *dnafx_journal_undo(void);
+GByteArray *dnafx_journal_redo(void);
+gint64 dnafx_journal_parse_time(const char *text);
+GByteArray *dnafx_journal_restore(int slot, gint64 when);
+
+/* The most recent changes, for all slots (slot=0) or a specific one */
+json_t *dnafx_journal_history(int slot, int limit);
+
+#endif
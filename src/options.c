@@ -1,24 +1,41 @@
 #include "options.h"
+#include "httpws.h"
 #include "debug.h"
 
 static GOptionContext *opts = NULL;
 
 gboolean dnafx_options_parse(dnafx_options *options, int argc, char *argv[]) {
+	/* The number of service threads depends on how libwebsockets was built */
+	static char threads_range[16];
+	g_snprintf(threads_range, sizeof(threads_range), "1-%d", dnafx_httpws_max_threads());
 	/* Supported command-line arguments */
 	GOptionEntry opt_entries[] = {
 		{ "interactive", 'i', 0, G_OPTION_ARG_NONE, &options->interactive, "Provide a CLI to interact with the device (default=no, quit when done)", NULL },
 		{ "http-ws", 'H', 0, G_OPTION_ARG_INT, &options->http_port, "Espose an HTTP/WebSocket API on the provided port (default=0, disabled)", NULL },
+		{ "http-unix", 'U', 0, G_OPTION_ARG_STRING, &options->http_unix, "Expose the HTTP/WebSocket API on a Unix domain socket too, only accessible by owner and group (default=none)", "path" },
+		{ "http-threads", 'T', 0, G_OPTION_ARG_INT, &options->http_threads, "Number of threads to serve the HTTP/WebSocket API with (default=1)", threads_range },
+		{ "http-queue-messages", 'm', 0, G_OPTION_ARG_INT, &options->http_queue_messages, "Maximum number of messages queued for a slow HTTP/WebSocket client (default=256)", "messages" },
+		{ "http-queue-bytes", 'M', 0, G_OPTION_ARG_INT, &options->http_queue_bytes, "Maximum number of bytes queued for a slow HTTP/WebSocket client (default=1048576)", "bytes" },
+		{ "http-queue-policy", 'Q', 0, G_OPTION_ARG_STRING, &options->http_queue_policy, "What to do when a client exceeds its queue budget (default=drop-oldest)", "drop-oldest|coalesce|disconnect" },
 		{ "offline", 'o', 0, G_OPTION_ARG_NONE, &options->offline, "Don't connect to the device via USB (default=always connect)", NULL },
 		{ "no-init", 'I', 0, G_OPTION_ARG_NONE, &options->no_init, "Don't send the initialization messages at startup (default=no)", NULL },
 		{ "no-get-presets", 'G', 0, G_OPTION_ARG_NONE, &options->no_get_presets, "Don't retrieve all presets at startup (default=no)", NULL },
 		{ "no-get-extras", 'E', 0, G_OPTION_ARG_NONE, &options->no_get_extras, "Don't retrieve extras (IRs?) at startup (default=no)", NULL },
+		{ "cache-folder", 'y', 0, G_OPTION_ARG_STRING, &options->cache_folder, "Folder to cache the last known state of the device to, by serial number (default=none, no cache)", "path" },
+		{ "warm-start", 'w', 0, G_OPTION_ARG_NONE, &options->warm_start, "Serve the cached state of the device at startup, and then revalidate it against the device (default=no, needs --cache-folder)", NULL },
+		{ "journal", 'j', 0, G_OPTION_ARG_STRING, &options->journal, "Journal file to keep track of all uploads to the device in, for undo/redo/restore (default=none)", "path" },
 		{ "save-presets", 's', 0, G_OPTION_ARG_STRING, &options->save_presets_folder, "Folder to store all retrieved presets to by default (default=none, don't save presets)", "path" },
+		{ "save-bank", 'k', 0, G_OPTION_ARG_STRING, &options->save_bank, "Bank file to store all retrieved presets to, as a single file (default=none)", "path" },
+		{ "load-bank", 'K', 0, G_OPTION_ARG_STRING, &options->load_bank, "Bank file to import presets from at startup (default=none)", "path" },
+		{ "load-archive", 'a', 0, G_OPTION_ARG_STRING, &options->load_archive, "Archive file to import presets from at startup (default=none)", "path" },
 		{ "change-preset", 'c', 0, G_OPTION_ARG_INT, &options->change_preset, "Change the current preset at startup (default=0, which means no)", "1-200" },
 		{ "preset-in", 'b', 0, G_OPTION_ARG_STRING_ARRAY, &options->preset_file_in, "Binary preset file to read at startup (can be called more than once; default=none)", "path" },
 		{ "preset-out", 'B', 0, G_OPTION_ARG_STRING, &options->preset_file_out, "Binary preset file to write at startup (default=none)", "path" },
 		{ "phb-in", 'p', 0, G_OPTION_ARG_STRING_ARRAY, &options->phb_file_in, "PHB preset file to read at startup (can be called more than once; default=none)", "path" },
 		{ "phb-out", 'P', 0, G_OPTION_ARG_STRING, &options->phb_file_out, "PHB preset file to write at startup (default=none)", "path" },
 		{ "upload-preset", 'u', 0, G_OPTION_ARG_INT, &options->upload_preset, "Upload the imported preset to the specified preset number (default=0, don't upload anything)", "1-200" },
+		{ "pipe-in", 'x', 0, G_OPTION_ARG_STRING, &options->pipe_in, "Convert a stream of presets from stdin to stdout, reading them in this format (default=binary)", "binary|ndjson|framed" },
+		{ "pipe-out", 'X', 0, G_OPTION_ARG_STRING, &options->pipe_out, "Convert a stream of presets from stdin to stdout, writing them in this format (default=binary)", "binary|ndjson|framed" },
 		{ "debug-level", 'd', 0, G_OPTION_ARG_INT, &options->debug_level, "Debug/logging level (0=disable debugging, 7=maximum debug level; default=4)", "0-7" },
 		{ "debug-timestamps", 't', 0, G_OPTION_ARG_NONE, &options->debug_timestamps, "Enable debug/logging timestamps", NULL },
 		{ "disable-colors", 'C', 0, G_OPTION_ARG_NONE, &options->disable_colors, "Disable color in the logging", NULL },
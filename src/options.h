@@ -6,13 +6,22 @@
 /* Struct containing the parsed command line options */
 typedef struct dnafx_options {
 	gboolean interactive;
-	int http_port;
+	int http_port, http_threads;
+	const char *http_unix;
+	int http_queue_messages, http_queue_bytes;
+	const char *http_queue_policy;
 	gboolean offline;
 	gboolean no_init, no_get_presets, no_get_extras;
+	const char *cache_folder;
+	gboolean warm_start;
+	const char *journal;
 	const char *save_presets_folder;
+	const char *save_bank, *load_bank;
+	const char *load_archive;
 	int change_preset, upload_preset;
 	const char **preset_file_in, *preset_file_out;
 	const char **phb_file_in, *phb_file_out;
+	const char *pipe_in, *pipe_out;
 	int debug_level;
 	gboolean debug_timestamps;
 	gboolean disable_colors;
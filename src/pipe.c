@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "pipe.h"
+#include "presets.h"
+#include "debug.h"
+
+/* Supported formats */
+typedef enum dnafx_pipe_format {
+	DNAFX_PIPE_BINARY = 0,
+	DNAFX_PIPE_NDJSON,
+	DNAFX_PIPE_FRAMED,
+	DNAFX_PIPE_INVALID
+} dnafx_pipe_format;
+static dnafx_pipe_format dnafx_pipe_format_parse(const char *name) {
+	if(name == NULL || !strcasecmp(name, "binary"))
+		return DNAFX_PIPE_BINARY;
+	else if(!strcasecmp(name, "ndjson"))
+		return DNAFX_PIPE_NDJSON;
+	else if(!strcasecmp(name, "framed"))
+		return DNAFX_PIPE_FRAMED;
+	return DNAFX_PIPE_INVALID;
+}
+
+/* Helper to parse a payload that may be a wire image or a PHB document */
+static dnafx_preset *dnafx_pipe_parse(uint8_t *payload, size_t len) {
+	if(len == DNAFX_PRESET_SIZE && payload[0] != '{')
+		return dnafx_preset_from_bytes(payload, len);
+	return dnafx_preset_from_phb_buffer((const char *)payload, len);
+}
+
+/* Read the next preset from stdin: returns 1 if a preset was read (which
+ * is NULL if it was invalid), 0 at the end of the stream, or -1 if the
+ * stream is broken and we can't go on; the buffer is reused every time */
+static int dnafx_pipe_read(dnafx_pipe_format format, GByteArray *buffer, dnafx_preset **preset) {
+	*preset = NULL;
+	g_byte_array_set_size(buffer, 0);
+	if(format == DNAFX_PIPE_BINARY) {
+		g_byte_array_set_size(buffer, DNAFX_PRESET_SIZE);
+		size_t read = fread(buffer->data, 1, DNAFX_PRESET_SIZE, stdin);
+		if(read == 0 && feof(stdin))
+			return 0;
+		if(read < DNAFX_PRESET_SIZE) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Truncated preset in stream (%zu/%d bytes)\n", read, DNAFX_PRESET_SIZE);
+			return -1;
+		}
+		*preset = dnafx_preset_from_bytes(buffer->data, DNAFX_PRESET_SIZE);
+		return 1;
+	} else if(format == DNAFX_PIPE_NDJSON) {
+		/* Read a line, skipping empty ones */
+		int c = 0;
+		gboolean overflow = FALSE;
+		while(TRUE) {
+			c = getc_unlocked(stdin);
+			if(c == EOF || c == '\n') {
+				if(buffer->len == 0 && !overflow) {
+					if(c == EOF)
+						return 0;
+					continue;
+				}
+				break;
+			}
+			if(buffer->len == DNAFX_PIPE_MAX_FRAME) {
+				/* Line too long, drop it */
+				overflow = TRUE;
+				continue;
+			}
+			uint8_t byte = c;
+			g_byte_array_append(buffer, &byte, 1);
+		}
+		if(overflow) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Line too long in stream (more than %d bytes)\n", DNAFX_PIPE_MAX_FRAME);
+			return 1;
+		}
+		*preset = dnafx_preset_from_phb_buffer((const char *)buffer->data, buffer->len);
+		return 1;
+	} else if(format == DNAFX_PIPE_FRAMED) {
+		uint32_t header = 0;
+		size_t read = fread(&header, 1, sizeof(header), stdin);
+		if(read == 0 && feof(stdin))
+			return 0;
+		if(read < sizeof(header)) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Truncated frame header in stream\n");
+			return -1;
+		}
+		uint32_t len = GUINT32_FROM_BE(header);
+		if(len > DNAFX_PIPE_MAX_FRAME) {
+			/* Frame too large, skip it without buffering it */
+			DNAFX_LOG(DNAFX_LOG_ERR, "Frame too large in stream (%"SCNu32" bytes)\n", len);
+			uint8_t discard[4096];
+			size_t chunk = 0;
+			while(len > 0) {
+				chunk = len > sizeof(discard) ? sizeof(discard) : len;
+				if(fread(discard, 1, chunk, stdin) < chunk) {
+					DNAFX_LOG(DNAFX_LOG_ERR, "Truncated frame in stream\n");
+					return -1;
+				}
+				len -= chunk;
+			}
+			return 1;
+		}
+		g_byte_array_set_size(buffer, len);
+		if(len > 0 && fread(buffer->data, 1, len, stdin) < len) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Truncated frame in stream\n");
+			return -1;
+		}
+		if(len > 0)
+			*preset = dnafx_pipe_parse(buffer->data, len);
+		return 1;
+	}
+	return -1;
+}
+
+/* Write a preset to stdout in the requested format */
+static int dnafx_pipe_write(dnafx_pipe_format format, GString *text, dnafx_preset *preset) {
+	if(format == DNAFX_PIPE_BINARY) {
+		uint8_t image[DNAFX_PRESET_SIZE];
+		if(dnafx_preset_to_bytes(preset, image, sizeof(image)) < 0)
+			return -1;
+		return fwrite(image, 1, sizeof(image), stdout) == sizeof(image) ? 0 : -1;
+	}
+	g_string_truncate(text, 0);
+	if(format == DNAFX_PIPE_FRAMED) {
+		/* Leave room for the length, we'll fill it in later */
+		g_string_append_len(text, "\0\0\0\0", 4);
+	}
+	int len = dnafx_preset_write_phb(preset, text, format == DNAFX_PIPE_NDJSON);
+	if(len < 0)
+		return -1;
+	if(format == DNAFX_PIPE_NDJSON) {
+		g_string_append_c(text, '\n');
+	} else {
+		uint32_t header = GUINT32_TO_BE((uint32_t)len);
+		memcpy(text->str, &header, sizeof(header));
+	}
+	return fwrite(text->str, 1, text->len, stdout) == text->len ? 0 : -1;
+}
+
+/* Pipe mode */
+int dnafx_pipe_run(const char *format_in, const char *format_out) {
+	dnafx_pipe_format in = dnafx_pipe_format_parse(format_in);
+	dnafx_pipe_format out = dnafx_pipe_format_parse(format_out);
+	if(in == DNAFX_PIPE_INVALID || out == DNAFX_PIPE_INVALID) {
+		DNAFX_LOG(DNAFX_LOG_FATAL, "Invalid pipe format '%s', should be binary, ndjson or framed\n",
+			in == DNAFX_PIPE_INVALID ? format_in : format_out);
+		return -1;
+	}
+	/* We only ever need a single preset in memory at a time */
+	static char inbuf[65536], outbuf[65536];
+	setvbuf(stdin, inbuf, _IOFBF, sizeof(inbuf));
+	setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+	GByteArray *buffer = g_byte_array_sized_new(DNAFX_PRESET_SIZE);
+	GString *text = g_string_sized_new(2048);
+	dnafx_preset *preset = NULL;
+	int ret = 0, converted = 0, failed = 0;
+	gint64 start = g_get_monotonic_time();
+	while((ret = dnafx_pipe_read(in, buffer, &preset)) > 0) {
+		if(preset == NULL) {
+			failed++;
+			continue;
+		}
+		if(dnafx_pipe_write(out, text, preset) < 0) {
+			if(ferror(stdout)) {
+				DNAFX_LOG(DNAFX_LOG_ERR, "Error writing to the stream\n");
+				dnafx_preset_free(preset);
+				ret = -1;
+				break;
+			}
+			failed++;
+		} else {
+			converted++;
+		}
+		dnafx_preset_free(preset);
+	}
+	if(fflush(stdout) != 0)
+		ret = -1;
+	g_byte_array_unref(buffer);
+	g_string_free(text, TRUE);
+	gint64 elapsed = g_get_monotonic_time() - start;
+	DNAFX_LOG(DNAFX_LOG_INFO, "Converted %d presets (%d failed) in %"SCNi64"ms\n",
+		converted, failed, elapsed/1000);
+	return ret < 0 ? -1 : failed;
+}
@@ -0,0 +1,19 @@
+#ifndef DNAFX_PIPE
+#define DNAFX_PIPE
+
+#include <glib.h>
+
+/* In pipe mode presets are read as a stream from stdin, and written in
+ * the target format to stdout, one at a time. Supported formats are:
+ * 	- "binary": 184 bytes wire images, concatenated;
+ * 	- "ndjson": one PHB document per line (compact, when writing);
+ * 	- "framed": a 4 bytes length (network order) followed by a payload,
+ * 	  which is either a 184 bytes wire image or a PHB document (always
+ * 	  PHB when writing, formatted as the official editor does) */
+#define DNAFX_PIPE_MAX_FRAME	65536
+
+/* Convert all presets from stdin to stdout, returning the number of
+ * presets that couldn't be converted, or -1 in case of fatal errors */
+int dnafx_pipe_run(const char *format_in, const char *format_out);
+
+#endif
@@ -2,19 +2,69 @@
 
 #include "presets.h"
 #include "effects.h"
+#include "session.h"
 #include "utils.h"
 #include "debug.h"
 
-/* Tables */
-static dnafx_preset *presets[DNAFX_PRESETS_NUM];
+/* Tables: device slots and named presets both hold a reference to the
+ * record in the store, while decoded views are cached by handle */
+static dnafx_store_handle presets[DNAFX_PRESETS_NUM];
 static GHashTable *presets_byname = NULL;
+static GHashTable *presets_views = NULL;
+/* Names sorted ignoring case, rebuilt when needed after names change, and
+ * the next numeric suffix to try for each name that had a collision */
+static GPtrArray *presets_names = NULL;
+static gboolean presets_names_dirty = TRUE;
+static guint presets_names_version = 0;
+static GHashTable *presets_suffixes = NULL;
+static void dnafx_presets_names_changed(void);
+/* Sorted listings, for paging, rebuilt when needed after changes */
+typedef struct dnafx_presets_entry {
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	uint8_t slot;
+	guint64 stamp;
+	dnafx_store_handle handle;
+} dnafx_presets_entry;
+static struct {
+	GArray *entries;
+	guint64 generation;
+	guint version;
+} presets_pages[DNAFX_PRESETS_SORT_MODIFIED+1];
+static void dnafx_presets_unref(dnafx_store_handle handle);
+static void dnafx_presets_release(gpointer data);
+static dnafx_preset *dnafx_presets_view(dnafx_store_handle handle);
+static gboolean dnafx_presets_in_slot(dnafx_store_handle handle);
+static dnafx_store_handle dnafx_presets_known(const uint8_t *image, gboolean slot);
+static dnafx_store_handle dnafx_presets_add_image(const uint8_t *image, gboolean slot, gboolean *known);
+static int dnafx_presets_assign(dnafx_store_handle handle, int id);
+
+/* Offsets of the sections and expressions in a wire image */
+static size_t image_sections[DNAFX_PRESET_EFFECTS];
+static size_t image_expressions = 0;
+static void dnafx_presets_image_offsets(void) {
+	if(image_expressions > 0)
+		return;
+	size_t offset = 1 + DNAFX_PRESET_NAME_SIZE, i = 0;
+	for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+		image_sections[i] = offset;
+		offset += dnafx_sections[i].size;
+	}
+	image_expressions = offset;
+}
 
 /* Presets state */
 static char *presets_folder = NULL;
 int dnafx_presets_init(const char *folder) {
 	memset(presets, 0, sizeof(presets));
+	dnafx_presets_image_offsets();
+	dnafx_store_init();
 	presets_byname = g_hash_table_new_full(g_str_hash, g_str_equal,
-		(GDestroyNotify)g_free, (GDestroyNotify)dnafx_preset_free);
+		(GDestroyNotify)g_free, (GDestroyNotify)dnafx_presets_release);
+	presets_views = g_hash_table_new_full(NULL, NULL,
+		NULL, (GDestroyNotify)dnafx_preset_free);
+	presets_names = g_ptr_array_new();
+	presets_names_dirty = TRUE;
+	presets_suffixes = g_hash_table_new_full(g_str_hash, g_str_equal, (GDestroyNotify)g_free, NULL);
 	if(folder == NULL) {
 		DNAFX_LOG(DNAFX_LOG_INFO, "Presets folder: none (won't save retrieved presets)\n");
 		return 0;
@@ -53,11 +103,145 @@ char *dnafx_presets_folder(void) {
 }
 
 void dnafx_presets_deinit(void) {
+	int i = 0;
 	g_free(presets_folder);
 	presets_folder = NULL;
+	if(presets_names != NULL)
+		g_ptr_array_unref(presets_names);
+	presets_names = NULL;
+	for(i=0; i<=DNAFX_PRESETS_SORT_MODIFIED; i++) {
+		if(presets_pages[i].entries != NULL)
+			g_array_unref(presets_pages[i].entries);
+		presets_pages[i].entries = NULL;
+	}
+	if(presets_suffixes != NULL)
+		g_hash_table_unref(presets_suffixes);
+	presets_suffixes = NULL;
 	if(presets_byname != NULL)
 		g_hash_table_unref(presets_byname);
 	presets_byname = NULL;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		dnafx_presets_unref(presets[i]);
+		presets[i] = DNAFX_STORE_INVALID;
+	}
+	if(presets_views != NULL)
+		g_hash_table_unref(presets_views);
+	presets_views = NULL;
+	dnafx_store_deinit();
+}
+
+/* Store helpers */
+static void dnafx_presets_unref(dnafx_store_handle handle) {
+	if(handle == DNAFX_STORE_INVALID)
+		return;
+	if(dnafx_store_unref(handle) == 0 && presets_views != NULL) {
+		/* The record is gone, and so is its view */
+		g_hash_table_remove(presets_views, GUINT_TO_POINTER(handle));
+	}
+}
+
+static void dnafx_presets_release(gpointer data) {
+	dnafx_presets_unref(GPOINTER_TO_UINT(data));
+}
+
+static dnafx_preset *dnafx_presets_view(dnafx_store_handle handle) {
+	if(handle == DNAFX_STORE_INVALID || presets_views == NULL)
+		return NULL;
+	dnafx_preset *preset = g_hash_table_lookup(presets_views, GUINT_TO_POINTER(handle));
+	if(preset != NULL)
+		return preset;
+	/* Decode the record the first time somebody needs it */
+	uint8_t *image = dnafx_store_image(handle);
+	if(image == NULL)
+		return NULL;
+	preset = dnafx_preset_from_bytes(image, DNAFX_PRESET_SIZE);
+	if(preset == NULL)
+		return NULL;
+	preset->handle = handle;
+	if(!dnafx_presets_in_slot(handle))
+		preset->id = 0;
+	g_hash_table_insert(presets_views, GUINT_TO_POINTER(handle), preset);
+	return preset;
+}
+
+static gboolean dnafx_presets_in_slot(dnafx_store_handle handle) {
+	uint8_t *image = dnafx_store_image(handle);
+	if(image == NULL || image[0] < 1 || image[0] > DNAFX_PRESETS_NUM)
+		return FALSE;
+	return presets[image[0]-1] == handle;
+}
+
+/* Make sure a name is unique in the library, appending a number if needed:
+ * we remember the next number to try for each name, rather than probing
+ * from 2 each time, and shorten the name when it's too long for the suffix */
+static int dnafx_presets_unique_name(char *name, size_t len) {
+	if(!g_hash_table_contains(presets_byname, name))
+		return 0;
+	char base[DNAFX_PRESET_NAME_SIZE+1], digits[8];
+	g_snprintf(base, sizeof(base), "%s", name);
+	size_t max = MIN(len - 1, DNAFX_PRESET_NAME_SIZE), b_len = strlen(base), d_len = 0;
+	guint suffix = GPOINTER_TO_UINT(g_hash_table_lookup(presets_suffixes, base));
+	if(suffix < 2)
+		suffix = 2;
+	do {
+		d_len = g_snprintf(digits, sizeof(digits), "%u", suffix);
+		if(suffix > DNAFX_PRESETS_MAX_SUFFIX || d_len >= max) {
+			/* Too many attempts or name too short to edit */
+			return -1;
+		}
+		g_snprintf(name, len, "%.*s%s", (int)MIN(b_len, max - d_len), base, digits);
+		suffix++;
+	} while(g_hash_table_contains(presets_byname, name));
+	g_hash_table_insert(presets_suffixes, g_strdup(base), GUINT_TO_POINTER(suffix));
+	return 0;
+}
+
+/* Sorted names index */
+static int dnafx_presets_names_compare(gconstpointer a, gconstpointer b) {
+	const char *na = *(const char **)a, *nb = *(const char **)b;
+	int res = g_ascii_strcasecmp(na, nb);
+	return res ? res : strcmp(na, nb);
+}
+
+static void dnafx_presets_names_changed(void) {
+	presets_names_dirty = TRUE;
+	presets_names_version++;
+}
+
+static void dnafx_presets_names_update(void) {
+	if(!presets_names_dirty || presets_names == NULL)
+		return;
+	g_ptr_array_set_size(presets_names, 0);
+	GHashTableIter iter;
+	gpointer key = NULL;
+	g_hash_table_iter_init(&iter, presets_byname);
+	while(g_hash_table_iter_next(&iter, &key, NULL))
+		g_ptr_array_add(presets_names, key);
+	g_ptr_array_sort(presets_names, dnafx_presets_names_compare);
+	presets_names_dirty = FALSE;
+}
+
+/* Fuzzy matching: all characters of the query must appear in the name in
+ * the same order, and matches at the start of words or right after the
+ * previous match score more; returns -1 if the name doesn't match */
+static int dnafx_presets_fuzzy_score(const char *name, const char *query) {
+	int score = 0, last = -2, i = 0;
+	const char *q = query;
+	for(i=0; name[i] && *q; i++) {
+		if(g_ascii_tolower(name[i]) != g_ascii_tolower(*q))
+			continue;
+		score += 1;
+		if(i == last + 1)
+			score += 5;
+		if(i == 0 || !g_ascii_isalnum(name[i-1]))
+			score += 3;
+		last = i;
+		q++;
+	}
+	if(*q)
+		return -1;
+	/* Shorter names are closer matches */
+	return MAX(score * 16 - (int)strlen(name), 0);
 }
 
 /* Presets structure */
@@ -89,6 +273,159 @@ void dnafx_preset_free(dnafx_preset *preset) {
 	g_free(preset);
 }
 
+/* Zero-copy access to the fields of a wire image */
+static int dnafx_image_get16(const uint8_t *image, size_t offset) {
+	uint16_t value = 0;
+	memcpy(&value, image + offset, 2);
+	return value;
+}
+
+static void dnafx_image_set16(uint8_t *image, size_t offset, uint16_t value) {
+	memcpy(image + offset, &value, 2);
+}
+
+int dnafx_preset_image_set_name(uint8_t *image, const char *name) {
+	if(image == NULL || name == NULL || strlen(name) == 0 || strlen(name) > DNAFX_PRESET_NAME_SIZE)
+		return -1;
+	memset(image + 1, 0, DNAFX_PRESET_NAME_SIZE);
+	memcpy(image + 1, name, strlen(name));
+	return 0;
+}
+
+int dnafx_preset_image_active(const uint8_t *image, int section) {
+	if(image == NULL || section < 0 || section >= DNAFX_PRESET_EFFECTS)
+		return -1;
+	dnafx_presets_image_offsets();
+	return dnafx_image_get16(image, image_sections[section]) ? 1 : 0;
+}
+
+int dnafx_preset_image_set_active(uint8_t *image, int section, gboolean active) {
+	if(image == NULL || section < 0 || section >= DNAFX_PRESET_EFFECTS)
+		return -1;
+	dnafx_presets_image_offsets();
+	dnafx_image_set16(image, image_sections[section], active ? 1 : 0);
+	return 0;
+}
+
+int dnafx_preset_image_effect(const uint8_t *image, int section) {
+	if(image == NULL || section < 0 || section >= DNAFX_PRESET_EFFECTS)
+		return -1;
+	dnafx_presets_image_offsets();
+	return dnafx_image_get16(image, image_sections[section] + 2);
+}
+
+int dnafx_preset_image_set_effect(uint8_t *image, int section, uint16_t id) {
+	if(image == NULL || section < 0 || section >= DNAFX_PRESET_EFFECTS ||
+			id > dnafx_sections[section].effects_max)
+		return -1;
+	dnafx_presets_image_offsets();
+	dnafx_image_set16(image, image_sections[section] + 2, id);
+	return 0;
+}
+
+int dnafx_preset_image_param(const uint8_t *image, int section, int param) {
+	if(image == NULL || section < 0 || section >= DNAFX_PRESET_EFFECTS ||
+			param < 0 || param >= dnafx_sections[section].max_params)
+		return -1;
+	dnafx_presets_image_offsets();
+	return dnafx_image_get16(image, image_sections[section] + 4 + 2*param);
+}
+
+int dnafx_preset_image_set_param(uint8_t *image, int section, int param, uint16_t value) {
+	if(image == NULL || section < 0 || section >= DNAFX_PRESET_EFFECTS ||
+			param < 0 || param >= dnafx_sections[section].max_params)
+		return -1;
+	dnafx_presets_image_offsets();
+	dnafx_image_set16(image, image_sections[section] + 4 + 2*param, value);
+	return 0;
+}
+
+int dnafx_preset_image_expression(const uint8_t *image, int index) {
+	if(image == NULL || index < 0 || index >= DNAFX_PRESET_EXPS)
+		return -1;
+	dnafx_presets_image_offsets();
+	return dnafx_image_get16(image, image_expressions + 2*index);
+}
+
+int dnafx_preset_image_set_expression(uint8_t *image, int index, uint16_t value) {
+	if(image == NULL || index < 0 || index >= DNAFX_PRESET_EXPS)
+		return -1;
+	dnafx_presets_image_offsets();
+	dnafx_image_set16(image, image_expressions + 2*index, value);
+	return 0;
+}
+
+/* Effects metadata (names are matched ignoring case) */
+int dnafx_preset_section_byname(const char *name) {
+	if(name == NULL)
+		return -1;
+	int i = 0;
+	for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+		if(!g_ascii_strcasecmp(dnafx_sections[i].name, name))
+			return i;
+	}
+	return -1;
+}
+
+const char *dnafx_preset_section_name(int section) {
+	if(section < 0 || section >= DNAFX_PRESET_EFFECTS)
+		return NULL;
+	return dnafx_sections[section].name;
+}
+
+int dnafx_preset_section_effects(int section) {
+	if(section < 0 || section >= DNAFX_PRESET_EFFECTS)
+		return -1;
+	return dnafx_sections[section].effects_max + 1;
+}
+
+int dnafx_preset_effect_byname(int section, const char *name) {
+	if(section < 0 || section >= DNAFX_PRESET_EFFECTS || name == NULL)
+		return -1;
+	int i = 0;
+	for(i=0; i<=dnafx_sections[section].effects_max; i++) {
+		if(!g_ascii_strcasecmp(dnafx_sections[section].effects[i].name, name))
+			return i;
+	}
+	return -1;
+}
+
+int dnafx_preset_effect_param(int section, int effect, const char *name) {
+	if(section < 0 || section >= DNAFX_PRESET_EFFECTS || effect < 0 ||
+			effect > dnafx_sections[section].effects_max || name == NULL)
+		return -1;
+	dnafx_effect *f = &dnafx_sections[section].effects[effect];
+	int i = 0;
+	for(i=0; i<f->params; i++) {
+		if(!g_ascii_strcasecmp(f->param_names[i], name))
+			return i;
+	}
+	return -1;
+}
+
+uint8_t *dnafx_preset_image(dnafx_preset *preset) {
+	return preset ? dnafx_store_image(preset->handle) : NULL;
+}
+
+void dnafx_preset_refresh(dnafx_store_handle handle) {
+	uint8_t *image = dnafx_store_image(handle);
+	if(image == NULL)
+		return;
+	dnafx_store_touch(handle);
+	dnafx_preset *view = presets_views ? g_hash_table_lookup(presets_views, GUINT_TO_POINTER(handle)) : NULL;
+	if(view == NULL)
+		return;
+	/* Decode the record again in the same instance, as it may be in use */
+	dnafx_preset *preset = dnafx_preset_from_bytes(image, DNAFX_PRESET_SIZE);
+	if(preset == NULL)
+		return;
+	preset->handle = handle;
+	if(!dnafx_presets_in_slot(handle))
+		preset->id = 0;
+	memcpy(view, preset, sizeof(dnafx_preset));
+	dnafx_preset_free(preset);
+}
+
 /* Internal parsing */
 static int dnafx_parse_effect(dnafx_preset *preset, uint8_t index, uint8_t *effect);
 static int dnafx_parse_expression(dnafx_preset *preset, uint8_t *exp, size_t elen);
@@ -183,105 +520,433 @@ static int dnafx_parse_expression(dnafx_preset *preset, uint8_t *exp, size_t ele
 	return 0;
 }
 
-/* Parse preset from a PHB file (JSON) */
-dnafx_preset *dnafx_preset_from_phb(const char *phb) {
-	if(phb == NULL) {
-		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
-		return NULL;
+/* Streaming PHB parsing: rather than building a JSON tree and looking
+ * properties up by name, we go through the document once, and map keys
+ * to sections, parameters and expressions using precomputed tables */
+#define DNAFX_PHB_MAX_PARAMS	64
+#define DNAFX_PHB_MAX_EFFECTS	64
+static struct {
+	/* Section and expression names, mapped to their index + 1 */
+	GHashTable *sections, *expressions;
+	/* Names of all the parameters of a section, mapped to an index + 1 */
+	GHashTable *params[DNAFX_PRESET_EFFECTS];
+	/* For each effect, which of the indexes above are its parameters */
+	uint8_t effect_params[DNAFX_PRESET_EFFECTS][DNAFX_PHB_MAX_EFFECTS][6];
+	/* The order keys are written in, which is sorted as the editor does */
+	uint8_t sections_order[DNAFX_PRESET_EFFECTS], expressions_order[DNAFX_PRESET_EXPS];
+	uint8_t params_order[DNAFX_PRESET_EFFECTS][DNAFX_PHB_MAX_EFFECTS][6];
+} phb_tables;
+static volatile gsize phb_tables_ready = 0;
+
+static void dnafx_phb_tables_init(void) {
+	if(!g_once_init_enter(&phb_tables_ready))
+		return;
+	phb_tables.sections = g_hash_table_new(g_str_hash, g_str_equal);
+	phb_tables.expressions = g_hash_table_new(g_str_hash, g_str_equal);
+	size_t i = 0, e = 0, j = 0;
+	for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+		g_hash_table_insert(phb_tables.sections, (char *)dnafx_sections[i].name, GUINT_TO_POINTER(i+1));
+		phb_tables.params[i] = g_hash_table_new(g_str_hash, g_str_equal);
+		for(e=0; e<=dnafx_sections[i].effects_max && e<DNAFX_PHB_MAX_EFFECTS; e++) {
+			dnafx_effect *f = &dnafx_sections[i].effects[e];
+			for(j=0; j<f->params; j++) {
+				guint index = GPOINTER_TO_UINT(g_hash_table_lookup(phb_tables.params[i], f->param_names[j]));
+				if(index == 0) {
+					index = g_hash_table_size(phb_tables.params[i]) + 1;
+					if(index > DNAFX_PHB_MAX_PARAMS) {
+						DNAFX_LOG(DNAFX_LOG_ERR, "Too many parameters in section %s\n", dnafx_sections[i].name);
+						continue;
+					}
+					g_hash_table_insert(phb_tables.params[i], (char *)f->param_names[j], GUINT_TO_POINTER(index));
+				}
+				phb_tables.effect_params[i][e][j] = index;
+			}
+		}
 	}
-	/* Parse the PHB string as JSON text */
-	json_error_t error;
-	json_t *json = json_loads(phb, 0, &error);
-	if(json == NULL) {
-		DNAFX_LOG(DNAFX_LOG_ERR, "JSON error: on line %d: %s\n", error.line, error.text);
-		return NULL;
+	for(i=0; i<sizeof(dnafx_expression)/sizeof(const char *); i++)
+		g_hash_table_insert(phb_tables.expressions, (char *)dnafx_expression[i], GUINT_TO_POINTER(i+1));
+	/* Sort the keys once, so that writing never has to */
+	size_t k = 0;
+	for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+		for(k=i; k>0 && strcmp(dnafx_sections[phb_tables.sections_order[k-1]].name, dnafx_sections[i].name) > 0; k--)
+			phb_tables.sections_order[k] = phb_tables.sections_order[k-1];
+		phb_tables.sections_order[k] = i;
+		for(e=0; e<=dnafx_sections[i].effects_max && e<DNAFX_PHB_MAX_EFFECTS; e++) {
+			dnafx_effect *f = &dnafx_sections[i].effects[e];
+			uint8_t *order = phb_tables.params_order[i][e];
+			for(j=0; j<f->params; j++) {
+				for(k=j; k>0 && strcmp(f->param_names[order[k-1]], f->param_names[j]) > 0; k--)
+					order[k] = order[k-1];
+				order[k] = j;
+			}
+		}
 	}
-	if(!json_is_object(json)) {
-		json_decref(json);
-		DNAFX_LOG(DNAFX_LOG_ERR, "JSON error: not an object\n");
-		return NULL;
+	for(i=0; i<DNAFX_PRESET_EXPS; i++) {
+		for(k=i; k>0 && strcmp(dnafx_expression[phb_tables.expressions_order[k-1]], dnafx_expression[i]) > 0; k--)
+			phb_tables.expressions_order[k] = phb_tables.expressions_order[k-1];
+		phb_tables.expressions_order[k] = i;
 	}
-	json_t *exp = json_object_get(json, "Exp");
-	json_t *em = json_object_get(json, "effectModule");
-	json_t *info = json_object_get(json, "fileInfo");
-	if(exp == NULL || !json_is_object(exp) || em == NULL || !json_is_object(em) ||
-			info == NULL || !json_is_object(info)) {
-		json_decref(json);
-		DNAFX_LOG(DNAFX_LOG_ERR, "Missing mandatory object (Exp, effectModule and/or fileInfo)\n");
-		return NULL;
+	g_once_init_leave(&phb_tables_ready, 1);
+}
+
+typedef struct dnafx_phb_parser {
+	const char *cur, *end;
+	const char *error;
+} dnafx_phb_parser;
+
+static void dnafx_phb_skip_ws(dnafx_phb_parser *p) {
+	while(p->cur < p->end && (*p->cur == ' ' || *p->cur == '\t' || *p->cur == '\n' || *p->cur == '\r'))
+		p->cur++;
+}
+
+static gboolean dnafx_phb_next(dnafx_phb_parser *p, char c) {
+	dnafx_phb_skip_ws(p);
+	if(p->cur < p->end && *p->cur == c) {
+		p->cur++;
+		return TRUE;
 	}
-	/* Create a preset instance */
-	dnafx_preset *preset = g_malloc0(sizeof(dnafx_preset));
-	/* Info */
-	json_t *name = json_object_get(info, "preset_name");
-	if(name == NULL || !json_is_string(name)) {
-		json_decref(json);
-		dnafx_preset_free(preset);
-		DNAFX_LOG(DNAFX_LOG_ERR, "Missing preset name");
-		return NULL;
+	return FALSE;
+}
+
+/* Parse a string, copying as much as we can in the provided buffer:
+ * returns the full length of the decoded string, or -1 on errors */
+static int dnafx_phb_string(dnafx_phb_parser *p, char *out, size_t olen) {
+	if(!dnafx_phb_next(p, '"')) {
+		p->error = "expected a string";
+		return -1;
 	}
-	g_snprintf(preset->name, sizeof(preset->name), "%s", json_string_value(name));
-	dnafx_trim_string(preset->name);
-	/* Effects */
-	size_t s_size = sizeof(dnafx_sections);
-	size_t num = s_size / sizeof(dnafx_section), i = 0;
-	for(i=0; i<num; i++) {
-		json_t *je = json_object_get(em, dnafx_sections[i].name);
-		if(je == NULL || !json_is_object(je)) {
-			json_decref(json);
-			dnafx_preset_free(preset);
-			DNAFX_LOG(DNAFX_LOG_ERR, "Missing mandatory effect section (%s)\n", dnafx_sections[i].name);
-			return NULL;
+	size_t len = 0;
+	char c = 0;
+	while(p->cur < p->end && *p->cur != '"') {
+		c = *p->cur++;
+		if(c == '\\') {
+			if(p->cur >= p->end)
+				break;
+			c = *p->cur++;
+			switch(c) {
+				case 'b': c = '\b'; break;
+				case 'f': c = '\f'; break;
+				case 'n': c = '\n'; break;
+				case 'r': c = '\r'; break;
+				case 't': c = '\t'; break;
+				case 'u': {
+					/* We only care about ASCII in names */
+					if(p->end - p->cur < 4) {
+						p->error = "invalid escape";
+						return -1;
+					}
+					char hex[5] = { p->cur[0], p->cur[1], p->cur[2], p->cur[3], 0 };
+					long cp = strtol(hex, NULL, 16);
+					c = (cp > 0 && cp < 0x80) ? (char)cp : '?';
+					p->cur += 4;
+					break;
+				}
+				default:
+					break;
+			}
 		}
-		json_t *type = json_object_get(je, "TYPE");
-		json_t *sw = json_object_get(je, "SWITCH");
-		json_t *data = json_object_get(je, "Data");
-		if(type == NULL || !json_is_integer(type) || sw == NULL || !json_is_integer(sw) ||
-				data == NULL || !json_is_object(data)) {
-			json_decref(json);
-			dnafx_preset_free(preset);
-			DNAFX_LOG(DNAFX_LOG_ERR, "Missing mandatory effect property in '%s' (Data, SWITCH and/or TYPE)\n",
-				dnafx_sections[i].name);
-			return NULL;
+		if(out != NULL && len + 1 < olen)
+			out[len] = c;
+		len++;
+	}
+	if(p->cur >= p->end) {
+		p->error = "unterminated string";
+		return -1;
+	}
+	p->cur++;
+	if(out != NULL && olen > 0)
+		out[len < olen ? len : olen - 1] = '\0';
+	return len;
+}
+
+static int dnafx_phb_skip(dnafx_phb_parser *p, int depth);
+
+/* Parse a value we expect to be an integer: if it's something else, we
+ * skip it and return 1, which means it will be treated as missing */
+static int dnafx_phb_integer(dnafx_phb_parser *p, int64_t *value) {
+	dnafx_phb_skip_ws(p);
+	if(p->cur >= p->end) {
+		p->error = "unexpected end of document";
+		return -1;
+	}
+	if(*p->cur != '-' && !g_ascii_isdigit(*p->cur))
+		return dnafx_phb_skip(p, 0) < 0 ? -1 : 1;
+	const char *start = p->cur;
+	if(*p->cur == '-')
+		p->cur++;
+	while(p->cur < p->end && g_ascii_isdigit(*p->cur))
+		p->cur++;
+	gboolean real = FALSE;
+	while(p->cur < p->end && (*p->cur == '.' || *p->cur == 'e' || *p->cur == 'E' ||
+			*p->cur == '+' || *p->cur == '-' || g_ascii_isdigit(*p->cur))) {
+		real = TRUE;
+		p->cur++;
+	}
+	if(real)
+		return 1;
+	int64_t v = 0;
+	const char *c = (*start == '-') ? start + 1 : start;
+	for(; c < p->cur; c++)
+		v = v*10 + (*c - '0');
+	*value = (*start == '-') ? -v : v;
+	return 0;
+}
+
+/* Skip a value we're not interested in */
+static int dnafx_phb_skip(dnafx_phb_parser *p, int depth) {
+	if(depth > 64) {
+		p->error = "too many nested levels";
+		return -1;
+	}
+	dnafx_phb_skip_ws(p);
+	if(p->cur >= p->end) {
+		p->error = "unexpected end of document";
+		return -1;
+	}
+	char c = *p->cur;
+	if(c == '"')
+		return dnafx_phb_string(p, NULL, 0) < 0 ? -1 : 0;
+	if(c == '{' || c == '[') {
+		char close = (c == '{') ? '}' : ']';
+		p->cur++;
+		if(dnafx_phb_next(p, close))
+			return 0;
+		do {
+			if(c == '{' && (dnafx_phb_string(p, NULL, 0) < 0 || !dnafx_phb_next(p, ':'))) {
+				if(p->error == NULL)
+					p->error = "expected ':'";
+				return -1;
+			}
+			if(dnafx_phb_skip(p, depth + 1) < 0)
+				return -1;
+		} while(dnafx_phb_next(p, ','));
+		if(!dnafx_phb_next(p, close)) {
+			p->error = "unterminated object or array";
+			return -1;
 		}
-		preset->effects[i].type = i;
-		preset->effects[i].id = json_integer_value(type);
-		preset->effects[i].active = json_integer_value(sw) ? TRUE : FALSE;
-		dnafx_effect *f = dnafx_sections[i].effects + preset->effects[i].id;
-		if(f == NULL) {
-			json_decref(json);
-			dnafx_preset_free(preset);
-			DNAFX_LOG(DNAFX_LOG_ERR, "Unknown effect\n");
-			return NULL;
+		return 0;
+	}
+	/* Numbers and literals */
+	const char *start = p->cur;
+	while(p->cur < p->end && *p->cur != ',' && *p->cur != '}' && *p->cur != ']' &&
+			*p->cur != ' ' && *p->cur != '\t' && *p->cur != '\n' && *p->cur != '\r')
+		p->cur++;
+	if(p->cur == start) {
+		p->error = "unexpected character";
+		return -1;
+	}
+	return 0;
+}
+
+/* Iterate on the properties of an object */
+#define DNAFX_PHB_OBJECT_BEGIN(p) \
+	if(!dnafx_phb_next(p, '{')) { \
+		p->error = "expected an object"; \
+		return -1; \
+	} \
+	if(!dnafx_phb_next(p, '}')) { \
+		do {
+#define DNAFX_PHB_OBJECT_END(p) \
+		} while(dnafx_phb_next(p, ',')); \
+		if(!dnafx_phb_next(p, '}')) { \
+			p->error = "unterminated object"; \
+			return -1; \
+		} \
+	}
+#define DNAFX_PHB_KEY(p, key) \
+	if(dnafx_phb_string(p, key, sizeof(key)) < 0 || !dnafx_phb_next(p, ':')) { \
+		if(p->error == NULL) \
+			p->error = "expected ':'"; \
+		return -1; \
+	}
+
+/* Parse the content of a section: parameters come (alphabetically) before
+ * the effect type, so we only map them to the effect at the end */
+static int dnafx_phb_section(dnafx_phb_parser *p, dnafx_preset *preset, int index) {
+	char key[32];
+	int64_t value = 0, type = -1, sw = -1, values[DNAFX_PHB_MAX_PARAMS];
+	guint64 found = 0;
+	gboolean data = FALSE;
+	int res = 0;
+	DNAFX_PHB_OBJECT_BEGIN(p)
+		DNAFX_PHB_KEY(p, key)
+		if(!strcmp(key, "TYPE") || !strcmp(key, "SWITCH")) {
+			res = dnafx_phb_integer(p, &value);
+			if(res < 0)
+				return -1;
+			if(res == 0 && key[0] == 'T')
+				type = value;
+			else if(res == 0)
+				sw = value;
+		} else if(!strcmp(key, "Data")) {
+			data = TRUE;
+			DNAFX_PHB_OBJECT_BEGIN(p)
+				DNAFX_PHB_KEY(p, key)
+				guint param = GPOINTER_TO_UINT(g_hash_table_lookup(phb_tables.params[index], key));
+				if(param == 0) {
+					if(dnafx_phb_skip(p, 0) < 0)
+						return -1;
+					continue;
+				}
+				res = dnafx_phb_integer(p, &value);
+				if(res < 0)
+					return -1;
+				if(res == 0) {
+					values[param-1] = value;
+					found |= ((guint64)1 << (param-1));
+				}
+			DNAFX_PHB_OBJECT_END(p)
+		} else if(dnafx_phb_skip(p, 0) < 0) {
+			return -1;
 		}
-		uint8_t j = 0;
-		for(j=0; j<f->params; j++) {
-			json_t *fval = json_object_get(data, f->param_names[j]);
-			if(fval == NULL || !json_is_integer(fval)) {
-				json_decref(json);
-				dnafx_preset_free(preset);
-				DNAFX_LOG(DNAFX_LOG_ERR, "Missing mandatory effect property in %s (%s)\n",
-					dnafx_sections[i].name, f->param_names[j]);
-				return NULL;
-			}
-			preset->effects[i].values[j] = json_integer_value(fval);
+	DNAFX_PHB_OBJECT_END(p)
+	if(type < 0 || sw < 0 || !data) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Missing mandatory effect property in '%s' (Data, SWITCH and/or TYPE)\n",
+			dnafx_sections[index].name);
+		return -2;
+	}
+	if(type > dnafx_sections[index].effects_max || type >= DNAFX_PHB_MAX_EFFECTS) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Unknown effect\n");
+		return -2;
+	}
+	preset->effects[index].type = index;
+	preset->effects[index].id = type;
+	preset->effects[index].active = sw ? TRUE : FALSE;
+	dnafx_effect *f = &dnafx_sections[index].effects[type];
+	uint8_t j = 0, param = 0;
+	for(j=0; j<f->params; j++) {
+		param = phb_tables.effect_params[index][type][j];
+		if(param == 0 || !(found & ((guint64)1 << (param-1)))) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Missing mandatory effect property in %s (%s)\n",
+				dnafx_sections[index].name, f->param_names[j]);
+			return -2;
 		}
+		preset->effects[index].values[j] = values[param-1];
 	}
-	/* Expression pedal */
-	s_size = sizeof(dnafx_expression);
-	num = s_size / sizeof(const char *);
-	for(i=0; i<num; i++) {
-		json_t *expval = json_object_get(exp, dnafx_expression[i]);
-		if(expval == NULL || !json_is_integer(expval)) {
-			json_decref(json);
-			dnafx_preset_free(preset);
+	return 0;
+}
+
+static int dnafx_phb_document(dnafx_phb_parser *p, dnafx_preset *preset) {
+	char key[64];
+	guint sections = 0, expressions = 0;
+	gboolean exp = FALSE, em = FALSE, info = FALSE, name = FALSE;
+	int64_t value = 0;
+	int res = 0;
+	DNAFX_PHB_OBJECT_BEGIN(p)
+		DNAFX_PHB_KEY(p, key)
+		if(!strcmp(key, "Exp")) {
+			exp = TRUE;
+			DNAFX_PHB_OBJECT_BEGIN(p)
+				DNAFX_PHB_KEY(p, key)
+				guint index = GPOINTER_TO_UINT(g_hash_table_lookup(phb_tables.expressions, key));
+				if(index == 0) {
+					if(dnafx_phb_skip(p, 0) < 0)
+						return -1;
+					continue;
+				}
+				res = dnafx_phb_integer(p, &value);
+				if(res < 0)
+					return -1;
+				if(res == 0) {
+					preset->expressions[index-1] = value;
+					expressions |= (1 << (index-1));
+				}
+			DNAFX_PHB_OBJECT_END(p)
+		} else if(!strcmp(key, "effectModule")) {
+			em = TRUE;
+			DNAFX_PHB_OBJECT_BEGIN(p)
+				DNAFX_PHB_KEY(p, key)
+				guint index = GPOINTER_TO_UINT(g_hash_table_lookup(phb_tables.sections, key));
+				if(index == 0) {
+					if(dnafx_phb_skip(p, 0) < 0)
+						return -1;
+					continue;
+				}
+				res = dnafx_phb_section(p, preset, index-1);
+				if(res < 0)
+					return res;
+				sections |= (1 << (index-1));
+			DNAFX_PHB_OBJECT_END(p)
+		} else if(!strcmp(key, "fileInfo")) {
+			info = TRUE;
+			DNAFX_PHB_OBJECT_BEGIN(p)
+				DNAFX_PHB_KEY(p, key)
+				dnafx_phb_skip_ws(p);
+				if(!strcmp(key, "preset_name") && p->cur < p->end && *p->cur == '"') {
+					if(dnafx_phb_string(p, preset->name, sizeof(preset->name)) < 0)
+						return -1;
+					name = TRUE;
+				} else if(dnafx_phb_skip(p, 0) < 0) {
+					return -1;
+				}
+			DNAFX_PHB_OBJECT_END(p)
+		} else if(dnafx_phb_skip(p, 0) < 0) {
+			return -1;
+		}
+	DNAFX_PHB_OBJECT_END(p)
+	if(!exp || !em || !info) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Missing mandatory object (Exp, effectModule and/or fileInfo)\n");
+		return -2;
+	}
+	if(!name) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Missing preset name\n");
+		return -2;
+	}
+	dnafx_trim_string(preset->name);
+	size_t i = 0;
+	for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+		if(!(sections & (1 << i))) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Missing mandatory effect section (%s)\n", dnafx_sections[i].name);
+			return -2;
+		}
+	}
+	for(i=0; i<sizeof(dnafx_expression)/sizeof(const char *); i++) {
+		if(!(expressions & (1 << i))) {
 			DNAFX_LOG(DNAFX_LOG_ERR, "Missing mandatory expression property (%s)\n", dnafx_expression[i]);
-			return NULL;
+			return -2;
 		}
-		preset->expressions[i] = json_integer_value(expval);
 	}
-	/* Done */
-	json_decref(json);
+	return 0;
+}
+
+static int dnafx_phb_parse(const char *phb, size_t len, dnafx_preset *preset) {
+	dnafx_phb_tables_init();
+	dnafx_phb_parser parser = { .cur = phb, .end = phb + len, .error = NULL };
+	int res = dnafx_phb_document(&parser, preset);
+	if(res == 0) {
+		/* Like json_loads, we only accept whitespace after the document */
+		dnafx_phb_skip_ws(&parser);
+		if(parser.cur != parser.end) {
+			parser.error = "end of file expected";
+			res = -1;
+		}
+	}
+	if(res == -1) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "JSON error: at offset %zu: %s\n",
+			(size_t)(parser.cur - phb), parser.error ? parser.error : "invalid document");
+	}
+	return res < 0 ? -1 : 0;
+}
+
+/* Parse preset from a PHB file (JSON) */
+dnafx_preset *dnafx_preset_from_phb(const char *phb) {
+	if(phb == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return NULL;
+	}
+	return dnafx_preset_from_phb_buffer(phb, strlen(phb));
+}
+
+dnafx_preset *dnafx_preset_from_phb_buffer(const char *phb, size_t len) {
+	if(phb == NULL || len == 0) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return NULL;
+	}
+	dnafx_preset *preset = g_malloc0(sizeof(dnafx_preset));
+	if(dnafx_phb_parse(phb, len, preset) < 0) {
+		dnafx_preset_free(preset);
+		return NULL;
+	}
 	return preset;
 }
 
@@ -291,7 +956,8 @@ int dnafx_preset_to_bytes(dnafx_preset *preset, uint8_t *buf, size_t blen) {
 		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
 		return -1;
 	}
-	/* Serialize the preset to its binary format */
+	/* Serialize the preset to its binary format: we always encode the
+	 * fields, even for views, in case the caller changed them */
 	memset(buf, 0, blen);
 	/* Write ID and name first */
 	size_t offset = 0;
@@ -380,18 +1046,156 @@ json_t *dnafx_preset_to_phb_json(dnafx_preset *preset) {
 	return json;
 }
 
+/* Direct PHB writer: the text is generated in a single pass, with keys
+ * in the same (sorted) order and the same formatting jansson would use
+ * with JSON_INDENT(4) | JSON_SORT_KEYS, or JSON_COMPACT in compact mode */
+typedef struct dnafx_phb_writer {
+	GString *out;
+	gboolean compact;
+	int depth;
+	gboolean first;
+} dnafx_phb_writer;
+
+static void dnafx_phb_write_string(dnafx_phb_writer *w, const char *text) {
+	g_string_append_c(w->out, '"');
+	const char *c = NULL;
+	for(c=text; *c; c++) {
+		switch(*c) {
+			case '"': g_string_append(w->out, "\\\""); break;
+			case '\\': g_string_append(w->out, "\\\\"); break;
+			case '\b': g_string_append(w->out, "\\b"); break;
+			case '\f': g_string_append(w->out, "\\f"); break;
+			case '\n': g_string_append(w->out, "\\n"); break;
+			case '\r': g_string_append(w->out, "\\r"); break;
+			case '\t': g_string_append(w->out, "\\t"); break;
+			default:
+				if((unsigned char)*c < 0x20)
+					g_string_append_printf(w->out, "\\u%04X", (unsigned char)*c);
+				else
+					g_string_append_c(w->out, *c);
+				break;
+		}
+	}
+	g_string_append_c(w->out, '"');
+}
+
+static void dnafx_phb_write_newline(dnafx_phb_writer *w) {
+	if(w->compact)
+		return;
+	g_string_append_c(w->out, '\n');
+	int i = 0;
+	for(i=0; i<w->depth; i++)
+		g_string_append(w->out, "    ");
+}
+
+static void dnafx_phb_write_key(dnafx_phb_writer *w, const char *key) {
+	if(!w->first)
+		g_string_append_c(w->out, ',');
+	w->first = FALSE;
+	dnafx_phb_write_newline(w);
+	dnafx_phb_write_string(w, key);
+	g_string_append(w->out, w->compact ? ":" : ": ");
+}
+
+static void dnafx_phb_write_begin(dnafx_phb_writer *w) {
+	g_string_append_c(w->out, '{');
+	w->depth++;
+	w->first = TRUE;
+}
+
+static void dnafx_phb_write_end(dnafx_phb_writer *w) {
+	w->depth--;
+	/* Empty objects are written as {} */
+	if(!w->first)
+		dnafx_phb_write_newline(w);
+	g_string_append_c(w->out, '}');
+	w->first = FALSE;
+}
+
+static void dnafx_phb_write_integer(dnafx_phb_writer *w, const char *key, int value) {
+	dnafx_phb_write_key(w, key);
+	g_string_append_printf(w->out, "%d", value);
+}
+
+static void dnafx_phb_write_text(dnafx_phb_writer *w, const char *key, const char *value) {
+	dnafx_phb_write_key(w, key);
+	dnafx_phb_write_string(w, value);
+}
+
+int dnafx_preset_write_phb(dnafx_preset *preset, GString *out, gboolean compact) {
+	if(preset == NULL || out == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return -1;
+	}
+	dnafx_phb_tables_init();
+	gsize start = out->len;
+	dnafx_phb_writer w = { .out = out, .compact = compact };
+	dnafx_phb_write_begin(&w);
+	/* Expression pedals */
+	dnafx_phb_write_key(&w, "Exp");
+	dnafx_phb_write_begin(&w);
+	int i = 0, j = 0, index = 0;
+	for(i=0; i<DNAFX_PRESET_EXPS; i++) {
+		index = phb_tables.expressions_order[i];
+		dnafx_phb_write_integer(&w, dnafx_expression[index], preset->expressions[index]);
+	}
+	dnafx_phb_write_end(&w);
+	/* Effects */
+	dnafx_phb_write_key(&w, "effectModule");
+	dnafx_phb_write_begin(&w);
+	for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+		index = phb_tables.sections_order[i];
+		dnafx_preset_effect *effect = &preset->effects[index];
+		if(effect->id > dnafx_sections[index].effects_max || effect->id >= DNAFX_PHB_MAX_EFFECTS) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Invalid effect %"SCNu16" in section %s\n",
+				effect->id, dnafx_sections[index].name);
+			g_string_truncate(out, start);
+			return -1;
+		}
+		dnafx_effect *f = dnafx_sections[index].effects + effect->id;
+		uint8_t *order = phb_tables.params_order[index][effect->id];
+		dnafx_phb_write_key(&w, dnafx_sections[index].name);
+		dnafx_phb_write_begin(&w);
+		dnafx_phb_write_key(&w, "Data");
+		dnafx_phb_write_begin(&w);
+		for(j=0; j<f->params; j++)
+			dnafx_phb_write_integer(&w, f->param_names[order[j]], effect->values[order[j]]);
+		dnafx_phb_write_end(&w);
+		dnafx_phb_write_integer(&w, "SWITCH", effect->active);
+		dnafx_phb_write_integer(&w, "TYPE", effect->id);
+		dnafx_phb_write_end(&w);
+	}
+	dnafx_phb_write_end(&w);
+	/* File info (names that are not valid UTF-8 are fixed, as JSON requires it) */
+	dnafx_phb_write_key(&w, "fileInfo");
+	dnafx_phb_write_begin(&w);
+	dnafx_phb_write_text(&w, "app", "HB100 Edit");
+	dnafx_phb_write_text(&w, "app_version", "V1.0.0");
+	dnafx_phb_write_text(&w, "device", "HB100");
+	dnafx_phb_write_text(&w, "device_version", "V1.0.0");
+	if(g_utf8_validate(preset->name, -1, NULL)) {
+		dnafx_phb_write_text(&w, "preset_name", preset->name);
+	} else {
+		char *name = g_utf8_make_valid(preset->name, -1);
+		dnafx_phb_write_text(&w, "preset_name", name);
+		g_free(name);
+	}
+	dnafx_phb_write_text(&w, "schema", "HB100 Preset");
+	dnafx_phb_write_end(&w);
+	dnafx_phb_write_end(&w);
+	return out->len - start;
+}
+
 char *dnafx_preset_to_phb(dnafx_preset *preset) {
-	json_t *json = dnafx_preset_to_phb_json(preset);
-	if(json == NULL)
+	GString *out = g_string_sized_new(2048);
+	if(dnafx_preset_write_phb(preset, out, FALSE) < 0) {
+		g_string_free(out, TRUE);
 		return NULL;
-	/* Convert the JSON to a string */
-	char *json_text = json_dumps(json, JSON_INDENT(4) | JSON_SORT_KEYS);
-	json_decref(json);
+	}
 	DNAFX_LOG(DNAFX_LOG_VERB, "Preset '%s' exported to PHB\n", preset->name);
-	DNAFX_LOG(DNAFX_LOG_HUGE, "%s\n", json_text);
-	json_decref(json);
+	DNAFX_LOG(DNAFX_LOG_HUGE, "%s\n", out->str);
 	/* Done */
-	return json_text;
+	return g_string_free(out, FALSE);
 }
 
 /* Importing and exporting */
@@ -406,16 +1210,22 @@ dnafx_preset *dnafx_preset_import(const char *filename, gboolean phb) {
 			return NULL;
 		preset = dnafx_preset_from_bytes(buf, sizeof(buf));
 	} else {
-		/* Open the provided PHB file and parse it */
-		char buf[4096];
-		int blen = dnafx_read_file(filename, TRUE, (uint8_t *)buf, sizeof(buf));
-		if(blen <= 0)
+		/* Open the provided PHB file, whatever its size, and parse it */
+		gchar *contents = NULL;
+		gsize len = 0;
+		GError *error = NULL;
+		if(!g_file_get_contents(filename, &contents, &len, &error)) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Error reading %s: %s\n", filename,
+				error && error->message ? error->message : "??");
+			g_clear_error(&error);
 			return NULL;
-		preset = dnafx_preset_from_phb(buf);
+		}
+		preset = dnafx_preset_from_phb_buffer(contents, len);
+		g_free(contents);
 	}
-	if(preset != NULL)
-		dnafx_preset_add(preset);
-	return preset;
+	if(preset == NULL)
+		return NULL;
+	return dnafx_preset_add(preset);
 }
 
 int dnafx_preset_export(dnafx_preset *preset, const char *filename, gboolean phb) {
@@ -434,59 +1244,492 @@ int dnafx_preset_export(dnafx_preset *preset, const char *filename, gboolean phb
 		if(json_text == NULL)
 			return -1;
 		if(dnafx_write_file(filename, TRUE, (uint8_t *)json_text, strlen(json_text)) <= 0) {
-			free(json_text);
+			g_free(json_text);
 			return -1;
 		}
-		free(json_text);
+		g_free(json_text);
 	}
 	return 0;
 }
 
-/* Presets management */
-int dnafx_preset_add(dnafx_preset *preset) {
-	if(presets_byname == NULL || preset == NULL || strlen(preset->name) == 0) {
+/* Bulk import: files are parsed to wire images on a thread pool, and
+ * the results are merged into the library on the calling thread */
+typedef struct dnafx_presets_import_item {
+	char *filename;
+	gboolean phb;
+	gboolean ok;
+	uint8_t image[DNAFX_PRESET_SIZE];
+} dnafx_presets_import_item;
+
+static void dnafx_presets_import_walk(const char *path, GPtrArray *items, int depth) {
+	if(depth > 32)
+		return;
+	GError *error = NULL;
+	GDir *dir = g_dir_open(path, 0, &error);
+	if(dir == NULL) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "Error opening %s: %s\n", path, error && error->message ? error->message : "??");
+		g_clear_error(&error);
+		return;
+	}
+	const char *name = NULL;
+	while((name = g_dir_read_name(dir)) != NULL) {
+		char *filename = g_build_filename(path, name, NULL);
+		if(g_file_test(filename, G_FILE_TEST_IS_DIR)) {
+			dnafx_presets_import_walk(filename, items, depth + 1);
+			g_free(filename);
+			continue;
+		}
+		gboolean bhb = g_str_has_suffix(name, ".bhb") || g_str_has_suffix(name, ".BHB");
+		gboolean phb = g_str_has_suffix(name, ".phb") || g_str_has_suffix(name, ".PHB");
+		if(!bhb && !phb) {
+			g_free(filename);
+			continue;
+		}
+		dnafx_presets_import_item *item = g_malloc0(sizeof(dnafx_presets_import_item));
+		item->filename = filename;
+		item->phb = phb;
+		g_ptr_array_add(items, item);
+	}
+	g_dir_close(dir);
+}
+
+static void dnafx_presets_import_item_free(dnafx_presets_import_item *item) {
+	if(item != NULL) {
+		g_free(item->filename);
+		g_free(item);
+	}
+}
+
+static void dnafx_presets_import_parse(gpointer data, gpointer user_data) {
+	dnafx_presets_import_item *item = (dnafx_presets_import_item *)data;
+	gchar *contents = NULL;
+	gsize len = 0;
+	if(!g_file_get_contents(item->filename, &contents, &len, NULL)) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "Error reading %s\n", item->filename);
+		return;
+	}
+	if(!item->phb) {
+		/* Binary presets are already what we need */
+		if(len == DNAFX_PRESET_SIZE) {
+			memcpy(item->image, contents, DNAFX_PRESET_SIZE);
+			item->ok = TRUE;
+		} else {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid binary preset %s (%zu bytes)\n", item->filename, (size_t)len);
+		}
+	} else {
+		dnafx_preset preset = { 0 };
+		if(dnafx_phb_parse(contents, len, &preset) == 0)
+			item->ok = (dnafx_preset_to_bytes(&preset, item->image, DNAFX_PRESET_SIZE) > 0);
+	}
+	g_free(contents);
+}
+
+json_t *dnafx_presets_import_dir(const char *path) {
+	if(presets_byname == NULL || path == NULL || !g_file_test(path, G_FILE_TEST_IS_DIR)) {
 		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
-		return -1;
+		return NULL;
 	}
-	char *name = g_strdup(preset->name);
-	if(dnafx_preset_find_byname(name) != NULL) {
-		/* We already have a preset with this name, change it */
-		if(strlen(preset->name) > 12) {
-			/* Too many attempts or name too long to edit */
-			DNAFX_LOG(DNAFX_LOG_ERR, "Error adding preset '%s' to the list\n", name);
-			g_free(name);
-			return -1;
+	gint64 start = g_get_monotonic_time();
+	GPtrArray *items = g_ptr_array_new_with_free_func((GDestroyNotify)dnafx_presets_import_item_free);
+	dnafx_presets_import_walk(path, items, 0);
+	/* Parse all the files we found in parallel */
+	guint i = 0, threads = g_get_num_processors();
+	if(threads > items->len)
+		threads = items->len;
+	if(threads > 1) {
+		GError *error = NULL;
+		GThreadPool *pool = g_thread_pool_new(dnafx_presets_import_parse, NULL, threads, TRUE, &error);
+		if(pool == NULL) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Error creating thread pool: %s\n", error && error->message ? error->message : "??");
+			g_clear_error(&error);
+			threads = 1;
+		} else {
+			for(i=0; i<items->len; i++)
+				g_thread_pool_push(pool, g_ptr_array_index(items, i), NULL);
+			/* Wait for all the files to be parsed */
+			g_thread_pool_free(pool, FALSE, TRUE);
 		}
-		size_t o_len = strlen(name), n_size = o_len + 3, ret = 0;
-		name = g_realloc(name, n_size);
-		char digits[3];
-		int attempts = 1;
-		while(dnafx_preset_find_byname(name) != NULL) {
-			name[o_len] = '\0';
-			attempts++;
-			g_snprintf(digits, sizeof(digits), "%d", attempts);
-			ret = g_strlcat(name, digits, n_size);
-			if(ret >= n_size)
-				DNAFX_LOG(DNAFX_LOG_ERR, "Truncation occurred, %lu >= %lu\n", ret, n_size);
+	}
+	if(threads <= 1) {
+		for(i=0; i<items->len; i++)
+			dnafx_presets_import_parse(g_ptr_array_index(items, i), NULL);
+	}
+	gint64 parsed = g_get_monotonic_time();
+	/* Merge everything in the library in one go, in the order we found the files */
+	guint imported = 0, duplicates = 0, failed = 0;
+	gboolean known = FALSE;
+	for(i=0; i<items->len; i++) {
+		dnafx_presets_import_item *item = g_ptr_array_index(items, i);
+		if(item->ok && dnafx_presets_add_image(item->image, FALSE, &known) != DNAFX_STORE_INVALID) {
+			if(known)
+				duplicates++;
+			else
+				imported++;
+		} else {
+			failed++;
 		}
+	}
+	gint64 end = g_get_monotonic_time();
+	double elapsed = (double)(end - start) / G_USEC_PER_SEC;
+	double rate = elapsed > 0 ? (double)items->len / elapsed : 0;
+	DNAFX_LOG(DNAFX_LOG_INFO, "Imported %u/%u presets from %s in %.3fs (%.0f files/s, %u duplicates, %u failed, %u threads)\n",
+		imported, items->len, path, elapsed, rate, duplicates, failed, threads ? threads : 1);
+	json_t *summary = json_object();
+	json_object_set_new(summary, "files", json_integer(items->len));
+	json_object_set_new(summary, "imported", json_integer(imported));
+	json_object_set_new(summary, "duplicates", json_integer(duplicates));
+	json_object_set_new(summary, "failed", json_integer(failed));
+	json_object_set_new(summary, "threads", json_integer(threads ? threads : 1));
+	json_object_set_new(summary, "parse-ms", json_integer((parsed - start) / 1000));
+	json_object_set_new(summary, "merge-ms", json_integer((end - parsed) / 1000));
+	json_object_set_new(summary, "files-per-second", json_real(rate));
+	g_ptr_array_unref(items);
+	return summary;
+}
+
+/* Wire images of all the presets in a folder that target a slot: we use
+ * the slot in the image, if any, or the number the file name starts with,
+ * as in the files we save when retrieving the presets from the device */
+GByteArray *dnafx_presets_folder_images(const char *path) {
+	if(path == NULL || !g_file_test(path, G_FILE_TEST_IS_DIR)) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return NULL;
+	}
+	GPtrArray *items = g_ptr_array_new_with_free_func((GDestroyNotify)dnafx_presets_import_item_free);
+	dnafx_presets_import_walk(path, items, 0);
+	GByteArray *images = g_byte_array_sized_new(DNAFX_PRESETS_NUM * DNAFX_PRESET_SIZE);
+	gboolean filled[DNAFX_PRESETS_NUM] = { 0 };
+	guint i = 0;
+	int slot = 0;
+	for(i=0; i<items->len; i++) {
+		dnafx_presets_import_item *item = g_ptr_array_index(items, i);
+		dnafx_presets_import_parse(item, NULL);
+		if(!item->ok)
+			continue;
+		slot = item->image[0];
+		if(slot < 1 || slot > DNAFX_PRESETS_NUM) {
+			char *base = g_path_get_basename(item->filename);
+			slot = g_ascii_isdigit(*base) ? atoi(base) : 0;
+			g_free(base);
+		}
+		if(slot < 1 || slot > DNAFX_PRESETS_NUM)
+			continue;
+		if(filled[slot-1]) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Ignoring %s, slot %d is taken already\n", item->filename, slot);
+			continue;
+		}
+		filled[slot-1] = TRUE;
+		item->image[0] = slot;
+		g_byte_array_append(images, item->image, DNAFX_PRESET_SIZE);
+	}
+	g_ptr_array_unref(items);
+	return images;
+}
+
+/* Presets management */
+dnafx_preset *dnafx_preset_add(dnafx_preset *preset) {
+	if(presets_byname == NULL || preset == NULL || strlen(preset->name) == 0) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		dnafx_preset_free(preset);
+		return NULL;
+	}
+	uint8_t image[DNAFX_PRESET_SIZE];
+	if(dnafx_preset_to_bytes(preset, image, sizeof(image)) < 0) {
+		dnafx_preset_free(preset);
+		return NULL;
+	}
+	dnafx_store_handle handle = dnafx_presets_known(image, FALSE);
+	if(handle != DNAFX_STORE_INVALID) {
+		/* We have this preset already, use the view of that one */
+		dnafx_preset_free(preset);
+		return dnafx_presets_view(handle);
+	}
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	g_snprintf(name, sizeof(name), "%s", preset->name);
+	if(dnafx_presets_unique_name(name, sizeof(name)) < 0) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Error adding preset '%s' to the list\n", preset->name);
+		dnafx_preset_free(preset);
+		return NULL;
+	}
+	if(strcmp(name, preset->name)) {
 		DNAFX_LOG(DNAFX_LOG_WARN, "We already have a preset named '%s', renaming new preset to '%s'\n",
 			preset->name, name);
-		memcpy(preset->name, name, strlen(name));
+		g_snprintf(preset->name, sizeof(preset->name), "%s", name);
+		memset(image + 1, 0, DNAFX_PRESET_NAME_SIZE);
+		memcpy(image + 1, name, strlen(name));
 	}
-	if(!g_hash_table_insert(presets_byname, name, preset)) {
+	/* Store the preset as a record, and keep this instance as its view */
+	handle = dnafx_store_add(image);
+	if(handle == DNAFX_STORE_INVALID) {
 		DNAFX_LOG(DNAFX_LOG_ERR, "Error adding preset '%s' to the list\n", name);
-		g_free(name);
-		return -1;
+		dnafx_preset_free(preset);
+		return NULL;
+	}
+	preset->handle = handle;
+	g_hash_table_insert(presets_views, GUINT_TO_POINTER(handle), preset);
+	/* The name index takes the reference we got when adding the record */
+	g_hash_table_insert(presets_byname, g_strdup(name), GUINT_TO_POINTER(handle));
+	dnafx_presets_names_changed();
+	return preset;
+}
+
+/* Check if the effects in an image are ones we know about */
+static int dnafx_presets_validate_image(const uint8_t *image) {
+	int i = 0, id = 0;
+	for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+		id = dnafx_preset_image_effect(image, i);
+		if(id < 0 || id > dnafx_sections[i].effects_max) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Unknown effect %d in section %s\n", id, dnafx_sections[i].name);
+			return -1;
+		}
 	}
 	return 0;
 }
 
+/* Check if we have an identical preset already: if the name is different
+ * too, and this is not a device slot, the name becomes an alias of the
+ * record we have, so that it can be found with either name */
+static dnafx_store_handle dnafx_presets_known(const uint8_t *image, gboolean slot) {
+	dnafx_store_handle handle = dnafx_store_find(image);
+	if(handle == DNAFX_STORE_INVALID)
+		return DNAFX_STORE_INVALID;
+	char name[DNAFX_PRESET_NAME_SIZE+1], known[DNAFX_PRESET_NAME_SIZE+1];
+	dnafx_preset_image_name(image, name, sizeof(name));
+	dnafx_preset_image_name(dnafx_store_image(handle), known, sizeof(known));
+	if(slot) {
+		/* The device shows the name, so we can only share the same one */
+		if(strcmp(name, known) || image[0] < 1 || image[0] > DNAFX_PRESETS_NUM)
+			return DNAFX_STORE_INVALID;
+		if(dnafx_presets_assign(handle, image[0]) < 0)
+			return DNAFX_STORE_INVALID;
+		/* Assigning may have given the slot its own copy of the record */
+		handle = presets[image[0]-1];
+	} else if(strlen(name) > 0 && !g_hash_table_contains(presets_byname, name)) {
+		DNAFX_LOG(DNAFX_LOG_VERB, "Preset '%s' is the same as '%s', adding it as an alias\n", name, known);
+		dnafx_store_ref(handle);
+		g_hash_table_insert(presets_byname, g_strdup(name), GUINT_TO_POINTER(handle));
+		dnafx_presets_names_changed();
+		return handle;
+	}
+	DNAFX_LOG(DNAFX_LOG_VERB, "Already have preset '%s'\n", name);
+	return handle;
+}
+
+/* Add a preset as it is on the wire, without decoding it */
+static dnafx_store_handle dnafx_presets_add_image(const uint8_t *image, gboolean slot, gboolean *known) {
+	if(presets_byname == NULL || image == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return DNAFX_STORE_INVALID;
+	}
+	if(dnafx_presets_validate_image(image) < 0)
+		return DNAFX_STORE_INVALID;
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	dnafx_preset_image_name(image, name, sizeof(name));
+	if(strlen(name) == 0) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid preset name\n");
+		return DNAFX_STORE_INVALID;
+	}
+	dnafx_store_handle handle = dnafx_presets_known(image, slot);
+	if(known != NULL)
+		*known = (handle != DNAFX_STORE_INVALID);
+	if(handle != DNAFX_STORE_INVALID)
+		return handle;
+	if(slot && (image[0] < 1 || image[0] > DNAFX_PRESETS_NUM))
+		slot = FALSE;
+	char unique[DNAFX_PRESET_NAME_SIZE+1];
+	g_snprintf(unique, sizeof(unique), "%s", name);
+	dnafx_store_handle owner = GPOINTER_TO_UINT(g_hash_table_lookup(presets_byname, name));
+	if(slot && owner != DNAFX_STORE_INVALID && owner == presets[image[0]-1]) {
+		/* The name belonged to what was in this slot before, and the
+		 * device replaced that, so the name moves to the new content */
+		DNAFX_LOG(DNAFX_LOG_VERB, "Preset '%s' in slot %d changed\n", name, image[0]);
+	} else if(dnafx_presets_unique_name(unique, sizeof(unique)) < 0) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Error adding preset '%s' to the list\n", name);
+		return DNAFX_STORE_INVALID;
+	}
+	handle = dnafx_store_add(image);
+	if(handle == DNAFX_STORE_INVALID)
+		return DNAFX_STORE_INVALID;
+	uint8_t *record = dnafx_store_image(handle);
+	if(strcmp(name, unique)) {
+		if(slot) {
+			/* Slots must match the device byte by byte, so only the
+			 * library entry gets a different name, not the preset */
+			DNAFX_LOG(DNAFX_LOG_WARN, "We already have a preset named '%s', listing the one in slot %d as '%s'\n",
+				name, record[0], unique);
+		} else {
+			DNAFX_LOG(DNAFX_LOG_WARN, "We already have a preset named '%s', renaming new preset to '%s'\n",
+				name, unique);
+			memset(record + 1, 0, DNAFX_PRESET_NAME_SIZE);
+			memcpy(record + 1, unique, strlen(unique));
+		}
+	}
+	/* If the name is moving, this releases the reference the old record had */
+	g_hash_table_insert(presets_byname, g_strdup(unique), GUINT_TO_POINTER(handle));
+	dnafx_presets_names_changed();
+	if(slot) {
+		/* This preset comes from the device, track the slot too */
+		dnafx_store_ref(handle);
+		dnafx_store_handle old = presets[record[0]-1];
+		presets[record[0]-1] = handle;
+		dnafx_presets_unref(old);
+	} else {
+		record[0] = 0;
+	}
+	return handle;
+}
+
+dnafx_store_handle dnafx_preset_add_image(const uint8_t *image, gboolean slot) {
+	return dnafx_presets_add_image(image, slot, NULL);
+}
+
+dnafx_store_handle dnafx_preset_add_named_image(const uint8_t *image, const char *name) {
+	if(presets_byname == NULL || image == NULL || name == NULL || strlen(name) == 0 ||
+			strlen(name) > DNAFX_PRESET_NAME_SIZE) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return DNAFX_STORE_INVALID;
+	}
+	if(dnafx_presets_validate_image(image) < 0)
+		return DNAFX_STORE_INVALID;
+	dnafx_store_handle handle = dnafx_store_find(image);
+	dnafx_store_handle owner = GPOINTER_TO_UINT(g_hash_table_lookup(presets_byname, name));
+	if(owner != DNAFX_STORE_INVALID && owner == handle) {
+		DNAFX_LOG(DNAFX_LOG_VERB, "Already have preset '%s'\n", name);
+		return handle;
+	}
+	char unique[DNAFX_PRESET_NAME_SIZE+1];
+	g_snprintf(unique, sizeof(unique), "%s", name);
+	if(dnafx_presets_unique_name(unique, sizeof(unique)) < 0) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Error adding preset '%s' to the list\n", name);
+		return DNAFX_STORE_INVALID;
+	}
+	if(strcmp(name, unique))
+		DNAFX_LOG(DNAFX_LOG_WARN, "We already have a preset named '%s', listing the new one as '%s'\n", name, unique);
+	if(handle != DNAFX_STORE_INVALID) {
+		/* Same content as a preset we have, this is one more name for it */
+		dnafx_store_ref(handle);
+	} else {
+		handle = dnafx_store_add(image);
+		if(handle == DNAFX_STORE_INVALID)
+			return DNAFX_STORE_INVALID;
+		dnafx_store_image(handle)[0] = 0;
+	}
+	g_hash_table_insert(presets_byname, g_strdup(unique), GUINT_TO_POINTER(handle));
+	dnafx_presets_names_changed();
+	return handle;
+}
+
+void dnafx_preset_image_name(const uint8_t *image, char *name, size_t len) {
+	if(name == NULL || len == 0)
+		return;
+	*name = '\0';
+	if(image == NULL)
+		return;
+	g_snprintf(name, len, "%.*s", DNAFX_PRESET_NAME_SIZE, (const char *)image + 1);
+	dnafx_trim_string(name);
+}
+
+/* Differences between two wire images, ignoring the slot */
+static json_t *dnafx_presets_diff_value(json_t *from, json_t *to) {
+	json_t *change = json_object();
+	json_object_set_new(change, "from", from);
+	json_object_set_new(change, "to", to);
+	return change;
+}
+
+json_t *dnafx_preset_image_diff(const uint8_t *a, const uint8_t *b) {
+	if(a == NULL || b == NULL || !memcmp(a + 1, b + 1, DNAFX_PRESET_SIZE - 1))
+		return NULL;
+	dnafx_presets_image_offsets();
+	json_t *diff = json_object();
+	char name_a[DNAFX_PRESET_NAME_SIZE+1], name_b[DNAFX_PRESET_NAME_SIZE+1];
+	dnafx_preset_image_name(a, name_a, sizeof(name_a));
+	dnafx_preset_image_name(b, name_b, sizeof(name_b));
+	if(strcmp(name_a, name_b))
+		json_object_set_new(diff, "name", dnafx_presets_diff_value(json_string(name_a), json_string(name_b)));
+	int i = 0, j = 0, id_a = 0, id_b = 0, value_a = 0, value_b = 0;
+	json_t *sections = json_array();
+	for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+		/* Skip sections that are the same */
+		if(!memcmp(a + image_sections[i], b + image_sections[i], dnafx_sections[i].size))
+			continue;
+		json_t *section = json_object();
+		json_object_set_new(section, "section", json_string(dnafx_sections[i].name));
+		value_a = dnafx_preset_image_active(a, i);
+		value_b = dnafx_preset_image_active(b, i);
+		if(value_a != value_b) {
+			json_object_set_new(section, "switch", dnafx_presets_diff_value(
+				json_string(value_a ? "on" : "off"), json_string(value_b ? "on" : "off")));
+		}
+		id_a = dnafx_preset_image_effect(a, i);
+		id_b = dnafx_preset_image_effect(b, i);
+		if(id_a != id_b) {
+			/* Different effects, parameters can't be compared */
+			json_object_set_new(section, "effect", dnafx_presets_diff_value(
+				id_a >= 0 && id_a <= dnafx_sections[i].effects_max ? json_string(dnafx_sections[i].effects[id_a].name) : json_integer(id_a),
+				id_b >= 0 && id_b <= dnafx_sections[i].effects_max ? json_string(dnafx_sections[i].effects[id_b].name) : json_integer(id_b)));
+		} else if(id_a >= 0 && id_a <= dnafx_sections[i].effects_max) {
+			dnafx_effect *f = &dnafx_sections[i].effects[id_a];
+			json_t *params = json_array();
+			for(j=0; j<f->params; j++) {
+				value_a = dnafx_preset_image_param(a, i, j);
+				value_b = dnafx_preset_image_param(b, i, j);
+				if(value_a == value_b)
+					continue;
+				json_t *param = dnafx_presets_diff_value(json_integer(value_a), json_integer(value_b));
+				json_object_set_new(param, "param", json_string(f->param_names[j]));
+				json_array_append_new(params, param);
+			}
+			if(json_array_size(params) > 0)
+				json_object_set_new(section, "params", params);
+			else
+				json_decref(params);
+		}
+		if(json_object_size(section) > 1)
+			json_array_append_new(sections, section);
+		else
+			json_decref(section);
+	}
+	if(json_array_size(sections) > 0)
+		json_object_set_new(diff, "sections", sections);
+	else
+		json_decref(sections);
+	json_t *expressions = json_array();
+	for(i=0; i<DNAFX_PRESET_EXPS; i++) {
+		value_a = dnafx_preset_image_expression(a, i);
+		value_b = dnafx_preset_image_expression(b, i);
+		if(value_a == value_b)
+			continue;
+		json_t *expression = dnafx_presets_diff_value(json_integer(value_a), json_integer(value_b));
+		json_object_set_new(expression, "expression", json_string(dnafx_expression[i]));
+		json_array_append_new(expressions, expression);
+	}
+	if(json_array_size(expressions) > 0)
+		json_object_set_new(diff, "expressions", expressions);
+	else
+		json_decref(expressions);
+	return diff;
+}
+
+dnafx_store_handle dnafx_preset_handle_byname(const char *name) {
+	if(presets_byname == NULL || name == NULL)
+		return DNAFX_STORE_INVALID;
+	return GPOINTER_TO_UINT(g_hash_table_lookup(presets_byname, name));
+}
+
+GPtrArray *dnafx_presets_names(void) {
+	if(presets_byname == NULL)
+		return NULL;
+	dnafx_presets_names_update();
+	return presets_names;
+}
+
 dnafx_preset *dnafx_preset_find_byid(int id) {
 	if(id < 1 || id > DNAFX_PRESETS_NUM) {
 		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
 		return NULL;
 	}
-	return presets[id-1];
+	return dnafx_presets_view(presets[id-1]);
 }
 
 dnafx_preset *dnafx_preset_find_byname(const char *name) {
@@ -494,114 +1737,648 @@ dnafx_preset *dnafx_preset_find_byname(const char *name) {
 		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
 		return NULL;
 	}
-	return g_hash_table_lookup(presets_byname, name);
+	gpointer handle = NULL;
+	if(!g_hash_table_lookup_extended(presets_byname, name, NULL, &handle))
+		return NULL;
+	return dnafx_presets_view(GPOINTER_TO_UINT(handle));
+}
+
+/* Put a stored record in a device slot */
+static int dnafx_presets_assign(dnafx_store_handle handle, int id) {
+	uint8_t *image = dnafx_store_image(handle);
+	if(image == NULL)
+		return -1;
+	dnafx_preset *preset = g_hash_table_lookup(presets_views, GUINT_TO_POINTER(handle));
+	dnafx_store_handle old = presets[id-1];
+	if(old == handle) {
+		/* Nothing to do */
+		image[0] = id;
+		if(preset != NULL)
+			preset->id = id;
+		return 0;
+	}
+	if(dnafx_presets_in_slot(handle)) {
+		/* This record is in a different slot already: the device now has
+		 * a copy in this slot too, so the slot gets its own record */
+		handle = dnafx_store_add(image);
+		if(handle == DNAFX_STORE_INVALID)
+			return -1;
+		dnafx_store_image(handle)[0] = id;
+	} else {
+		dnafx_store_ref(handle);
+		image[0] = id;
+		if(preset != NULL)
+			preset->id = id;
+		dnafx_store_touch(handle);
+	}
+	if(old != DNAFX_STORE_INVALID) {
+		/* There was another preset in that slot, remove it from there */
+		uint8_t *old_image = dnafx_store_image(old);
+		char name[DNAFX_PRESET_NAME_SIZE+1];
+		dnafx_preset_image_name(old_image, name, sizeof(name));
+		DNAFX_LOG(DNAFX_LOG_INFO, "Removing preset '%s' from local slot %d\n", name, id);
+		presets[id-1] = DNAFX_STORE_INVALID;
+		if(old_image != NULL)
+			old_image[0] = 0;
+		dnafx_preset *old_view = g_hash_table_lookup(presets_views, GUINT_TO_POINTER(old));
+		if(old_view != NULL)
+			old_view->id = 0;
+		dnafx_presets_unref(old);
+	}
+	presets[id-1] = handle;
+	return 0;
 }
 
 int dnafx_preset_set_id(dnafx_preset *preset, int id) {
-	if(preset == NULL || id > DNAFX_PRESETS_NUM) {
+	if(preset == NULL || preset->handle == DNAFX_STORE_INVALID || id < 1 || id > DNAFX_PRESETS_NUM) {
 		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
 		return -1;
 	}
-	if(id > 1 && presets[id-1] != NULL) {
-		/* There was another preset in that slot, remove it from there */
-		DNAFX_LOG(DNAFX_LOG_INFO, "Removing preset '%s' from local slot %d\n",
-			presets[id-1]->name, id);
-		presets[id-1]->id = 0;
+	return dnafx_presets_assign(preset->handle, id);
+}
+
+/* Device slots */
+uint8_t *dnafx_preset_slot_image(int slot) {
+	if(slot < 1 || slot > DNAFX_PRESETS_NUM)
+		return NULL;
+	return dnafx_store_image(presets[slot-1]);
+}
+
+int dnafx_preset_clear_slot(int slot) {
+	if(presets_byname == NULL || slot < 1 || slot > DNAFX_PRESETS_NUM) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return -1;
 	}
-	preset->id = id;
-	presets[id-1] = preset;
+	dnafx_store_handle old = presets[slot-1];
+	if(old == DNAFX_STORE_INVALID)
+		return 0;
+	/* The record stays in the library, if it has a name there */
+	presets[slot-1] = DNAFX_STORE_INVALID;
+	uint8_t *old_image = dnafx_store_image(old);
+	if(old_image != NULL)
+		old_image[0] = 0;
+	dnafx_preset *old_view = g_hash_table_lookup(presets_views, GUINT_TO_POINTER(old));
+	if(old_view != NULL)
+		old_view->id = 0;
+	dnafx_presets_unref(old);
 	return 0;
 }
 
+int dnafx_preset_put_image(int slot, const uint8_t *image) {
+	if(presets_byname == NULL || image == NULL || slot < 1 || slot > DNAFX_PRESETS_NUM) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return -1;
+	}
+	/* If we know this preset already, the slot will reference the same record */
+	uint8_t copy[DNAFX_PRESET_SIZE];
+	memcpy(copy, image, DNAFX_PRESET_SIZE);
+	copy[0] = slot;
+	return dnafx_preset_add_image(copy, TRUE) != DNAFX_STORE_INVALID ? 0 : -1;
+}
+
+/* Helper to match the library entries of a record */
+static gboolean dnafx_presets_is_record(gpointer key, gpointer value, gpointer user_data) {
+	return value == user_data;
+}
+
 int dnafx_preset_remove(dnafx_preset *preset) {
-	if(presets_byname == NULL || preset == NULL || strlen(preset->name) == 0) {
+	if(presets_byname == NULL || preset == NULL || preset->handle == DNAFX_STORE_INVALID) {
 		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
 		return -1;
 	}
-	gboolean done = g_hash_table_remove(presets_byname, preset->name);
-	return done ? 0 : -1;
+	/* The name in the image may not be the one in the library (aliases,
+	 * unique names), so we remove all the names of the record we found;
+	 * device slots referencing the same record keep it alive */
+	guint removed = g_hash_table_foreach_remove(presets_byname,
+		dnafx_presets_is_record, GUINT_TO_POINTER(preset->handle));
+	if(removed > 0)
+		dnafx_presets_names_changed();
+	return removed > 0 ? 0 : -1;
 }
 
 /* Listing presets */
 void dnafx_presets_print(void) {
-	dnafx_preset *preset = NULL;
-	DNAFX_LOG(DNAFX_LOG_INFO, "Device presets:\n");
+	const uint8_t *image = NULL;
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	DNAFX_LOG(DNAFX_LOG_INFO, "Device presets%s:\n", dnafx_session_is_open() ? " (edit session)" : "");
 	uint8_t i = 0;
 	for(i=1; i<= DNAFX_PRESETS_NUM; i++) {
 		DNAFX_LOG(DNAFX_LOG_INFO, "   ");
-		preset = presets[i-1];
+		/* While an edit session is open, slots are read through its overlay */
+		image = dnafx_session_slot_image(i);
+		dnafx_preset_image_name(image, name, sizeof(name));
 		DNAFX_LOG(DNAFX_LOG_INFO, "[%03d] %-14s   ",
-			preset ? preset->id : 0, preset ? preset->name : NULL);
+			image ? i : 0, image ? name : NULL);
 		if((i % 3) == 0)
 			DNAFX_LOG(DNAFX_LOG_INFO, "\n");
 	}
 	DNAFX_LOG(DNAFX_LOG_INFO, "\n\n");
 	DNAFX_LOG(DNAFX_LOG_INFO, "Named presets:\n");
-	GList *names = presets_byname ? g_hash_table_get_keys(presets_byname) : NULL;
-	GList *no_id = NULL, *temp = names;
-	while(temp != NULL) {
-		preset = g_hash_table_lookup(presets_byname, (char *)temp->data);
-		if(preset->id == 0)
-			no_id = g_list_prepend(no_id, preset);
-		temp = temp->next;
-	}
-	g_list_free(names);
-	if(no_id == NULL) {
-		DNAFX_LOG(DNAFX_LOG_INFO, " (none)");
-	} else {
-		i = 0;
-		GList *temp = no_id;
-		while(temp != NULL) {
-			DNAFX_LOG(DNAFX_LOG_INFO, "   ");
-			i++;
-			preset = (dnafx_preset *)temp->data;
-			DNAFX_LOG(DNAFX_LOG_INFO, "[XXX] %-14s   ", preset ? preset->name : NULL);
-			if((i % 3) == 0)
-				DNAFX_LOG(DNAFX_LOG_INFO, "\n");
-			temp = temp->next;
-		}
+	GHashTableIter iter;
+	gpointer key = NULL, value = NULL;
+	if(presets_byname != NULL)
+		g_hash_table_iter_init(&iter, presets_byname);
+	i = 0;
+	while(presets_byname != NULL && g_hash_table_iter_next(&iter, &key, &value)) {
+		if(dnafx_presets_in_slot(GPOINTER_TO_UINT(value)))
+			continue;
+		DNAFX_LOG(DNAFX_LOG_INFO, "   ");
+		i++;
+		DNAFX_LOG(DNAFX_LOG_INFO, "[XXX] %-14s   ", (char *)key);
+		if((i % 3) == 0)
+			DNAFX_LOG(DNAFX_LOG_INFO, "\n");
 	}
+	if(i == 0)
+		DNAFX_LOG(DNAFX_LOG_INFO, " (none)");
 	DNAFX_LOG(DNAFX_LOG_INFO, "\n\n");
-	g_list_free(no_id);
+	DNAFX_LOG(DNAFX_LOG_VERB, "Store: %u records, %zu bytes\n", dnafx_store_count(), dnafx_store_memory());
 }
 
 json_t *dnafx_presets_list(void) {
-	dnafx_preset *preset = NULL;
+	const uint8_t *image = NULL;
+	char name[DNAFX_PRESET_NAME_SIZE+1];
 	json_t *list = json_object();
 	json_t *device = json_object();
 	uint8_t i = 0;
 	char id_num[4];
 	for(i=1; i<= DNAFX_PRESETS_NUM; i++) {
-		preset = presets[i-1];
-		if(preset) {
+		/* While an edit session is open, slots are read through its overlay */
+		image = dnafx_session_slot_image(i);
+		if(image) {
+			dnafx_preset_image_name(image, name, sizeof(name));
 			json_t *p = json_object();
-			json_object_set(p, "id", json_integer(preset->id));
-			json_object_set(p, "name", json_string(preset->name));
-			g_snprintf(id_num, sizeof(id_num), "%d", preset->id);
-			json_object_set(device, id_num, p);
+			json_object_set_new(p, "id", json_integer(i));
+			json_object_set_new(p, "name", json_string(name));
+			if(image != dnafx_preset_slot_image(i))
+				json_object_set_new(p, "dirty", json_true());
+			g_snprintf(id_num, sizeof(id_num), "%d", i);
+			json_object_set_new(device, id_num, p);
 		}
 	}
 	json_object_set_new(list, "device", device);
 	json_t *named = json_array();
-	GList *names = presets_byname ? g_hash_table_get_keys(presets_byname) : NULL;
-	GList *no_id = NULL, *temp = names;
-	while(temp != NULL) {
-		preset = g_hash_table_lookup(presets_byname, (char *)temp->data);
-		if(preset->id == 0)
-			no_id = g_list_prepend(no_id, preset);
-		temp = temp->next;
-	}
-	g_list_free(names);
-	if(no_id != NULL) {
-		i = 0;
-		GList *temp = no_id;
-		while(temp != NULL) {
-			preset = (dnafx_preset *)temp->data;
-			json_array_append_new(named, json_string(preset->name));
-			temp = temp->next;
-		}
-	}
-	g_list_free(no_id);
+	GHashTableIter iter;
+	gpointer key = NULL, value = NULL;
+	if(presets_byname != NULL) {
+		g_hash_table_iter_init(&iter, presets_byname);
+		while(g_hash_table_iter_next(&iter, &key, &value)) {
+			if(!dnafx_presets_in_slot(GPOINTER_TO_UINT(value)))
+				json_array_append_new(named, json_string((char *)key));
+		}
+	}
 	json_object_set_new(list, "others", named);
 	return list;
 }
+
+/* Paged listings */
+int dnafx_presets_sort_from_str(const char *sort) {
+	if(sort == NULL || !strcasecmp(sort, "name"))
+		return DNAFX_PRESETS_SORT_NAME;
+	else if(!strcasecmp(sort, "slot"))
+		return DNAFX_PRESETS_SORT_SLOT;
+	else if(!strcasecmp(sort, "modified"))
+		return DNAFX_PRESETS_SORT_MODIFIED;
+	return -1;
+}
+
+const char *dnafx_presets_sort_str(dnafx_presets_sort sort) {
+	switch(sort) {
+		case DNAFX_PRESETS_SORT_NAME:
+			return "name";
+		case DNAFX_PRESETS_SORT_SLOT:
+			return "slot";
+		case DNAFX_PRESETS_SORT_MODIFIED:
+			return "modified";
+		default:
+			break;
+	}
+	return NULL;
+}
+
+/* By name ignoring case, by slot (presets not on the device last), or
+ * most recently changed first, using the name to break ties */
+static int dnafx_presets_entry_compare_name(gconstpointer a, gconstpointer b) {
+	const dnafx_presets_entry *ea = a, *eb = b;
+	int res = g_ascii_strcasecmp(ea->name, eb->name);
+	return res ? res : strcmp(ea->name, eb->name);
+}
+
+static int dnafx_presets_entry_compare_slot(gconstpointer a, gconstpointer b) {
+	const dnafx_presets_entry *ea = a, *eb = b;
+	int sa = ea->slot ? ea->slot : DNAFX_PRESETS_NUM+1, sb = eb->slot ? eb->slot : DNAFX_PRESETS_NUM+1;
+	if(sa != sb)
+		return sa < sb ? -1 : 1;
+	return dnafx_presets_entry_compare_name(a, b);
+}
+
+static int dnafx_presets_entry_compare_modified(gconstpointer a, gconstpointer b) {
+	const dnafx_presets_entry *ea = a, *eb = b;
+	if(ea->stamp != eb->stamp)
+		return ea->stamp > eb->stamp ? -1 : 1;
+	return dnafx_presets_entry_compare_name(a, b);
+}
+
+static GCompareFunc dnafx_presets_entry_compare(dnafx_presets_sort sort) {
+	if(sort == DNAFX_PRESETS_SORT_SLOT)
+		return dnafx_presets_entry_compare_slot;
+	else if(sort == DNAFX_PRESETS_SORT_MODIFIED)
+		return dnafx_presets_entry_compare_modified;
+	return dnafx_presets_entry_compare_name;
+}
+
+static GArray *dnafx_presets_pages_update(dnafx_presets_sort sort) {
+	if(presets_pages[sort].entries != NULL &&
+			presets_pages[sort].generation == dnafx_store_generation() &&
+			presets_pages[sort].version == presets_names_version)
+		return presets_pages[sort].entries;
+	if(presets_pages[sort].entries == NULL)
+		presets_pages[sort].entries = g_array_new(FALSE, FALSE, sizeof(dnafx_presets_entry));
+	GArray *entries = presets_pages[sort].entries;
+	g_array_set_size(entries, 0);
+	dnafx_presets_entry entry;
+	GHashTableIter iter;
+	gpointer key = NULL, value = NULL;
+	uint8_t *image = NULL;
+	gboolean listed[DNAFX_PRESETS_NUM] = { 0 };
+	g_hash_table_iter_init(&iter, presets_byname);
+	while(g_hash_table_iter_next(&iter, &key, &value)) {
+		memset(&entry, 0, sizeof(entry));
+		g_snprintf(entry.name, sizeof(entry.name), "%s", (char *)key);
+		entry.handle = GPOINTER_TO_UINT(value);
+		if(dnafx_presets_in_slot(entry.handle)) {
+			entry.slot = dnafx_store_image(entry.handle)[0];
+			listed[entry.slot-1] = TRUE;
+		}
+		entry.stamp = dnafx_store_stamp(entry.handle);
+		g_array_append_val(entries, entry);
+	}
+	/* Device slots whose preset doesn't have a name entry anymore */
+	int i = 0;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		image = dnafx_store_image(presets[i]);
+		if(image == NULL || listed[i])
+			continue;
+		memset(&entry, 0, sizeof(entry));
+		dnafx_preset_image_name(image, entry.name, sizeof(entry.name));
+		entry.handle = presets[i];
+		entry.slot = i + 1;
+		entry.stamp = dnafx_store_stamp(entry.handle);
+		g_array_append_val(entries, entry);
+	}
+	g_array_sort(entries, dnafx_presets_entry_compare(sort));
+	presets_pages[sort].generation = dnafx_store_generation();
+	presets_pages[sort].version = presets_names_version;
+	return entries;
+}
+
+json_t *dnafx_presets_list_page(dnafx_presets_sort sort, int limit, const char *cursor, gboolean full) {
+	if(presets_byname == NULL || sort > DNAFX_PRESETS_SORT_MODIFIED) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return NULL;
+	}
+	if(limit <= 0)
+		limit = DNAFX_PRESETS_PAGE_LIMIT;
+	GArray *entries = dnafx_presets_pages_update(sort);
+	GCompareFunc compare = dnafx_presets_entry_compare(sort);
+	/* Cursors are the sort key and the name of the last preset we returned
+	 * (key:name), so we start from the first entry that comes after that */
+	guint start = 0;
+	if(cursor != NULL && *cursor != '\0') {
+		dnafx_presets_entry last = { 0 };
+		char *name = NULL;
+		guint64 key = g_ascii_strtoull(cursor, &name, 10);
+		if(name == NULL || *name != ':') {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Invalid cursor '%s'\n", cursor);
+			return NULL;
+		}
+		g_snprintf(last.name, sizeof(last.name), "%s", name + 1);
+		if(sort == DNAFX_PRESETS_SORT_SLOT)
+			last.slot = key;
+		else if(sort == DNAFX_PRESETS_SORT_MODIFIED)
+			last.stamp = key;
+		guint low = 0, high = entries->len, mid = 0;
+		while(low < high) {
+			mid = low + (high - low) / 2;
+			if(compare(&g_array_index(entries, dnafx_presets_entry, mid), &last) <= 0)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		start = low;
+	}
+	json_t *page = json_object();
+	json_object_set_new(page, "sort", json_string(dnafx_presets_sort_str(sort)));
+	json_object_set_new(page, "count", json_integer(entries->len));
+	json_t *list = json_array();
+	guint i = 0;
+	dnafx_presets_entry *entry = NULL;
+	for(i=start; i<entries->len && i<start+limit; i++) {
+		entry = &g_array_index(entries, dnafx_presets_entry, i);
+		json_t *p = json_object();
+		json_object_set_new(p, "name", json_string(entry->name));
+		if(entry->slot > 0)
+			json_object_set_new(p, "id", json_integer(entry->slot));
+		json_object_set_new(p, "modified", json_integer(entry->stamp));
+		if(full) {
+			dnafx_preset *preset = dnafx_presets_view(entry->handle);
+			json_t *phb = preset ? dnafx_preset_to_phb_json(preset) : NULL;
+			if(phb != NULL)
+				json_object_set_new(p, "phb", phb);
+		}
+		json_array_append_new(list, p);
+	}
+	json_object_set_new(page, "presets", list);
+	if(i < entries->len && entry != NULL) {
+		/* There's more, tell the caller where to start from next time */
+		char next[64];
+		guint64 key = (sort == DNAFX_PRESETS_SORT_SLOT ? entry->slot :
+			(sort == DNAFX_PRESETS_SORT_MODIFIED ? entry->stamp : 0));
+		g_snprintf(next, sizeof(next), "%"SCNu64":%s", key, entry->name);
+		json_object_set_new(page, "next", json_string(next));
+	}
+	return page;
+}
+
+/* Helper to describe a search result */
+static json_t *dnafx_presets_search_result(const char *name) {
+	json_t *result = json_object();
+	json_object_set_new(result, "name", json_string(name));
+	dnafx_store_handle handle = GPOINTER_TO_UINT(g_hash_table_lookup(presets_byname, name));
+	if(dnafx_presets_in_slot(handle))
+		json_object_set_new(result, "id", json_integer(dnafx_store_image(handle)[0]));
+	return result;
+}
+
+typedef struct dnafx_presets_match {
+	const char *name;
+	int score;
+} dnafx_presets_match;
+
+json_t *dnafx_presets_search(const char *query, gboolean fuzzy, int limit) {
+	if(presets_byname == NULL || query == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return NULL;
+	}
+	if(limit <= 0)
+		limit = DNAFX_PRESETS_SEARCH_LIMIT;
+	dnafx_presets_names_update();
+	json_t *results = json_array();
+	size_t q_len = strlen(query);
+	if(!fuzzy) {
+		/* Names are sorted, so all names with this prefix are next to each other */
+		guint low = 0, high = presets_names->len, mid = 0;
+		while(low < high) {
+			mid = low + (high - low) / 2;
+			if(g_ascii_strncasecmp(g_ptr_array_index(presets_names, mid), query, q_len) < 0)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		const char *name = NULL;
+		for(; low < presets_names->len && json_array_size(results) < (size_t)limit; low++) {
+			name = g_ptr_array_index(presets_names, low);
+			if(g_ascii_strncasecmp(name, query, q_len))
+				break;
+			json_array_append_new(results, dnafx_presets_search_result(name));
+		}
+		return results;
+	}
+	/* Fuzzy search: keep the best matches, in order of score */
+	dnafx_presets_match *matches = g_malloc0_n(limit, sizeof(dnafx_presets_match));
+	int found = 0, score = 0, i = 0;
+	guint n = 0;
+	const char *name = NULL;
+	for(n=0; n<presets_names->len; n++) {
+		name = g_ptr_array_index(presets_names, n);
+		score = dnafx_presets_fuzzy_score(name, query);
+		if(score < 0 || (found == limit && score <= matches[limit-1].score))
+			continue;
+		/* Insert the match where it belongs, dropping the worst if we're full */
+		i = (found < limit) ? found++ : limit - 1;
+		while(i > 0 && matches[i-1].score < score) {
+			matches[i] = matches[i-1];
+			i--;
+		}
+		matches[i].name = name;
+		matches[i].score = score;
+	}
+	for(i=0; i<found; i++) {
+		json_t *result = dnafx_presets_search_result(matches[i].name);
+		json_object_set_new(result, "score", json_integer(matches[i].score));
+		json_array_append_new(results, result);
+	}
+	g_free(matches);
+	return results;
+}
+
+/* Bulk patches: the selection and the field to change are resolved once,
+ * and then applied to the images in the device slots */
+#define DNAFX_PRESETS_EFFECTS_MAX	64	/* More than any section has */
+typedef struct dnafx_presets_field {
+	int section;		/* -1 for expressions */
+	int what;			/* 0: param, 1: switch, 2: effect */
+	int index;			/* Expression index, or param index if a single effect */
+	int params[DNAFX_PRESETS_EFFECTS_MAX];	/* Param index for each effect (-1 if none) */
+} dnafx_presets_field;
+
+/* Helper to resolve SECTION.FIELD or EXP.NAME */
+static int dnafx_presets_field_parse(const char *text, size_t len, dnafx_presets_field *field) {
+	memset(field, 0, sizeof(*field));
+	const char *dot = memchr(text, '.', len);
+	if(dot == NULL || dot == text || (size_t)(dot - text) >= len - 1)
+		return -1;
+	char *section = g_strndup(text, dot - text);
+	char *name = g_strndup(dot + 1, len - (dot - text) - 1);
+	g_strstrip(section);
+	g_strstrip(name);
+	int i = 0, found = 0, ret = 0;
+	if(!g_ascii_strcasecmp(section, "EXP")) {
+		field->section = -1;
+		field->index = -1;
+		for(i=0; i<DNAFX_PRESET_EXPS; i++) {
+			if(!g_ascii_strcasecmp(dnafx_expression[i], name))
+				field->index = i;
+		}
+		ret = field->index < 0 ? -1 : 0;
+		goto done;
+	}
+	field->section = dnafx_preset_section_byname(section);
+	if(field->section < 0) {
+		ret = -1;
+		goto done;
+	}
+	if(!g_ascii_strcasecmp(name, "SWITCH")) {
+		field->what = 1;
+	} else if(!g_ascii_strcasecmp(name, "TYPE")) {
+		field->what = 2;
+	} else {
+		/* Effects in the same section may have the param in different positions */
+		for(i=0; i<=dnafx_sections[field->section].effects_max; i++) {
+			field->params[i] = dnafx_preset_effect_param(field->section, i, name);
+			if(field->params[i] >= 0)
+				found++;
+		}
+		ret = found > 0 ? 0 : -1;
+	}
+done:
+	g_free(section);
+	g_free(name);
+	return ret;
+}
+
+/* Helper to parse a value for a field (on/off for switches, names for effects) */
+static int dnafx_presets_field_value(dnafx_presets_field *field, const char *value) {
+	if(value == NULL || *value == '\0')
+		return -1;
+	if(field->what == 1 && (!g_ascii_strcasecmp(value, "on") || !g_ascii_strcasecmp(value, "off")))
+		return !g_ascii_strcasecmp(value, "on");
+	if(field->what == 2 && !g_ascii_isdigit(*value))
+		return dnafx_preset_effect_byname(field->section, value);
+	char *end = NULL;
+	long number = strtol(value, &end, 10);
+	if(end == value || *end != '\0' || number < 0 || number > G_MAXUINT16)
+		return -1;
+	return (int)number;
+}
+
+json_t *dnafx_presets_patch(const char *selection, const char *expression, GByteArray **uploads) {
+	if(selection == NULL || expression == NULL || uploads == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return NULL;
+	}
+	*uploads = NULL;
+	dnafx_presets_image_offsets();
+	/* Parse the selection first */
+	gboolean slots[DNAFX_PRESETS_NUM] = { 0 };
+	GPatternSpec *pattern = NULL;
+	dnafx_presets_field filter;
+	int filter_value = -1, first = 0, last = 0, i = 0;
+	const char *eq = strchr(selection, '=');
+	if(!g_ascii_strcasecmp(selection, "all")) {
+		first = 1;
+		last = DNAFX_PRESETS_NUM;
+	} else if(g_ascii_isdigit(*selection)) {
+		int n = sscanf(selection, "%d-%d", &first, &last);
+		if(n == 1)
+			last = first;
+		if(n < 1 || first < 1 || last < first || last > DNAFX_PRESETS_NUM) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Invalid slot range '%s'\n", selection);
+			return NULL;
+		}
+	} else if(!g_ascii_strncasecmp(selection, "name=", 5)) {
+		char *upper = g_ascii_strup(selection + 5, -1);
+		pattern = g_pattern_spec_new(upper);
+		g_free(upper);
+		first = 1;
+		last = DNAFX_PRESETS_NUM;
+	} else if(eq != NULL && dnafx_presets_field_parse(selection, eq - selection, &filter) == 0 &&
+			filter.section >= 0 && filter.what > 0 &&
+			(filter_value = dnafx_presets_field_value(&filter, eq + 1)) >= 0) {
+		first = 1;
+		last = DNAFX_PRESETS_NUM;
+	} else {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid selection '%s' (should be all, a slot range, name=pattern, SECTION.TYPE=effect or SECTION.SWITCH=on|off)\n", selection);
+		return NULL;
+	}
+	for(i=first; i<=last; i++)
+		slots[i-1] = TRUE;
+	/* Then the field to change, the operator and the value */
+	dnafx_presets_field field;
+	int op = '=', value = -1;
+	eq = strchr(expression, '=');
+	size_t len = eq ? (size_t)(eq - expression) : 0;
+	if(len > 0 && (expression[len-1] == '+' || expression[len-1] == '-')) {
+		op = expression[len-1];
+		len--;
+	}
+	if(eq == NULL || dnafx_presets_field_parse(expression, len, &field) < 0 ||
+			(value = dnafx_presets_field_value(&field, eq + 1)) < 0 ||
+			(op != '=' && field.what > 0)) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid patch '%s' (should be SECTION.PARAM, SECTION.SWITCH, SECTION.TYPE or EXP.NAME, followed by =, += or -= and a value)\n", expression);
+		if(pattern != NULL)
+			g_pattern_spec_free(pattern);
+		return NULL;
+	}
+	if(field.what == 2 && value > dnafx_sections[field.section].effects_max) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid effect '%s' for section %s\n", eq + 1, dnafx_sections[field.section].name);
+		if(pattern != NULL)
+			g_pattern_spec_free(pattern);
+		return NULL;
+	}
+	/* Go through the slots: only images that actually change are queued */
+	gint64 start = g_get_monotonic_time();
+	*uploads = g_byte_array_new();
+	json_t *report = json_object();
+	json_t *patched = json_array();
+	int matched = 0, skipped = 0, effect = 0, param = -1, current = 0, updated = 0;
+	size_t offset = 0;
+	const uint8_t *image = NULL;
+	uint8_t *copy = NULL;
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		/* If an edit session is open, we patch what's in there */
+		if(!slots[i] || (image = dnafx_session_slot_image(i + 1)) == NULL)
+			continue;
+		if(pattern != NULL) {
+			dnafx_preset_image_name(image, name, sizeof(name));
+			char *upper = g_ascii_strup(name, -1);
+			gboolean match = g_pattern_match_string(pattern, upper);
+			g_free(upper);
+			if(!match)
+				continue;
+		} else if(filter_value >= 0) {
+			offset = image_sections[filter.section] + (filter.what == 2 ? 2 : 0);
+			current = dnafx_image_get16(image, offset);
+			if(filter.what == 1 ? ((current ? 1 : 0) != filter_value) : (current != filter_value))
+				continue;
+		}
+		matched++;
+		/* Locate the field in this image */
+		if(field.section < 0) {
+			offset = image_expressions + 2*field.index;
+		} else if(field.what == 0) {
+			effect = dnafx_image_get16(image, image_sections[field.section] + 2);
+			param = effect <= dnafx_sections[field.section].effects_max ? field.params[effect] : -1;
+			if(param < 0) {
+				/* The effect in this section doesn't have this param */
+				skipped++;
+				continue;
+			}
+			offset = image_sections[field.section] + 4 + 2*param;
+		} else {
+			offset = image_sections[field.section] + (field.what == 2 ? 2 : 0);
+		}
+		current = dnafx_image_get16(image, offset);
+		if(op == '+')
+			updated = MIN(current + value, G_MAXUINT16);
+		else if(op == '-')
+			updated = MAX(current - value, 0);
+		else
+			updated = value;
+		if(field.what == 1)
+			current = current ? 1 : 0;
+		if(updated == current)
+			continue;
+		g_byte_array_append(*uploads, image, DNAFX_PRESET_SIZE);
+		copy = (*uploads)->data + (*uploads)->len - DNAFX_PRESET_SIZE;
+		copy[0] = i + 1;
+		dnafx_image_set16(copy, offset, updated);
+		json_t *slot = json_object();
+		json_object_set_new(slot, "slot", json_integer(i + 1));
+		dnafx_preset_image_name(image, name, sizeof(name));
+		json_object_set_new(slot, "name", json_string(name));
+		json_object_set_new(slot, "from", json_integer(current));
+		json_object_set_new(slot, "to", json_integer(updated));
+		json_array_append_new(patched, slot);
+	}
+	if(pattern != NULL)
+		g_pattern_spec_free(pattern);
+	json_object_set_new(report, "selection", json_string(selection));
+	json_object_set_new(report, "patch", json_string(expression));
+	json_object_set_new(report, "matched", json_integer(matched));
+	if(skipped > 0)
+		json_object_set_new(report, "skipped", json_integer(skipped));
+	json_object_set_new(report, "uploads", patched);
+	json_object_set_new(report, "elapsed-us", json_integer(g_get_monotonic_time() - start));
+	return report;
+}
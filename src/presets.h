@@ -7,12 +7,16 @@
 #include <glib.h>
 #include <jansson.h>
 
+#include "store.h"
+
 /* Defines */
 #define DNAFX_PRESETS_NUM		200
 #define DNAFX_PRESET_SIZE		184
 #define DNAFX_PRESET_NAME_SIZE	14
 #define DNAFX_PRESET_EFFECTS	9
 #define DNAFX_PRESET_EXPS		6
+/* Highest number we append to names to make them unique */
+#define DNAFX_PRESETS_MAX_SUFFIX	9999
 
 /* Presets state */
 int dnafx_presets_init(const char *folder);
@@ -42,6 +46,8 @@ typedef struct dnafx_preset_effect {
 typedef uint16_t dnafx_preset_expression;
 
 typedef struct dnafx_preset {
+	/* Record in the store this is a decoded view of, if any */
+	dnafx_store_handle handle;
 	int id;
 	char name[DNAFX_PRESET_NAME_SIZE+1];
 	dnafx_preset_effect effects[DNAFX_PRESET_EFFECTS];
@@ -53,26 +59,105 @@ void dnafx_preset_free(dnafx_preset *preset);
 /* Parsing */
 dnafx_preset *dnafx_preset_from_bytes(uint8_t *buf, size_t blen);
 dnafx_preset *dnafx_preset_from_phb(const char *phb);
+dnafx_preset *dnafx_preset_from_phb_buffer(const char *phb, size_t len);
+
+/* Zero-copy access to the fields of a wire image, using the offsets of
+ * the sections: getters return -1 in case of invalid arguments */
+int dnafx_preset_image_set_name(uint8_t *image, const char *name);
+int dnafx_preset_image_active(const uint8_t *image, int section);
+int dnafx_preset_image_set_active(uint8_t *image, int section, gboolean active);
+int dnafx_preset_image_effect(const uint8_t *image, int section);
+int dnafx_preset_image_set_effect(uint8_t *image, int section, uint16_t id);
+int dnafx_preset_image_param(const uint8_t *image, int section, int param);
+int dnafx_preset_image_set_param(uint8_t *image, int section, int param, uint16_t value);
+int dnafx_preset_image_expression(const uint8_t *image, int index);
+int dnafx_preset_image_set_expression(uint8_t *image, int index, uint16_t value);
+/* Effects metadata, with names matched ignoring case */
+int dnafx_preset_section_byname(const char *name);
+const char *dnafx_preset_section_name(int section);
+int dnafx_preset_section_effects(int section);
+int dnafx_preset_effect_byname(int section, const char *name);
+int dnafx_preset_effect_param(int section, int effect, const char *name);
+/* Wire image of a preset in the store, if it's there: changing the fields
+ * of a view doesn't change the image (encoders use the fields, though),
+ * so stored presets must be changed in the image, and then refreshed */
+uint8_t *dnafx_preset_image(dnafx_preset *preset);
+/* Must be called after changing the image of a stored preset in place */
+void dnafx_preset_refresh(dnafx_store_handle handle);
 
 /* Encoding */
 int dnafx_preset_to_bytes(dnafx_preset *preset, uint8_t *buf, size_t blen);
 char *dnafx_preset_to_bytes_base64(dnafx_preset *preset);
 char *dnafx_preset_to_phb(dnafx_preset *preset);
+/* Appends the PHB text of a preset to a (reusable) buffer, returns its length */
+int dnafx_preset_write_phb(dnafx_preset *preset, GString *out, gboolean compact);
 json_t *dnafx_preset_to_phb_json(dnafx_preset *preset);
 
 /* Importing and exporting */
 dnafx_preset *dnafx_preset_import(const char *filename, gboolean phb);
 int dnafx_preset_export(dnafx_preset *preset, const char *filename, gboolean phb);
+/* Import all binary (.bhb) and PHB (.phb) presets in a directory tree */
+json_t *dnafx_presets_import_dir(const char *path);
+/* Wire images of the presets in a folder tree that target a slot, with the
+ * slot as first byte (one per slot at most), as dnafx_bank_images does */
+GByteArray *dnafx_presets_folder_images(const char *path);
 
-/* Presets management */
-int dnafx_preset_add(dnafx_preset *preset);
+/* Presets management: presets we know about are kept in the store as
+ * records, referenced by device slots and/or by name; the dnafx_preset
+ * instances returned by the find methods are decoded views of those
+ * records, which are created on demand and owned by the library. Records
+ * are deduplicated by content: adding a preset we have already under a
+ * different name adds that name as an alias, and the library takes over
+ * the preset to add, returning the instance it keeps (or NULL on errors) */
+dnafx_preset *dnafx_preset_add(dnafx_preset *preset);
+dnafx_store_handle dnafx_preset_add_image(const uint8_t *image, gboolean slot);
+/* Add an image to the library under a name that may not be the one in the
+ * image (e.g., an alias, from an archive), without changing its bytes */
+dnafx_store_handle dnafx_preset_add_named_image(const uint8_t *image, const char *name);
+void dnafx_preset_image_name(const uint8_t *image, char *name, size_t len);
+/* What changed between two wire images (name, and for each section the
+ * state, effect and parameters, then expressions), or NULL if identical */
+json_t *dnafx_preset_image_diff(const uint8_t *a, const uint8_t *b);
+dnafx_store_handle dnafx_preset_handle_byname(const char *name);
+/* Names of all named presets, sorted ignoring case (owned by the library) */
+GPtrArray *dnafx_presets_names(void);
 dnafx_preset *dnafx_preset_find_byid(int id);
 dnafx_preset *dnafx_preset_find_byname(const char *name);
 int dnafx_preset_set_id(dnafx_preset *preset, int id);
+/* Removes the preset (all its names) from the library */
 int dnafx_preset_remove(dnafx_preset *preset);
+/* Device slots: images are the ones in the store, if the slot is filled */
+uint8_t *dnafx_preset_slot_image(int slot);
+int dnafx_preset_put_image(int slot, const uint8_t *image);
+int dnafx_preset_clear_slot(int slot);
+
+/* Change a field in many device presets at once: the selection can be
+ * "all", a slot range (e.g., 100-150), a name pattern (name=US*, matched
+ * ignoring case) or an effect filter (AMP.TYPE="PLX 100", REVERB.SWITCH=on),
+ * while the patch is SECTION.PARAM, SECTION.SWITCH, SECTION.TYPE or EXP.NAME
+ * (e.g., EXP.VOL_MAX), followed by =, += or -= (params and expressions
+ * only) and a value. Presets using an effect without that param are left
+ * alone. The images of the presets that change are returned, with the slot
+ * as first byte, to be uploaded, as well as a report on them; if an edit
+ * session is open, the images are taken from the session overlay */
+json_t *dnafx_presets_patch(const char *selection, const char *expression, GByteArray **uploads);
 
 /* Listing presets */
 void dnafx_presets_print(void);
 json_t *dnafx_presets_list(void);
+/* Paged listing of all known presets: the cursor is the one returned as
+ * "next" by the previous page, and full adds the PHB of each preset */
+typedef enum dnafx_presets_sort {
+	DNAFX_PRESETS_SORT_NAME = 0,
+	DNAFX_PRESETS_SORT_SLOT,
+	DNAFX_PRESETS_SORT_MODIFIED
+} dnafx_presets_sort;
+int dnafx_presets_sort_from_str(const char *sort);
+const char *dnafx_presets_sort_str(dnafx_presets_sort sort);
+#define DNAFX_PRESETS_PAGE_LIMIT	50
+json_t *dnafx_presets_list_page(dnafx_presets_sort sort, int limit, const char *cursor, gboolean full);
+/* Search named presets by prefix or fuzzy match, ignoring case */
+#define DNAFX_PRESETS_SEARCH_LIMIT	20
+json_t *dnafx_presets_search(const char *query, gboolean fuzzy, int limit);
 
 #endif
@@ -0,0 +1,583 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "query.h"
+#include "presets.h"
+#include "debug.h"
+
+/* Columnar index of the records in the store: rows are handles - 1 */
+#define DNAFX_QUERY_PARAMS	6
+static struct {
+	guint rows, words;
+	guint64 generation;
+	gboolean built;
+	/* Records in use */
+	uint64_t *used;
+	/* Effect, state and parameters of each section */
+	uint8_t *effects[DNAFX_PRESET_EFFECTS];
+	uint64_t *active[DNAFX_PRESET_EFFECTS];
+	uint16_t *params[DNAFX_PRESET_EFFECTS][DNAFX_QUERY_PARAMS];
+	/* Expression pedal settings */
+	uint16_t *expressions[DNAFX_PRESET_EXPS];
+} columns;
+
+#define DNAFX_QUERY_BIT_SET(bitmap, row)	(bitmap)[(row) >> 6] |= ((uint64_t)1 << ((row) & 63))
+#define DNAFX_QUERY_BIT_GET(bitmap, row)	(((bitmap)[(row) >> 6] >> ((row) & 63)) & 1)
+
+static void dnafx_query_index_update(void) {
+	guint rows = dnafx_store_capacity();
+	if(columns.built && columns.rows == rows && columns.generation == dnafx_store_generation())
+		return;
+	gint64 start = g_get_monotonic_time();
+	/* (Re)allocate the columns, if the store grew */
+	if(!columns.built || columns.rows != rows) {
+		columns.rows = rows;
+		columns.words = rows / 64 + 1;
+		int i = 0, j = 0;
+		columns.used = g_realloc(columns.used, columns.words * sizeof(uint64_t));
+		for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+			columns.effects[i] = g_realloc(columns.effects[i], rows);
+			columns.active[i] = g_realloc(columns.active[i], columns.words * sizeof(uint64_t));
+			for(j=0; j<DNAFX_QUERY_PARAMS; j++)
+				columns.params[i][j] = g_realloc(columns.params[i][j], rows * sizeof(uint16_t));
+		}
+		for(i=0; i<DNAFX_PRESET_EXPS; i++)
+			columns.expressions[i] = g_realloc(columns.expressions[i], rows * sizeof(uint16_t));
+	}
+	memset(columns.used, 0, columns.words * sizeof(uint64_t));
+	int i = 0, j = 0;
+	for(i=0; i<DNAFX_PRESET_EFFECTS; i++)
+		memset(columns.active[i], 0, columns.words * sizeof(uint64_t));
+	/* Fill the columns */
+	guint row = 0;
+	const uint8_t *image = NULL;
+	int value = 0;
+	for(row=0; row<rows; row++) {
+		image = dnafx_store_image(row + 1);
+		if(image == NULL) {
+			/* Free records are masked out, but zero them anyway, so that
+			 * anything scanning the columns never reads garbage */
+			for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+				columns.effects[i][row] = 0;
+				for(j=0; j<DNAFX_QUERY_PARAMS; j++)
+					columns.params[i][j][row] = 0;
+			}
+			for(i=0; i<DNAFX_PRESET_EXPS; i++)
+				columns.expressions[i][row] = 0;
+			continue;
+		}
+		DNAFX_QUERY_BIT_SET(columns.used, row);
+		for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+			columns.effects[i][row] = dnafx_preset_image_effect(image, i);
+			if(dnafx_preset_image_active(image, i) == 1)
+				DNAFX_QUERY_BIT_SET(columns.active[i], row);
+			for(j=0; j<DNAFX_QUERY_PARAMS; j++) {
+				value = dnafx_preset_image_param(image, i, j);
+				columns.params[i][j][row] = value < 0 ? 0 : value;
+			}
+		}
+		for(i=0; i<DNAFX_PRESET_EXPS; i++) {
+			value = dnafx_preset_image_expression(image, i);
+			columns.expressions[i][row] = value < 0 ? 0 : value;
+		}
+	}
+	columns.generation = dnafx_store_generation();
+	columns.built = TRUE;
+	DNAFX_LOG(DNAFX_LOG_VERB, "Indexed %u records in %"SCNi64"us\n", rows, g_get_monotonic_time() - start);
+}
+
+void dnafx_query_deinit(void) {
+	g_free(columns.used);
+	int i = 0, j = 0;
+	for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+		g_free(columns.effects[i]);
+		g_free(columns.active[i]);
+		for(j=0; j<DNAFX_QUERY_PARAMS; j++)
+			g_free(columns.params[i][j]);
+	}
+	for(i=0; i<DNAFX_PRESET_EXPS; i++)
+		g_free(columns.expressions[i]);
+	memset(&columns, 0, sizeof(columns));
+}
+
+/* Tokenizer: parentheses are tokens on their own, and quotes can be used
+ * to have spaces (or parentheses) in a token; quotes are removed */
+static GPtrArray *dnafx_query_tokenize(const char *query) {
+	GPtrArray *tokens = g_ptr_array_new_with_free_func((GDestroyNotify)g_free);
+	const char *c = query;
+	while(*c) {
+		if(g_ascii_isspace(*c)) {
+			c++;
+			continue;
+		}
+		if(*c == '(' || *c == ')') {
+			g_ptr_array_add(tokens, g_strndup(c, 1));
+			c++;
+			continue;
+		}
+		GString *token = g_string_new(NULL);
+		gboolean quoted = FALSE;
+		while(*c && (quoted || (!g_ascii_isspace(*c) && *c != '(' && *c != ')'))) {
+			if(*c == '"')
+				quoted = !quoted;
+			else
+				g_string_append_c(token, *c);
+			c++;
+		}
+		if(quoted) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Unterminated quote in query\n");
+			g_string_free(token, TRUE);
+			g_ptr_array_unref(tokens);
+			return NULL;
+		}
+		g_ptr_array_add(tokens, g_string_free(token, FALSE));
+	}
+	return tokens;
+}
+
+/* Parser: conditions are evaluated as soon as they're parsed */
+typedef struct dnafx_query_parser {
+	GPtrArray *tokens;
+	guint pos;
+} dnafx_query_parser;
+
+static const char *dnafx_query_peek(dnafx_query_parser *p) {
+	return p->pos < p->tokens->len ? g_ptr_array_index(p->tokens, p->pos) : NULL;
+}
+
+typedef enum dnafx_query_op {
+	DNAFX_QUERY_EQ = 0,
+	DNAFX_QUERY_NE,
+	DNAFX_QUERY_LT,
+	DNAFX_QUERY_LE,
+	DNAFX_QUERY_GT,
+	DNAFX_QUERY_GE
+} dnafx_query_op;
+
+static inline gboolean dnafx_query_compare(int a, dnafx_query_op op, int b) {
+	switch(op) {
+		case DNAFX_QUERY_EQ: return a == b;
+		case DNAFX_QUERY_NE: return a != b;
+		case DNAFX_QUERY_LT: return a < b;
+		case DNAFX_QUERY_LE: return a <= b;
+		case DNAFX_QUERY_GT: return a > b;
+		case DNAFX_QUERY_GE: return a >= b;
+		default: break;
+	}
+	return FALSE;
+}
+
+static gboolean dnafx_query_number(const char *text, int *value) {
+	char *end = NULL;
+	long number = strtol(text, &end, 10);
+	if(*text == '\0' || *end != '\0')
+		return FALSE;
+	*value = number;
+	return TRUE;
+}
+
+static uint64_t *dnafx_query_condition(const char *condition) {
+	/* Split the condition in section, field, operator and value */
+	const char *dot = strchr(condition, '.');
+	const char *op_start = strpbrk(condition, "!<>=");
+	if(dot == NULL || op_start == NULL || op_start < dot) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid condition '%s'\n", condition);
+		return NULL;
+	}
+	char *section_name = g_strndup(condition, dot - condition);
+	int section = dnafx_preset_section_byname(section_name);
+	g_free(section_name);
+	if(section < 0) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Unknown section in condition '%s'\n", condition);
+		return NULL;
+	}
+	dnafx_query_op op = DNAFX_QUERY_EQ;
+	const char *value_text = op_start + 1;
+	if(op_start[0] == '!' && op_start[1] == '=') {
+		op = DNAFX_QUERY_NE;
+		value_text++;
+	} else if(op_start[0] == '<') {
+		op = DNAFX_QUERY_LT;
+		if(op_start[1] == '=') {
+			op = DNAFX_QUERY_LE;
+			value_text++;
+		}
+	} else if(op_start[0] == '>') {
+		op = DNAFX_QUERY_GT;
+		if(op_start[1] == '=') {
+			op = DNAFX_QUERY_GE;
+			value_text++;
+		}
+	} else if(op_start[0] == '=') {
+		if(op_start[1] == '=')
+			value_text++;
+	} else {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid operator in condition '%s'\n", condition);
+		return NULL;
+	}
+	char *field = g_strndup(dot + 1, op_start - dot - 1);
+	int value = 0;
+	uint64_t *bitmap = g_malloc0(columns.words * sizeof(uint64_t));
+	guint row = 0;
+	if(!g_ascii_strcasecmp(field, "TYPE")) {
+		/* Effects can be referred to by name or id */
+		if(!dnafx_query_number(value_text, &value))
+			value = dnafx_preset_effect_byname(section, value_text);
+		if(value < 0) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Unknown effect in condition '%s'\n", condition);
+			goto error;
+		}
+		const uint8_t *effects = columns.effects[section];
+		for(row=0; row<columns.rows; row++) {
+			if(DNAFX_QUERY_BIT_GET(columns.used, row) && dnafx_query_compare(effects[row], op, value))
+				DNAFX_QUERY_BIT_SET(bitmap, row);
+		}
+	} else if(!g_ascii_strcasecmp(field, "SWITCH")) {
+		if(!g_ascii_strcasecmp(value_text, "on"))
+			value = 1;
+		else if(!g_ascii_strcasecmp(value_text, "off"))
+			value = 0;
+		else if(!dnafx_query_number(value_text, &value)) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Invalid state in condition '%s'\n", condition);
+			goto error;
+		}
+		for(row=0; row<columns.rows; row++) {
+			if(DNAFX_QUERY_BIT_GET(columns.used, row) &&
+					dnafx_query_compare(DNAFX_QUERY_BIT_GET(columns.active[section], row), op, value))
+				DNAFX_QUERY_BIT_SET(bitmap, row);
+		}
+	} else {
+		/* A parameter: where it is depends on the effect */
+		if(!dnafx_query_number(value_text, &value)) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Invalid value in condition '%s'\n", condition);
+			goto error;
+		}
+		int8_t index[256];
+		memset(index, -1, sizeof(index));
+		int e = 0, effects_num = dnafx_preset_section_effects(section);
+		gboolean found = FALSE;
+		for(e=0; e<effects_num && e<256; e++) {
+			index[e] = dnafx_preset_effect_param(section, e, field);
+			if(index[e] >= DNAFX_QUERY_PARAMS)
+				index[e] = -1;
+			if(index[e] >= 0)
+				found = TRUE;
+		}
+		if(!found) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Unknown parameter in condition '%s'\n", condition);
+			goto error;
+		}
+		const uint8_t *effects = columns.effects[section];
+		int param = 0;
+		for(row=0; row<columns.rows; row++) {
+			if(!DNAFX_QUERY_BIT_GET(columns.used, row))
+				continue;
+			param = index[effects[row]];
+			if(param >= 0 && dnafx_query_compare(columns.params[section][param][row], op, value))
+				DNAFX_QUERY_BIT_SET(bitmap, row);
+		}
+	}
+	g_free(field);
+	return bitmap;
+
+error:
+	g_free(field);
+	g_free(bitmap);
+	return NULL;
+}
+
+static uint64_t *dnafx_query_expression(dnafx_query_parser *p);
+static uint64_t *dnafx_query_factor(dnafx_query_parser *p) {
+	const char *token = dnafx_query_peek(p);
+	if(token == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Unexpected end of query\n");
+		return NULL;
+	}
+	p->pos++;
+	guint i = 0;
+	if(!g_ascii_strcasecmp(token, "not")) {
+		uint64_t *bitmap = dnafx_query_factor(p);
+		if(bitmap == NULL)
+			return NULL;
+		for(i=0; i<columns.words; i++)
+			bitmap[i] = ~bitmap[i] & columns.used[i];
+		return bitmap;
+	} else if(!strcmp(token, "(")) {
+		uint64_t *bitmap = dnafx_query_expression(p);
+		if(bitmap == NULL)
+			return NULL;
+		token = dnafx_query_peek(p);
+		if(token == NULL || strcmp(token, ")")) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Missing closing parenthesis in query\n");
+			g_free(bitmap);
+			return NULL;
+		}
+		p->pos++;
+		return bitmap;
+	}
+	return dnafx_query_condition(token);
+}
+
+static uint64_t *dnafx_query_term(dnafx_query_parser *p) {
+	uint64_t *bitmap = dnafx_query_factor(p), *other = NULL;
+	const char *token = NULL;
+	guint i = 0;
+	while(bitmap != NULL && (token = dnafx_query_peek(p)) != NULL &&
+			g_ascii_strcasecmp(token, "or") && strcmp(token, ")")) {
+		if(!g_ascii_strcasecmp(token, "and"))
+			p->pos++;
+		other = dnafx_query_factor(p);
+		if(other == NULL) {
+			g_free(bitmap);
+			return NULL;
+		}
+		for(i=0; i<columns.words; i++)
+			bitmap[i] &= other[i];
+		g_free(other);
+	}
+	return bitmap;
+}
+
+static uint64_t *dnafx_query_expression(dnafx_query_parser *p) {
+	uint64_t *bitmap = dnafx_query_term(p), *other = NULL;
+	const char *token = NULL;
+	guint i = 0;
+	while(bitmap != NULL && (token = dnafx_query_peek(p)) != NULL && !g_ascii_strcasecmp(token, "or")) {
+		p->pos++;
+		other = dnafx_query_term(p);
+		if(other == NULL) {
+			g_free(bitmap);
+			return NULL;
+		}
+		for(i=0; i<columns.words; i++)
+			bitmap[i] |= other[i];
+		g_free(other);
+	}
+	return bitmap;
+}
+
+/* Queries */
+json_t *dnafx_query_presets(const char *query, int limit) {
+	if(query == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return NULL;
+	}
+	if(limit <= 0)
+		limit = DNAFX_QUERY_LIMIT;
+	GPtrArray *tokens = dnafx_query_tokenize(query);
+	if(tokens == NULL)
+		return NULL;
+	if(tokens->len == 0) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Empty query\n");
+		g_ptr_array_unref(tokens);
+		return NULL;
+	}
+	gint64 start = g_get_monotonic_time();
+	dnafx_query_index_update();
+	dnafx_query_parser parser = { .tokens = tokens, .pos = 0 };
+	uint64_t *bitmap = dnafx_query_expression(&parser);
+	if(bitmap != NULL && parser.pos < tokens->len) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Unexpected '%s' in query\n",
+			(char *)g_ptr_array_index(tokens, parser.pos));
+		g_free(bitmap);
+		bitmap = NULL;
+	}
+	g_ptr_array_unref(tokens);
+	if(bitmap == NULL)
+		return NULL;
+	/* Return the names of the matching presets, sorted */
+	json_t *result = json_object();
+	json_t *presets = json_array();
+	GPtrArray *names = dnafx_presets_names();
+	guint i = 0, count = 0;
+	dnafx_store_handle handle = DNAFX_STORE_INVALID;
+	const char *name = NULL;
+	uint8_t *image = NULL;
+	for(i=0; names != NULL && i<names->len; i++) {
+		name = g_ptr_array_index(names, i);
+		handle = dnafx_preset_handle_byname(name);
+		if(handle == DNAFX_STORE_INVALID || handle > columns.rows || !DNAFX_QUERY_BIT_GET(bitmap, handle - 1))
+			continue;
+		count++;
+		if(json_array_size(presets) >= (size_t)limit)
+			continue;
+		json_t *p = json_object();
+		json_object_set_new(p, "name", json_string(name));
+		image = dnafx_store_image(handle);
+		if(image != NULL && dnafx_preset_slot_image(image[0]) == image)
+			json_object_set_new(p, "id", json_integer(image[0]));
+		json_array_append_new(presets, p);
+	}
+	g_free(bitmap);
+	json_object_set_new(result, "count", json_integer(count));
+	json_object_set_new(result, "presets", presets);
+	json_object_set_new(result, "elapsed-us", json_integer(g_get_monotonic_time() - start));
+	return result;
+}
+
+/* Similarity: each kernel adds the weighted distance of a section to all
+ * rows at once, working on whole columns with no branches in the loops,
+ * which is what allows the compiler to vectorize them */
+static void dnafx_query_distance_section(uint32_t *distances, int section, const uint8_t *image, uint32_t weight) {
+	const uint16_t *c0 = columns.params[section][0], *c1 = columns.params[section][1],
+		*c2 = columns.params[section][2], *c3 = columns.params[section][3],
+		*c4 = columns.params[section][4], *c5 = columns.params[section][5];
+	int32_t v[DNAFX_QUERY_PARAMS];
+	int j = 0;
+	for(j=0; j<DNAFX_QUERY_PARAMS; j++)
+		v[j] = MAX(dnafx_preset_image_param(image, section, j), 0);
+	/* A different effect is far, no matter what the parameters are */
+	const uint8_t *effects = columns.effects[section];
+	uint8_t effect = dnafx_preset_image_effect(image, section);
+	uint32_t far = (section == DNAFX_EFFECT_AMP || section == DNAFX_EFFECT_CAB) ?
+		DNAFX_QUERY_MODEL_DISTANCE : DNAFX_QUERY_EFFECT_DISTANCE;
+	guint row = 0, rows = columns.rows;
+	uint32_t d = 0;
+	for(row=0; row<rows; row++) {
+		d = abs(c0[row] - v[0]) + abs(c1[row] - v[1]) + abs(c2[row] - v[2]) +
+			abs(c3[row] - v[3]) + abs(c4[row] - v[4]) + abs(c5[row] - v[5]);
+		distances[row] += weight * (effects[row] == effect ? d : far);
+	}
+	/* Sections that are on in one preset and off in the other */
+	uint64_t mask = dnafx_preset_image_active(image, section) == 1 ? G_MAXUINT64 : 0, bits = 0;
+	guint w = 0;
+	for(w=0; w<columns.words; w++) {
+		bits = (columns.active[section][w] ^ mask) & columns.used[w];
+		while(bits) {
+			distances[w*64 + __builtin_ctzll(bits)] += weight * DNAFX_QUERY_SWITCH_DISTANCE;
+			bits &= bits - 1;
+		}
+	}
+}
+
+static void dnafx_query_distance_expressions(uint32_t *distances, const uint8_t *image, uint32_t weight) {
+	guint row = 0, rows = columns.rows;
+	int i = 0;
+	int32_t value = 0;
+	for(i=0; i<DNAFX_PRESET_EXPS; i++) {
+		const uint16_t *column = columns.expressions[i];
+		value = MAX(dnafx_preset_image_expression(image, i), 0);
+		for(row=0; row<rows; row++)
+			distances[row] += weight * abs((int32_t)column[row] - value);
+	}
+}
+
+/* Parse weights like "AMP=3 CAB=3 REVERB=0 EXP=1" */
+static int dnafx_query_weights(const char *text, uint32_t *weights) {
+	int i = 0;
+	for(i=0; i<=DNAFX_PRESET_EFFECTS; i++)
+		weights[i] = DNAFX_QUERY_WEIGHT;
+	if(text == NULL)
+		return 0;
+	gchar **items = g_strsplit_set(text, " \t,", -1);
+	int value = 0, res = 0, section = 0;
+	char *sep = NULL;
+	for(i=0; items[i] != NULL; i++) {
+		if(*items[i] == '\0')
+			continue;
+		sep = strchr(items[i], '=');
+		if(sep == NULL || !dnafx_query_number(sep + 1, &value) || value < 0 || value > DNAFX_QUERY_WEIGHT_MAX) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Invalid weight '%s' (should be SECTION=0-%d)\n", items[i], DNAFX_QUERY_WEIGHT_MAX);
+			res = -1;
+			break;
+		}
+		*sep = '\0';
+		section = !g_ascii_strcasecmp(items[i], "EXP") ? DNAFX_PRESET_EFFECTS : dnafx_preset_section_byname(items[i]);
+		if(section < 0) {
+			DNAFX_LOG(DNAFX_LOG_ERR, "Invalid section '%s' in weights\n", items[i]);
+			res = -1;
+			break;
+		}
+		weights[section] = value;
+	}
+	g_strfreev(items);
+	return res;
+}
+
+json_t *dnafx_query_similar(dnafx_store_handle handle, int limit, const char *weights) {
+	const uint8_t *image = dnafx_store_image(handle);
+	if(image == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return NULL;
+	}
+	uint32_t w[DNAFX_PRESET_EFFECTS+1];
+	if(dnafx_query_weights(weights, w) < 0)
+		return NULL;
+	if(limit <= 0)
+		limit = DNAFX_QUERY_SIMILAR_LIMIT;
+	gint64 start = g_get_monotonic_time();
+	dnafx_query_index_update();
+	/* Compute the distance of all records from this one */
+	guint rows = columns.rows;
+	uint32_t *distances = g_malloc0(rows * sizeof(uint32_t));
+	int i = 0;
+	for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+		if(w[i] > 0)
+			dnafx_query_distance_section(distances, i, image, w[i]);
+	}
+	if(w[DNAFX_PRESET_EFFECTS] > 0)
+		dnafx_query_distance_expressions(distances, image, w[DNAFX_PRESET_EFFECTS]);
+	/* Keep the closest ones, sorted by distance */
+	guint *best = g_malloc(limit * sizeof(guint));
+	guint found = 0, row = 0, pos = 0;
+	uint64_t bits = 0;
+	for(i=0; i<(int)columns.words; i++) {
+		bits = columns.used[i];
+		while(bits) {
+			row = i*64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			if(row + 1 == handle || (found == (guint)limit && distances[row] >= distances[best[found-1]]))
+				continue;
+			pos = found < (guint)limit ? found++ : found - 1;
+			while(pos > 0 && distances[best[pos-1]] > distances[row]) {
+				best[pos] = best[pos-1];
+				pos--;
+			}
+			best[pos] = row;
+		}
+	}
+	/* Done: presets are reported with their names in the library, which
+	 * may not be the one in the image (aliases, unique names) */
+	json_t *result = json_object();
+	json_t *presets = json_array();
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	uint8_t *other = NULL;
+	guint j = 0;
+	GHashTable *names = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)json_decref);
+	for(j=0; j<found; j++)
+		g_hash_table_insert(names, GUINT_TO_POINTER(best[j] + 1), json_array());
+	GPtrArray *library = dnafx_presets_names();
+	json_t *aliases = NULL;
+	for(j=0; library != NULL && j<library->len; j++) {
+		aliases = g_hash_table_lookup(names,
+			GUINT_TO_POINTER(dnafx_preset_handle_byname(g_ptr_array_index(library, j))));
+		if(aliases != NULL)
+			json_array_append_new(aliases, json_string(g_ptr_array_index(library, j)));
+	}
+	for(j=0; j<found; j++) {
+		other = dnafx_store_image(best[j] + 1);
+		aliases = g_hash_table_lookup(names, GUINT_TO_POINTER(best[j] + 1));
+		json_t *p = json_object();
+		if(json_array_size(aliases) > 0) {
+			json_object_set(p, "name", json_array_get(aliases, 0));
+			if(json_array_size(aliases) > 1)
+				json_object_set(p, "names", aliases);
+		} else {
+			/* Only in a device slot */
+			dnafx_preset_image_name(other, name, sizeof(name));
+			json_object_set_new(p, "name", json_string(name));
+		}
+		if(dnafx_preset_slot_image(other[0]) == other)
+			json_object_set_new(p, "id", json_integer(other[0]));
+		json_object_set_new(p, "distance", json_integer(distances[best[j]]));
+		json_array_append_new(presets, p);
+	}
+	g_hash_table_destroy(names);
+	g_free(best);
+	g_free(distances);
+	dnafx_preset_image_name(image, name, sizeof(name));
+	json_object_set_new(result, "preset", json_string(name));
+	json_object_set_new(result, "presets", presets);
+	json_object_set_new(result, "elapsed-us", json_integer(g_get_monotonic_time() - start));
+	return result;
+}
@@ -0,0 +1,51 @@
+#ifndef DNAFX_QUERY
+#define DNAFX_QUERY
+
+#include <glib.h>
+#include <jansson.h>
+
+#include "store.h"
+
+/* Queries on the content of presets, e.g., to find all presets that use a
+ * specific amp with a high gain. The library is indexed by column (effect,
+ * state and parameters of each section, for all records in the store), and
+ * each condition in a query is evaluated as a bitmap over all records, so
+ * that compound queries are just bitwise operations. The index is rebuilt
+ * the first time a query is run after the store changed. Queries look like:
+ *
+ * 	AMP.TYPE="PLX 100" and AMP.GAIN>70 and not (REVERB.SWITCH=off or DELAY.MIX<10)
+ *
+ * where each condition is section.field, followed by one of =, !=, <, <=,
+ * > and >=, and a value: fields can be TYPE (the effect, by name or id),
+ * SWITCH (0/1, or off/on) or the name of a parameter, in which case only
+ * presets using an effect with that parameter are considered. Names that
+ * contain spaces can be quoted, and "and" is implied between conditions */
+#define DNAFX_QUERY_LIMIT		100
+
+/* Run a query, and return the matching named presets (up to limit) */
+json_t *dnafx_query_presets(const char *query, int limit);
+
+/* Presets that sound alike: the distance between two presets is the sum,
+ * for each section, of the differences in their parameters, or a fixed
+ * distance if the section uses a different effect (much larger for AMP
+ * and CAB, as a different model changes everything), plus a penalty if
+ * the section is on in one and off in the other; the differences in the
+ * expression pedal settings are added too. Each section (and expressions,
+ * as EXP) has a weight, 1 by default, which can be changed with a list
+ * like "AMP=3 CAB=3 REVERB=0", and multiplies its contribution */
+#define DNAFX_QUERY_SIMILAR_LIMIT		10
+#define DNAFX_QUERY_WEIGHT				1
+#define DNAFX_QUERY_WEIGHT_MAX			100
+#define DNAFX_QUERY_SWITCH_DISTANCE		50
+#define DNAFX_QUERY_EFFECT_DISTANCE		300
+#define DNAFX_QUERY_MODEL_DISTANCE		3000
+
+/* Find the presets closest to a record (up to limit), closest first: each
+ * is reported with its name in the library (and all of them, as names,
+ * if it has aliases), or the one in its image if it's only in a slot */
+json_t *dnafx_query_similar(dnafx_store_handle handle, int limit, const char *weights);
+
+/* Get rid of the index */
+void dnafx_query_deinit(void);
+
+#endif
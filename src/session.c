@@ -0,0 +1,172 @@
+#include <string.h>
+
+#include "session.h"
+#include "presets.h"
+#include "debug.h"
+
+/* The overlay: slots are only copied when edited */
+static gboolean session_open = FALSE, session_committing = FALSE;
+static uint8_t *overlay[DNAFX_PRESETS_NUM];
+/* Decoded views of the slots in the overlay, created on demand */
+static dnafx_preset *views[DNAFX_PRESETS_NUM];
+static gint64 session_started = 0;
+
+int dnafx_session_begin(void) {
+	if(session_open) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "An edit session is open already\n");
+		return -1;
+	}
+	memset(overlay, 0, sizeof(overlay));
+	memset(views, 0, sizeof(views));
+	session_open = TRUE;
+	session_started = g_get_real_time();
+	DNAFX_LOG(DNAFX_LOG_INFO, "Edit session open, changes won't be uploaded until committed\n");
+	return 0;
+}
+
+/* Helper to forget about what we had for a slot in the overlay */
+static void dnafx_session_clean(int slot) {
+	g_free(overlay[slot-1]);
+	overlay[slot-1] = NULL;
+	dnafx_preset_free(views[slot-1]);
+	views[slot-1] = NULL;
+}
+
+gboolean dnafx_session_is_open(void) {
+	return session_open;
+}
+
+void dnafx_session_discard(void) {
+	int i = 0;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++)
+		dnafx_session_clean(i + 1);
+	session_open = FALSE;
+	session_committing = FALSE;
+}
+
+const uint8_t *dnafx_session_slot_image(int slot) {
+	if(slot < 1 || slot > DNAFX_PRESETS_NUM)
+		return NULL;
+	if(session_open && overlay[slot-1] != NULL)
+		return overlay[slot-1];
+	return dnafx_preset_slot_image(slot);
+}
+
+dnafx_preset *dnafx_session_find_byid(int slot) {
+	if(slot < 1 || slot > DNAFX_PRESETS_NUM || !session_open || overlay[slot-1] == NULL)
+		return dnafx_preset_find_byid(slot);
+	if(views[slot-1] == NULL)
+		views[slot-1] = dnafx_preset_from_bytes(overlay[slot-1], DNAFX_PRESET_SIZE);
+	return views[slot-1];
+}
+
+dnafx_preset *dnafx_session_find_byname(const char *name) {
+	dnafx_preset *preset = dnafx_preset_find_byname(name);
+	if(preset == NULL || !session_open || preset->id < 1 || preset->id > DNAFX_PRESETS_NUM ||
+			dnafx_preset_image(preset) != dnafx_preset_slot_image(preset->id))
+		return preset;
+	return dnafx_session_find_byid(preset->id);
+}
+
+int dnafx_session_put(const uint8_t *image) {
+	if(!session_open || image == NULL || image[0] < 1 || image[0] > DNAFX_PRESETS_NUM) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return -1;
+	}
+	int slot = image[0];
+	const uint8_t *device = dnafx_preset_slot_image(slot);
+	if(device != NULL && !memcmp(device + 1, image + 1, DNAFX_PRESET_SIZE - 1)) {
+		/* Back to what the device has, the slot is clean again */
+		dnafx_session_clean(slot);
+		return 0;
+	}
+	if(overlay[slot-1] == NULL)
+		overlay[slot-1] = g_malloc(DNAFX_PRESET_SIZE);
+	memcpy(overlay[slot-1], image, DNAFX_PRESET_SIZE);
+	/* Decode it again next time somebody asks */
+	dnafx_preset_free(views[slot-1]);
+	views[slot-1] = NULL;
+	return 0;
+}
+
+json_t *dnafx_session_status(void) {
+	json_t *status = json_object();
+	json_object_set_new(status, "open", json_boolean(session_open));
+	if(!session_open)
+		return status;
+	json_object_set_new(status, "started", json_integer(session_started / G_USEC_PER_SEC));
+	json_t *slots = json_array();
+	const uint8_t *device = NULL;
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	int i = 0;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		if(overlay[i] == NULL)
+			continue;
+		/* The fields that changed are whatever differs from the device */
+		device = dnafx_preset_slot_image(i + 1);
+		json_t *slot = device ? dnafx_preset_image_diff(device, overlay[i]) : NULL;
+		if(slot == NULL)
+			slot = json_object();
+		if(json_object_get(slot, "name") == NULL) {
+			dnafx_preset_image_name(overlay[i], name, sizeof(name));
+			json_object_set_new(slot, "name", json_string(name));
+		}
+		json_object_set_new(slot, "slot", json_integer(i + 1));
+		json_array_append_new(slots, slot);
+	}
+	json_object_set_new(status, "dirty", slots);
+	return status;
+}
+
+GByteArray *dnafx_session_commit(void) {
+	if(!session_open) {
+		DNAFX_LOG(DNAFX_LOG_WARN, "No edit session open\n");
+		return NULL;
+	}
+	GByteArray *uploads = g_byte_array_new();
+	const uint8_t *device = NULL;
+	int i = 0;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		if(overlay[i] == NULL)
+			continue;
+		/* The device may have changed meanwhile (e.g., get-presets) */
+		device = dnafx_preset_slot_image(i + 1);
+		if(device != NULL && !memcmp(device + 1, overlay[i] + 1, DNAFX_PRESET_SIZE - 1))
+			continue;
+		g_byte_array_append(uploads, overlay[i], DNAFX_PRESET_SIZE);
+		uploads->data[uploads->len - DNAFX_PRESET_SIZE] = i + 1;
+	}
+	session_committing = TRUE;
+	return uploads;
+}
+
+gboolean dnafx_session_is_committing(void) {
+	return session_committing;
+}
+
+void dnafx_session_uploaded(int slot) {
+	if(!session_open || slot < 1 || slot > DNAFX_PRESETS_NUM || overlay[slot-1] == NULL)
+		return;
+	const uint8_t *device = dnafx_preset_slot_image(slot);
+	if(device != NULL && !memcmp(device + 1, overlay[slot-1] + 1, DNAFX_PRESET_SIZE - 1)) {
+		/* The device has what we had in the overlay now */
+		dnafx_session_clean(slot);
+	}
+}
+
+void dnafx_session_commit_done(gboolean success) {
+	if(!session_committing)
+		return;
+	session_committing = FALSE;
+	int i = 0, dirty = 0;
+	for(i=0; i<DNAFX_PRESETS_NUM; i++) {
+		if(overlay[i] != NULL)
+			dirty++;
+	}
+	if(success && dirty == 0) {
+		dnafx_session_discard();
+		DNAFX_LOG(DNAFX_LOG_INFO, "Edit session committed\n");
+		return;
+	}
+	DNAFX_LOG(DNAFX_LOG_WARN, "Edit session commit failed, still open with %d dirty slots\n", dirty);
+}
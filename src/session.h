@@ -0,0 +1,43 @@
+#ifndef DNAFX_SESSION
+#define DNAFX_SESSION
+
+#include <stdint.h>
+
+#include <glib.h>
+#include <jansson.h>
+
+#include "presets.h"
+
+/* Edit sessions: while a session is open, changes to the device presets
+ * (e.g., with patch) are applied to a copy-on-write overlay of the device
+ * slots, rather than uploaded right away. Reads go through the overlay, so
+ * edits build on each other, and slots are only copied when first edited:
+ * a slot is dirty as long as its image differs from the one on the device.
+ * Committing the session uploads all the dirty slots as a single batch */
+int dnafx_session_begin(void);
+gboolean dnafx_session_is_open(void);
+void dnafx_session_discard(void);
+
+/* The image of a slot as seen in the session (or on the device, if closed) */
+const uint8_t *dnafx_session_slot_image(int slot);
+/* Same, as a decoded preset owned by the session (or the library): names
+ * of presets in a slot also go through the overlay */
+dnafx_preset *dnafx_session_find_byid(int slot);
+dnafx_preset *dnafx_session_find_byname(const char *name);
+/* Change a slot in the session (the slot is the first byte of the image) */
+int dnafx_session_put(const uint8_t *image);
+
+/* Dirty slots, and what changed in each of them */
+json_t *dnafx_session_status(void);
+/* Start committing the session, returning the images (with the slot as
+ * first byte) of the dirty slots, which need to be uploaded: the overlay
+ * is kept until they are, and slots only become clean once uploaded */
+GByteArray *dnafx_session_commit(void);
+gboolean dnafx_session_is_committing(void);
+/* A slot was uploaded to the device, it may not be dirty anymore */
+void dnafx_session_uploaded(int slot);
+/* The commit is over: if it went fine the session is closed, otherwise
+ * it stays open with the slots that didn't make it to the device */
+void dnafx_session_commit_done(gboolean success);
+
+#endif
@@ -0,0 +1,236 @@
+#include <string.h>
+
+#include "store.h"
+#include "presets.h"
+#include "debug.h"
+
+/* A record: the image plus what we need to manage it (216 bytes); the
+ * refcount is 32 bits, as huge libraries can easily have more than 64k
+ * names for the same content */
+typedef struct dnafx_store_record {
+	uint8_t image[DNAFX_PRESET_SIZE];
+	uint32_t refs;
+	uint32_t flags;
+	/* Next record with the same hash, if any */
+	dnafx_store_handle chain;
+	/* Generation of the store when the record was last changed */
+	guint64 stamp;
+	/* Hash of the content, also used as key in the content index */
+	guint64 hash;
+} dnafx_store_record;
+#define DNAFX_STORE_RECORD_USED	(1 << 0)
+
+/* Chunks of records, and an intrusive list of free records: a record
+ * that is not in use stores the handle of the next free one in its image */
+static GPtrArray *chunks = NULL;
+static dnafx_store_handle free_head = DNAFX_STORE_INVALID;
+static guint records = 0, used = 0;
+/* Bumped any time the content of the store changes */
+static guint64 generation = 0;
+/* Content index: hash of the content to a record that has it, which is
+ * the head of the chain of all the records with that same hash */
+static GHashTable *contents = NULL;
+
+/* Handles start from 1, so that 0 can be used as an invalid handle */
+static dnafx_store_record *dnafx_store_record_get(dnafx_store_handle handle) {
+	if(chunks == NULL || handle == DNAFX_STORE_INVALID || handle > records)
+		return NULL;
+	guint index = handle - 1;
+	dnafx_store_record *chunk = g_ptr_array_index(chunks, index / DNAFX_STORE_CHUNK);
+	return &chunk[index % DNAFX_STORE_CHUNK];
+}
+
+/* Content hashing: the content of a record is everything that follows the
+ * slot and the name, so that the same preset saved under different names
+ * or in different slots is still recognized; we hash 8 bytes at a time */
+#define DNAFX_STORE_CONTENT		(1 + DNAFX_PRESET_NAME_SIZE)
+static guint64 dnafx_store_hash(const uint8_t *image) {
+	const uint8_t *data = image + DNAFX_STORE_CONTENT;
+	size_t len = DNAFX_PRESET_SIZE - DNAFX_STORE_CONTENT;
+	guint64 hash = 0x9E3779B97F4A7C15ULL ^ len, word = 0;
+	while(len > 0) {
+		word = 0;
+		memcpy(&word, data, MIN(len, sizeof(word)));
+		hash ^= word * 0xBF58476D1CE4E5B9ULL;
+		hash = ((hash << 31) | (hash >> 33)) * 0x94D049BB133111EBULL;
+		data += MIN(len, sizeof(word));
+		len -= MIN(len, sizeof(word));
+	}
+	hash ^= hash >> 32;
+	hash *= 0xD6E8FEB86659FD93ULL;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+static void dnafx_store_index(dnafx_store_handle handle, dnafx_store_record *record) {
+	record->hash = dnafx_store_hash(record->image);
+	/* The record becomes the head of the chain: since keys point to the
+	 * hash in the head record, we always replace the key as well */
+	record->chain = GPOINTER_TO_UINT(g_hash_table_lookup(contents, &record->hash));
+	g_hash_table_replace(contents, &record->hash, GUINT_TO_POINTER(handle));
+}
+
+static void dnafx_store_unindex(dnafx_store_handle handle, dnafx_store_record *record) {
+	dnafx_store_handle head = GPOINTER_TO_UINT(g_hash_table_lookup(contents, &record->hash));
+	if(head == handle) {
+		/* Any other record with the same hash becomes the head */
+		dnafx_store_record *next = dnafx_store_record_get(record->chain);
+		if(next != NULL)
+			g_hash_table_replace(contents, &next->hash, GUINT_TO_POINTER(record->chain));
+		else
+			g_hash_table_remove(contents, &record->hash);
+	} else {
+		/* Unlink the record from the chain */
+		dnafx_store_record *prev = dnafx_store_record_get(head);
+		while(prev != NULL && prev->chain != handle)
+			prev = dnafx_store_record_get(prev->chain);
+		if(prev != NULL)
+			prev->chain = record->chain;
+	}
+	record->chain = DNAFX_STORE_INVALID;
+}
+
+/* Store management */
+void dnafx_store_init(void) {
+	if(chunks != NULL)
+		return;
+	chunks = g_ptr_array_new_with_free_func((GDestroyNotify)g_free);
+	/* Keys point to the hash in the records, which never move */
+	contents = g_hash_table_new(g_int64_hash, g_int64_equal);
+	free_head = DNAFX_STORE_INVALID;
+	records = 0;
+	used = 0;
+	generation = 0;
+}
+
+void dnafx_store_deinit(void) {
+	if(chunks == NULL)
+		return;
+	if(used > 0)
+		DNAFX_LOG(DNAFX_LOG_VERB, "Destroying store with %u records still in use\n", used);
+	g_hash_table_unref(contents);
+	contents = NULL;
+	g_ptr_array_unref(chunks);
+	chunks = NULL;
+	free_head = DNAFX_STORE_INVALID;
+	records = 0;
+	used = 0;
+}
+
+/* Records management */
+dnafx_store_handle dnafx_store_add(const uint8_t *image) {
+	if(chunks == NULL || image == NULL) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Invalid arguments\n");
+		return DNAFX_STORE_INVALID;
+	}
+	dnafx_store_handle handle = free_head;
+	dnafx_store_record *record = NULL;
+	if(handle != DNAFX_STORE_INVALID) {
+		/* Recycle a free record */
+		record = dnafx_store_record_get(handle);
+		memcpy(&free_head, record->image, sizeof(free_head));
+	} else {
+		/* Allocate a new chunk, if we filled the last one */
+		if((records % DNAFX_STORE_CHUNK) == 0)
+			g_ptr_array_add(chunks, g_malloc0(DNAFX_STORE_CHUNK * sizeof(dnafx_store_record)));
+		records++;
+		handle = records;
+		record = dnafx_store_record_get(handle);
+	}
+	memcpy(record->image, image, DNAFX_PRESET_SIZE);
+	record->refs = 1;
+	record->flags = DNAFX_STORE_RECORD_USED;
+	dnafx_store_index(handle, record);
+	used++;
+	generation++;
+	record->stamp = generation;
+	return handle;
+}
+
+void dnafx_store_ref(dnafx_store_handle handle) {
+	dnafx_store_record *record = dnafx_store_record_get(handle);
+	if(record == NULL || !(record->flags & DNAFX_STORE_RECORD_USED))
+		return;
+	if(record->refs == G_MAXUINT32) {
+		DNAFX_LOG(DNAFX_LOG_ERR, "Too many references to record %"SCNu32"\n", handle);
+		return;
+	}
+	record->refs++;
+}
+
+int dnafx_store_unref(dnafx_store_handle handle) {
+	dnafx_store_record *record = dnafx_store_record_get(handle);
+	if(record == NULL || !(record->flags & DNAFX_STORE_RECORD_USED))
+		return -1;
+	record->refs--;
+	if(record->refs > 0)
+		return record->refs;
+	/* Nobody needs this record anymore, put it in the free list */
+	dnafx_store_unindex(handle, record);
+	record->flags = 0;
+	memset(record->image, 0, DNAFX_PRESET_SIZE);
+	memcpy(record->image, &free_head, sizeof(free_head));
+	free_head = handle;
+	used--;
+	generation++;
+	return 0;
+}
+
+uint8_t *dnafx_store_image(dnafx_store_handle handle) {
+	dnafx_store_record *record = dnafx_store_record_get(handle);
+	if(record == NULL || !(record->flags & DNAFX_STORE_RECORD_USED))
+		return NULL;
+	return record->image;
+}
+
+void dnafx_store_touch(dnafx_store_handle handle) {
+	dnafx_store_record *record = dnafx_store_record_get(handle);
+	if(record == NULL || !(record->flags & DNAFX_STORE_RECORD_USED))
+		return;
+	/* The content may have changed, so hash it again */
+	dnafx_store_unindex(handle, record);
+	dnafx_store_index(handle, record);
+	generation++;
+	record->stamp = generation;
+}
+
+dnafx_store_handle dnafx_store_find(const uint8_t *image) {
+	if(contents == NULL || image == NULL)
+		return DNAFX_STORE_INVALID;
+	guint64 hash = dnafx_store_hash(image);
+	dnafx_store_handle handle = GPOINTER_TO_UINT(g_hash_table_lookup(contents, &hash));
+	dnafx_store_record *record = dnafx_store_record_get(handle);
+	while(record != NULL) {
+		/* Make sure it's not just a hash collision */
+		if(!memcmp(record->image + DNAFX_STORE_CONTENT, image + DNAFX_STORE_CONTENT,
+				DNAFX_PRESET_SIZE - DNAFX_STORE_CONTENT))
+			return handle;
+		handle = record->chain;
+		record = dnafx_store_record_get(handle);
+	}
+	return DNAFX_STORE_INVALID;
+}
+
+guint64 dnafx_store_stamp(dnafx_store_handle handle) {
+	dnafx_store_record *record = dnafx_store_record_get(handle);
+	if(record == NULL || !(record->flags & DNAFX_STORE_RECORD_USED))
+		return 0;
+	return record->stamp;
+}
+
+/* Store state */
+guint dnafx_store_count(void) {
+	return used;
+}
+
+guint dnafx_store_capacity(void) {
+	return records;
+}
+
+size_t dnafx_store_memory(void) {
+	return chunks ? chunks->len * DNAFX_STORE_CHUNK * sizeof(dnafx_store_record) : 0;
+}
+
+guint64 dnafx_store_generation(void) {
+	return generation;
+}
@@ -0,0 +1,44 @@
+#ifndef DNAFX_STORE
+#define DNAFX_STORE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+/* Presets are stored as their 184 bytes wire image in records that live
+ * in fixed size chunks, which are never moved or freed until the store
+ * is destroyed: this means records can be referenced via stable handles,
+ * and that bulk operations on them stay cache friendly. Records are
+ * refcounted, so that device slots and named entries can all reference
+ * the same record, which is only recycled when nobody needs it anymore.
+ * Records are also indexed by a hash of their content (the image without
+ * slot and name), so that finding an identical preset is O(1) */
+typedef uint32_t dnafx_store_handle;
+#define DNAFX_STORE_INVALID		0
+#define DNAFX_STORE_CHUNK		256
+
+/* Store management */
+void dnafx_store_init(void);
+void dnafx_store_deinit(void);
+
+/* Records management */
+dnafx_store_handle dnafx_store_add(const uint8_t *image);
+void dnafx_store_ref(dnafx_store_handle handle);
+int dnafx_store_unref(dnafx_store_handle handle);
+uint8_t *dnafx_store_image(dnafx_store_handle handle);
+/* Must be called after changing the image of a record in place */
+void dnafx_store_touch(dnafx_store_handle handle);
+/* When a record was last changed, compared to other records */
+guint64 dnafx_store_stamp(dnafx_store_handle handle);
+/* Find a record with the same content as this image, ignoring slot and name */
+dnafx_store_handle dnafx_store_find(const uint8_t *image);
+
+/* Store state */
+guint dnafx_store_count(void);
+/* Highest handle ever returned, to iterate over all records */
+guint dnafx_store_capacity(void);
+size_t dnafx_store_memory(void);
+guint64 dnafx_store_generation(void);
+
+#endif
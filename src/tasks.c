@@ -51,6 +51,50 @@ const char *dnafx_task_type_str(dnafx_task_type type) {
 			return "interrupt";
 		case DNAFX_TASK_LIST_PRESETS:
 			return "list presets";
+		case DNAFX_TASK_API_STATS:
+			return "api stats";
+		case DNAFX_TASK_SAVE_BANK:
+			return "save bank";
+		case DNAFX_TASK_LOAD_BANK:
+			return "load bank";
+		case DNAFX_TASK_UPLOAD_BANK:
+			return "upload bank";
+		case DNAFX_TASK_SAVE_ARCHIVE:
+			return "save archive";
+		case DNAFX_TASK_LOAD_ARCHIVE:
+			return "load archive";
+		case DNAFX_TASK_IMPORT_DIR:
+			return "import dir";
+		case DNAFX_TASK_SEARCH_PRESETS:
+			return "search presets";
+		case DNAFX_TASK_QUERY_PRESETS:
+			return "query presets";
+		case DNAFX_TASK_SIMILAR_PRESETS:
+			return "similar presets";
+		case DNAFX_TASK_DIFF:
+			return "diff";
+		case DNAFX_TASK_SYNC:
+			return "sync";
+		case DNAFX_TASK_MOVE:
+			return "move";
+		case DNAFX_TASK_SWAP:
+			return "swap";
+		case DNAFX_TASK_REORDER:
+			return "reorder";
+		case DNAFX_TASK_PATCH:
+			return "patch";
+		case DNAFX_TASK_SESSION:
+			return "session";
+		case DNAFX_TASK_UNDO:
+			return "undo";
+		case DNAFX_TASK_REDO:
+			return "redo";
+		case DNAFX_TASK_RESTORE:
+			return "restore";
+		case DNAFX_TASK_HISTORY:
+			return "history";
+		case DNAFX_TASK_CACHE_STATUS:
+			return "cache status";
 		case DNAFX_TASK_QUIT:
 			return "quit";
 		case DNAFX_TASK_NONE:
@@ -60,6 +104,32 @@ const char *dnafx_task_type_str(dnafx_task_type type) {
 	return NULL;
 };
 
+/* Tasks that only need local state, and tasks that only refresh it */
+gboolean dnafx_task_is_local(dnafx_task_type type) {
+	switch(type) {
+		case DNAFX_TASK_CLI:
+		case DNAFX_TASK_HELP:
+		case DNAFX_TASK_LIST_PRESETS:
+		case DNAFX_TASK_PARSE_PRESET:
+		case DNAFX_TASK_EXPORT_PRESET:
+		case DNAFX_TASK_SEARCH_PRESETS:
+		case DNAFX_TASK_QUERY_PRESETS:
+		case DNAFX_TASK_SIMILAR_PRESETS:
+		case DNAFX_TASK_HISTORY:
+		case DNAFX_TASK_CACHE_STATUS:
+		case DNAFX_TASK_API_STATS:
+			return TRUE;
+		default:
+			break;
+	}
+	return FALSE;
+}
+
+gboolean dnafx_task_is_refresh(dnafx_task_type type) {
+	return (type == DNAFX_TASK_INIT_1 || type == DNAFX_TASK_GET_PRESETS_1 ||
+		type == DNAFX_TASK_GET_EXTRAS_1);
+}
+
 /* Create a new task out of a command */
 dnafx_task *dnafx_task_new(int argc, char **argv) {
 	if(argc == 0 || argv == NULL)
@@ -128,6 +198,186 @@ dnafx_task *dnafx_task_new(int argc, char **argv) {
 		task->type = DNAFX_TASK_INTERRUPT;
 	} else if(!strcasecmp(argv[0], "list-presets")) {
 		task->type = DNAFX_TASK_LIST_PRESETS;
+		if(argc > 1) {
+			/* Paged listing */
+			if(dnafx_presets_sort_from_str(argv[1]) < 0 ||
+					(argc > 3 && strcasecmp(argv[3], "names") && strcasecmp(argv[3], "full"))) {
+				DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'list-presets' format\n");
+				dnafx_task_free(task);
+				return NULL;
+			}
+			task->text[0] = g_strdup(argv[1]);
+			if(argc > 2)
+				task->number[0] = atoi(argv[2]);
+			if(argc > 3)
+				task->text[1] = g_strdup(argv[3]);
+			if(argc > 4)
+				task->text[2] = g_strdup(argv[4]);
+		}
+	} else if(!strcasecmp(argv[0], "search-presets")) {
+		if(argc < 3 || (strcasecmp(argv[1], "prefix") && strcasecmp(argv[1], "fuzzy"))) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'search-presets' format\n");
+			dnafx_task_free(task);
+			return NULL;
+		}
+		task->type = DNAFX_TASK_SEARCH_PRESETS;
+		task->text[0] = g_strdup(argv[1]);
+		task->text[1] = g_strdup(argv[2]);
+		if(argc > 3)
+			task->number[0] = atoi(argv[3]);
+	} else if(!strcasecmp(argv[0], "query-presets")) {
+		/* All arguments are part of the query, except an optional limit */
+		int first = 1;
+		if(argc > 2 && g_ascii_isdigit(*argv[1])) {
+			task->number[0] = atoi(argv[1]);
+			first = 2;
+		}
+		if(argc <= first) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'query-presets' format\n");
+			dnafx_task_free(task);
+			return NULL;
+		}
+		task->type = DNAFX_TASK_QUERY_PRESETS;
+		GString *query = g_string_new(argv[first]);
+		int i = 0;
+		for(i=first+1; i<argc; i++)
+			g_string_append_printf(query, " %s", argv[i]);
+		task->text[0] = g_string_free(query, FALSE);
+	} else if(!strcasecmp(argv[0], "similar-presets")) {
+		if(argc < 2) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'similar-presets' format\n");
+			dnafx_task_free(task);
+			return NULL;
+		}
+		task->type = DNAFX_TASK_SIMILAR_PRESETS;
+		task->number[0] = atoi(argv[1]);
+		if(strlen(argv[1]) > 3 || task->number[0] == 0) {
+			task->number[0] = 0;
+			task->text[0] = g_strdup(argv[1]);
+		}
+		/* Then an optional limit, and optional weights */
+		int first = 2;
+		if(argc > 2 && g_ascii_isdigit(*argv[2])) {
+			task->number[1] = atoi(argv[2]);
+			first = 3;
+		}
+		if(argc > first) {
+			GString *weights = g_string_new(argv[first]);
+			int i = 0;
+			for(i=first+1; i<argc; i++)
+				g_string_append_printf(weights, " %s", argv[i]);
+			task->text[1] = g_string_free(weights, FALSE);
+		}
+	} else if(!strcasecmp(argv[0], "diff")) {
+		if(argc < 3) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'diff' format\n");
+			dnafx_task_free(task);
+			return NULL;
+		}
+		task->type = DNAFX_TASK_DIFF;
+		task->text[0] = g_strdup(argv[1]);
+		task->text[1] = g_strdup(argv[2]);
+	} else if(!strcasecmp(argv[0], "sync")) {
+		if(argc < 2 || (argc > 2 && strcasecmp(argv[2], "dry-run"))) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'sync' format\n");
+			dnafx_task_free(task);
+			return NULL;
+		}
+		task->type = DNAFX_TASK_SYNC;
+		task->text[0] = g_strdup(argv[1]);
+		task->number[0] = (argc > 2);
+	} else if(!strcasecmp(argv[0], "move")) {
+		if(argc < 3) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'move' format\n");
+			dnafx_task_free(task);
+			return NULL;
+		}
+		task->type = DNAFX_TASK_MOVE;
+		task->number[0] = atoi(argv[1]);
+		task->number[1] = atoi(argv[2]);
+		task->number[2] = argc > 3 ? atoi(argv[3]) : 1;
+	} else if(!strcasecmp(argv[0], "swap")) {
+		if(argc < 3) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'swap' format\n");
+			dnafx_task_free(task);
+			return NULL;
+		}
+		task->type = DNAFX_TASK_SWAP;
+		task->number[0] = atoi(argv[1]);
+		task->number[1] = atoi(argv[2]);
+	} else if(!strcasecmp(argv[0], "reorder")) {
+		if(argc < 3) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'reorder' format\n");
+			dnafx_task_free(task);
+			return NULL;
+		}
+		task->type = DNAFX_TASK_REORDER;
+		GString *slots = g_string_new(argv[1]);
+		int i = 0;
+		for(i=2; i<argc; i++)
+			g_string_append_printf(slots, " %s", argv[i]);
+		task->text[0] = g_string_free(slots, FALSE);
+	} else if(!strcasecmp(argv[0], "patch")) {
+		if(argc < 3 || (argc > 3 && strcasecmp(argv[3], "dry-run"))) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'patch' format\n");
+			dnafx_task_free(task);
+			return NULL;
+		}
+		task->type = DNAFX_TASK_PATCH;
+		task->text[0] = g_strdup(argv[1]);
+		task->text[1] = g_strdup(argv[2]);
+		task->number[0] = (argc > 3);
+	} else if(!strcasecmp(argv[0], "session")) {
+		if(argc < 2 || (strcasecmp(argv[1], "begin") && strcasecmp(argv[1], "status") &&
+				strcasecmp(argv[1], "commit") && strcasecmp(argv[1], "discard"))) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'session' format\n");
+			dnafx_task_free(task);
+			return NULL;
+		}
+		task->type = DNAFX_TASK_SESSION;
+		task->text[0] = g_ascii_strdown(argv[1], -1);
+	} else if(!strcasecmp(argv[0], "undo")) {
+		task->type = DNAFX_TASK_UNDO;
+	} else if(!strcasecmp(argv[0], "redo")) {
+		task->type = DNAFX_TASK_REDO;
+	} else if(!strcasecmp(argv[0], "restore")) {
+		if(argc < 3) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'restore' format\n");
+			dnafx_task_free(task);
+			return NULL;
+		}
+		task->type = DNAFX_TASK_RESTORE;
+		task->number[0] = atoi(argv[1]);
+		task->text[0] = g_strdup(argv[2]);
+	} else if(!strcasecmp(argv[0], "history")) {
+		task->type = DNAFX_TASK_HISTORY;
+		if(argc > 1)
+			task->number[0] = atoi(argv[1]);
+		if(argc > 2)
+			task->number[1] = atoi(argv[2]);
+	} else if(!strcasecmp(argv[0], "cache-status")) {
+		task->type = DNAFX_TASK_CACHE_STATUS;
+	} else if(!strcasecmp(argv[0], "api-stats")) {
+		task->type = DNAFX_TASK_API_STATS;
+	} else if(!strcasecmp(argv[0], "save-bank") || !strcasecmp(argv[0], "load-bank") ||
+			!strcasecmp(argv[0], "upload-bank") || !strcasecmp(argv[0], "save-archive") ||
+			!strcasecmp(argv[0], "load-archive")) {
+		if(argc < 2) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid '%s' format\n", argv[0]);
+			dnafx_task_free(task);
+			return NULL;
+		}
+		if(!strcasecmp(argv[0], "save-bank"))
+			task->type = DNAFX_TASK_SAVE_BANK;
+		else if(!strcasecmp(argv[0], "load-bank"))
+			task->type = DNAFX_TASK_LOAD_BANK;
+		else if(!strcasecmp(argv[0], "save-archive"))
+			task->type = DNAFX_TASK_SAVE_ARCHIVE;
+		else if(!strcasecmp(argv[0], "load-archive"))
+			task->type = DNAFX_TASK_LOAD_ARCHIVE;
+		else
+			task->type = DNAFX_TASK_UPLOAD_BANK;
+		task->text[0] = g_strdup(argv[1]);
 	} else if(!strcasecmp(argv[0], "import-preset")) {
 		if(argc < 3) {
 			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'import-preset' format\n");
@@ -142,6 +392,14 @@ dnafx_task *dnafx_task_new(int argc, char **argv) {
 		task->type = DNAFX_TASK_IMPORT_PRESET;
 		task->text[0] = g_strdup(argv[1]);
 		task->text[1] = g_strdup(argv[2]);
+	} else if(!strcasecmp(argv[0], "import-dir")) {
+		if(argc < 2) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'import-dir' format\n");
+			dnafx_task_free(task);
+			return NULL;
+		}
+		task->type = DNAFX_TASK_IMPORT_DIR;
+		task->text[0] = g_strdup(argv[1]);
 	} else if(!strcasecmp(argv[0], "parse-preset")) {
 		if(argc < 2) {
 			DNAFX_LOG(DNAFX_LOG_WARN, "Invalid 'parse-preset' format\n");
@@ -160,7 +418,7 @@ dnafx_task *dnafx_task_new(int argc, char **argv) {
 			dnafx_task_free(task);
 			return NULL;
 		}
-		if(strcasecmp(argv[2], "binary") && strcasecmp(argv[2], "phb")) {
+		if(strcasecmp(argv[2], "binary") && strcasecmp(argv[2], "phb") && strcasecmp(argv[2], "phb-compact")) {
 			DNAFX_LOG(DNAFX_LOG_WARN, "Unsupported 'export-preset' format '%s'\n", argv[2]);
 			dnafx_task_free(task);
 			return NULL;
@@ -198,6 +456,10 @@ void dnafx_task_free(dnafx_task *task) {
 		g_free(task->text[1]);
 		g_free(task->text[2]);
 		g_free(task->text[3]);
+		if(task->images != NULL)
+			g_byte_array_unref(task->images);
+		if(task->report != NULL)
+			json_decref(task->report);
 		g_free(task);
 	}
 }
@@ -218,9 +480,31 @@ static dnafx_task_help help_items[] = {
 	{ .command = "rename-preset", .min_args = 2, .options = "<slot> \"<name>\"", .summary = "Rename an existing preset on the device" },
 	{ .command = "upload-preset", .min_args = 2, .options = "\"<name>\" <slot>", .summary = "Upload a named preset to the specified slot on the device" },
 	{ .command = "import-preset", .min_args = 2, .options = "<binary|phb> \"filename\"", .summary = "Import the specified binary or PHB preset" },
+	{ .command = "import-dir", .min_args = 1, .options = "\"path\"", .summary = "Import all the binary and PHB presets in a folder and its subfolders" },
 	{ .command = "parse-preset", .min_args = 1, .options = "<number>|\"name\"", .summary = "Prints the content of the specified preset" },
-	{ .command = "export-preset", .min_args = 2, .options = "<number>|\"name\" <binary|phb> [\"filename\"]", .summary = "Export the specified preset as a binary of PHB file" },
-	{ .command = "list-presets", .min_args = 0, .options = NULL, .summary = "Prints the list of known presets" },
+	{ .command = "export-preset", .min_args = 2, .options = "<number>|\"name\" <binary|phb|phb-compact> [\"filename\"]", .summary = "Export the specified preset as a binary of PHB file" },
+	{ .command = "list-presets", .min_args = 0, .options = "[<name|slot|modified> [limit] [names|full] [\"cursor\"]]", .summary = "Prints the list of known presets, or a page of it if sorted" },
+	{ .command = "query-presets", .min_args = 1, .options = "[limit] <section.field<op>value> [and|or|not ...]", .summary = "Find presets by effect, state and parameters (e.g., AMP.GAIN>70 and REVERB.SWITCH=off)" },
+	{ .command = "similar-presets", .min_args = 1, .options = "<number>|\"name\" [limit] [SECTION=weight ...]", .summary = "Find the presets that sound most like the specified one" },
+	{ .command = "search-presets", .min_args = 2, .options = "<prefix|fuzzy> \"text\" [limit]", .summary = "Search known presets by name, ignoring case" },
+	{ .command = "diff", .min_args = 2, .options = "<device|session|\"bank file\"|\"folder\"> <device|session|\"bank file\"|\"folder\">", .summary = "Show what changed, slot by slot, between two sets of presets" },
+	{ .command = "sync", .min_args = 1, .options = "<\"bank file\"|\"folder\"> [dry-run]", .summary = "Upload only the slots that differ from what's on the device" },
+	{ .command = "move", .min_args = 2, .options = "<from> <to> [count]", .summary = "Move one or more consecutive presets to another position on the device, shifting the others" },
+	{ .command = "swap", .min_args = 2, .options = "<slot> <slot>", .summary = "Swap two presets on the device" },
+	{ .command = "reorder", .min_args = 2, .options = "<slot> <slot> [slot ...]", .summary = "Put the listed presets in that order, in the same slots" },
+	{ .command = "patch", .min_args = 2, .options = "<all|first-last|name=pattern|SECTION.TYPE=effect> <SECTION.PARAM|EXP.NAME<=|+=|-=>value> [dry-run]", .summary = "Change a parameter in many presets on the device at once" },
+	{ .command = "session", .min_args = 1, .options = "<begin|status|commit|discard>", .summary = "Keep changes to presets local until committed, and then upload them all at once" },
+	{ .command = "undo", .min_args = 0, .options = NULL, .summary = "Undo the last upload to the device, using the journal" },
+	{ .command = "redo", .min_args = 0, .options = NULL, .summary = "Redo the last upload that was undone" },
+	{ .command = "restore", .min_args = 2, .options = "<slot> <timestamp|date|-<n><s|m|h|d>>", .summary = "Restore a slot on the device as it was at a specific time, using the journal" },
+	{ .command = "history", .min_args = 0, .options = "[slot] [limit]", .summary = "Show the most recent uploads in the journal" },
+	{ .command = "cache-status", .min_args = 0, .options = NULL, .summary = "Show whether the cached device state is being served, and what the device changed in it" },
+	{ .command = "save-bank", .min_args = 1, .options = "\"filename\"", .summary = "Save all the presets on the device to a bank file" },
+	{ .command = "load-bank", .min_args = 1, .options = "\"filename\"", .summary = "Import all the presets in a bank file" },
+	{ .command = "upload-bank", .min_args = 1, .options = "\"filename\"", .summary = "Upload all the presets in a bank file to their slots on the device" },
+	{ .command = "save-archive", .min_args = 1, .options = "\"filename\"", .summary = "Save all the named presets to a compact archive file" },
+	{ .command = "load-archive", .min_args = 1, .options = "\"filename\"", .summary = "Import all the presets in an archive file" },
+	{ .command = "api-stats", .min_args = 0, .options = NULL, .summary = "Show statistics on the HTTP/WebSocket API responses" },
 	{ .command = "quit", .min_args = 0, .options = NULL, .summary = "Close the editor" },
 };
 
@@ -230,8 +514,8 @@ void dnafx_task_show_help(void) {
 	size_t num = s_size / sizeof(dnafx_task_help), i = 0;
 	for(i=0; i<num; i++) {
 		DNAFX_LOG(DNAFX_LOG_INFO, "\t" DNAFX_COLOR_BOLD "%s%s%s" DNAFX_COLOR_OFF "\n\t\t%s\n\n",
-			help_items[i].command, (help_items[i].min_args ? " " : ""),
-			(help_items[i].min_args ? help_items[i].options : ""), help_items[i].summary);
+			help_items[i].command, (help_items[i].options ? " " : ""),
+			(help_items[i].options ? help_items[i].options : ""), help_items[i].summary);
 	}
 }
 
@@ -244,7 +528,7 @@ json_t *dnafx_task_show_help_json(void) {
 		json_t *item = json_object();
 		json_object_set_new(item, "command", json_string(help_items[i].command));
 		json_object_set_new(item, "min-args", json_integer(help_items[i].min_args));
-		if(help_items[i].min_args > 0)
+		if(help_items[i].options != NULL)
 			json_object_set_new(item, "options", json_string(help_items[i].options));
 		json_object_set_new(item, "summary", json_string(help_items[i].summary));
 		json_array_append_new(help, item);
@@ -271,6 +555,28 @@ dnafx_task *dnafx_tasks_next(void) {
 	return task;
 }
 
+dnafx_task *dnafx_tasks_next_local(void) {
+	if(tasks == NULL)
+		return NULL;
+	dnafx_task *task = NULL, *local = NULL;
+	GQueue skipped = G_QUEUE_INIT;
+	g_async_queue_lock(tasks);
+	while((task = g_async_queue_try_pop_unlocked(tasks)) != NULL) {
+		if(dnafx_task_is_local(task->type)) {
+			local = task;
+			break;
+		}
+		g_queue_push_tail(&skipped, task);
+		if(!dnafx_task_is_refresh(task->type))
+			break;
+	}
+	/* Put back what we skipped, in the same order */
+	while((task = g_queue_pop_tail(&skipped)) != NULL)
+		g_async_queue_push_front_unlocked(tasks, task);
+	g_async_queue_unlock(tasks);
+	return local;
+}
+
 void dnafx_tasks_deinit(void) {
 	if(tasks != NULL)
 		g_async_queue_unref(tasks);
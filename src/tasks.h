@@ -34,9 +34,34 @@ typedef enum dnafx_task_type {
 	DNAFX_TASK_IMPORT_PRESET,
 	DNAFX_TASK_PARSE_PRESET,
 	DNAFX_TASK_EXPORT_PRESET,
+	DNAFX_TASK_API_STATS,
+	DNAFX_TASK_SAVE_BANK,
+	DNAFX_TASK_LOAD_BANK,
+	DNAFX_TASK_UPLOAD_BANK,
+	DNAFX_TASK_SAVE_ARCHIVE,
+	DNAFX_TASK_LOAD_ARCHIVE,
+	DNAFX_TASK_IMPORT_DIR,
+	DNAFX_TASK_SEARCH_PRESETS,
+	DNAFX_TASK_QUERY_PRESETS,
+	DNAFX_TASK_SIMILAR_PRESETS,
+	DNAFX_TASK_DIFF,
+	DNAFX_TASK_SYNC,
+	DNAFX_TASK_MOVE,
+	DNAFX_TASK_SWAP,
+	DNAFX_TASK_REORDER,
+	DNAFX_TASK_PATCH,
+	DNAFX_TASK_SESSION,
+	DNAFX_TASK_UNDO,
+	DNAFX_TASK_REDO,
+	DNAFX_TASK_RESTORE,
+	DNAFX_TASK_HISTORY,
+	DNAFX_TASK_CACHE_STATUS,
 	DNAFX_TASK_QUIT,
 } dnafx_task_type;
 const char *dnafx_task_type_str(dnafx_task_type type);
+/* Tasks that only need local state, and tasks that only refresh it */
+gboolean dnafx_task_is_local(dnafx_task_type type);
+gboolean dnafx_task_is_refresh(dnafx_task_type type);
 
 /* Task */
 typedef struct dnafx_task {
@@ -46,6 +71,10 @@ typedef struct dnafx_task {
 	int number[4];
 	/* Strings, if needed */
 	char *text[4];
+	/* Preset wire images, for tasks working on more than one at a time */
+	GByteArray *images;
+	/* What to report back when a batch of uploads is over */
+	json_t *report;
 	/* Opaque context, for tasks triggered by an API */
 	void *context;
 	/* Callback function, for tasks triggered by an API */
@@ -66,6 +95,9 @@ void dnafx_tasks_init(void);
 void dnafx_tasks_add(dnafx_task *task);
 gboolean dnafx_tasks_is_empty(void);
 dnafx_task *dnafx_tasks_next(void);
+/* Get the first task that only needs local state, as long as the tasks
+ * queued before it (if any) only refresh that state from the device */
+dnafx_task *dnafx_tasks_next_local(void);
 void dnafx_tasks_deinit(void);
 
 #endif
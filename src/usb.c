@@ -2,6 +2,14 @@
 #include "usb.h"
 #include "tasks.h"
 #include "presets.h"
+#include "bank.h"
+#include "archive.h"
+#include "query.h"
+#include "diff.h"
+#include "session.h"
+#include "journal.h"
+#include "cache.h"
+#include "httpws.h"
 #include "utils.h"
 #include "debug.h"
 
@@ -17,17 +25,28 @@
 static libusb_context *ctx = NULL;
 static libusb_device_handle *usb = NULL;
 static volatile int in_flight = 0;
+static gboolean refreshing = FALSE;
+static dnafx_task *local_task = NULL;
 static void dnafx_usb_cb(struct libusb_transfer *transfer);
 
 /* Task status */
 static void dnafx_usb_task_notify(dnafx_task *task, int code, json_t *result);
 static void dnafx_usb_task_notify_error(dnafx_task *task, int code, char *text);
 static void dnafx_usb_task_done(dnafx_task *task);
+/* Tasks that only need local state can be served while the device is
+ * being refreshed after a warm start, without waiting for it */
+static void dnafx_usb_local_task(dnafx_task *task);
+/* Batches of uploads: the report is sent back when the batch is over */
+static void dnafx_usb_upload_batch(dnafx_task *task, GByteArray *images, json_t *report);
+static void dnafx_usb_upload_batch_done(dnafx_task *task, int code, const char *reason);
+/* Printing a list of presets, when there's nobody to return it to */
+static void dnafx_usb_print_presets(json_t *presets, const char *score);
 
 /* Static buffer */
 static uint8_t buf[DNAFX_BUFFER_SIZE];
 static size_t buf_size = 0;
 static dnafx_preset *cur_preset = NULL;
+static int cur_slot = 0;
 static uint8_t cur_preset_bytes[DNAFX_PRESET_SIZE];
 
 /* Helpers */
@@ -123,6 +142,7 @@ int dnafx_usb_init(int debug_level) {
 	/* Print the device details */
 	DNAFX_LOG(DNAFX_LOG_INFO, "\nConnected to the device\n");
 	unsigned char text[256];
+	char product[256] = { 0 }, serial[256] = { 0 };
 	if(desc.iManufacturer) {
 		ret = libusb_get_string_descriptor_ascii(usb, desc.iManufacturer, text, sizeof(text));
 		if(ret > 0)
@@ -130,15 +150,24 @@ int dnafx_usb_init(int debug_level) {
 	}
 	if(desc.iProduct) {
 		ret = libusb_get_string_descriptor_ascii(usb, desc.iProduct, text, sizeof(text));
-		if(ret > 0)
+		if(ret > 0) {
 			DNAFX_LOG(DNAFX_LOG_INFO, "  -- Product:       %s\n", (char *)text);
+			g_strlcpy(product, (char *)text, sizeof(product));
+		}
 	}
 	if(desc.iSerialNumber) {
 		ret = libusb_get_string_descriptor_ascii(usb, desc.iSerialNumber, text, sizeof(text));
-		if(ret > 0)
+		if(ret > 0) {
 			DNAFX_LOG(DNAFX_LOG_INFO, "  -- Serial Number: %s\n", (char *)text);
+			g_strlcpy(serial, (char *)text, sizeof(serial));
+		}
 	}
+	char firmware[16];
+	g_snprintf(firmware, sizeof(firmware), "%x.%02x", desc.bcdDevice >> 8, desc.bcdDevice & 0xFF);
+	DNAFX_LOG(DNAFX_LOG_INFO, "  -- Firmware:      %s\n", firmware);
 	DNAFX_LOG(DNAFX_LOG_INFO, "\n");
+	/* The serial number and firmware identify the device state in the cache */
+	dnafx_cache_set_device(serial[0] ? serial : NULL, product[0] ? product : NULL, firmware);
 
 	/* Claim the device (needed?) */
 	if(libusb_kernel_driver_active(usb, 0) == 1) {
@@ -171,6 +200,244 @@ int dnafx_usb_get_next_timeout(struct timeval *tv) {
 	return ctx ? libusb_get_next_timeout(ctx, tv) : 0;
 }
 
+/* Tasks that only need local state, and so can be served at any time */
+static void dnafx_usb_local_task(dnafx_task *task) {
+	if(task->type == DNAFX_TASK_CLI) {
+		dnafx_cli();
+		dnafx_usb_task_done(task);
+	} else if(task->type == DNAFX_TASK_HELP) {
+		if(task->context == NULL && task->callback == NULL) {
+			/* Just print the help instrunctions */
+			dnafx_task_show_help();
+		} else {
+			/* Return the list as a JSON object */
+			json_t *help = dnafx_task_show_help_json();
+			dnafx_usb_task_notify(task, 200, help);
+		}
+		dnafx_usb_task_done(task);
+	} else if(task->type == DNAFX_TASK_LIST_PRESETS && task->text[0] != NULL) {
+		/* Paged listing */
+		gboolean full = task->text[1] && !strcasecmp(task->text[1], "full");
+		json_t *page = dnafx_presets_list_page(dnafx_presets_sort_from_str(task->text[0]),
+			task->number[0], task->text[2], full);
+		if(page == NULL) {
+			dnafx_usb_task_notify_error(task, 400, "Error listing presets");
+		} else if(task->context == NULL && task->callback == NULL) {
+			/* Just print the results */
+			json_t *presets = json_object_get(page, "presets");
+			dnafx_usb_print_presets(presets, NULL);
+			json_t *next = json_object_get(page, "next");
+			DNAFX_LOG(DNAFX_LOG_INFO, "%zu of %"JSON_INTEGER_FORMAT" presets%s%s%s\n",
+				json_array_size(presets), json_integer_value(json_object_get(page, "count")),
+				next ? " (next: \"" : "", next ? json_string_value(next) : "", next ? "\")" : "");
+			json_decref(page);
+		} else {
+			dnafx_usb_task_notify(task, 200, page);
+		}
+		dnafx_usb_task_done(task);
+	} else if(task->type == DNAFX_TASK_LIST_PRESETS) {
+		if(task->context == NULL && task->callback == NULL) {
+			/* Just print the results */
+			dnafx_presets_print();
+		} else {
+			/* Return the list as a JSON object */
+			json_t *list = dnafx_presets_list();
+			dnafx_usb_task_notify(task, 200, list);
+		}
+		dnafx_usb_task_done(task);
+	} else if(task->type == DNAFX_TASK_SEARCH_PRESETS) {
+		gboolean fuzzy = !strcasecmp(task->text[0], "fuzzy");
+		json_t *results = dnafx_presets_search(task->text[1], fuzzy, task->number[0]);
+		if(results == NULL) {
+			dnafx_usb_task_notify_error(task, 400, "Error searching presets");
+		} else if(task->context == NULL && task->callback == NULL) {
+			/* Just print the results */
+			DNAFX_LOG(DNAFX_LOG_INFO, "Found %zu presets:\n", json_array_size(results));
+			dnafx_usb_print_presets(results, NULL);
+			json_decref(results);
+		} else {
+			dnafx_usb_task_notify(task, 200, results);
+		}
+		dnafx_usb_task_done(task);
+	} else if(task->type == DNAFX_TASK_QUERY_PRESETS) {
+		json_t *result = dnafx_query_presets(task->text[0], task->number[0]);
+		if(result == NULL) {
+			dnafx_usb_task_notify_error(task, 400, "Invalid query");
+		} else if(task->context == NULL && task->callback == NULL) {
+			/* Just print the results */
+			DNAFX_LOG(DNAFX_LOG_INFO, "Found %"JSON_INTEGER_FORMAT" presets (%"JSON_INTEGER_FORMAT"us):\n",
+				json_integer_value(json_object_get(result, "count")),
+				json_integer_value(json_object_get(result, "elapsed-us")));
+			dnafx_usb_print_presets(json_object_get(result, "presets"), NULL);
+			json_decref(result);
+		} else {
+			dnafx_usb_task_notify(task, 200, result);
+		}
+		dnafx_usb_task_done(task);
+	} else if(task->type == DNAFX_TASK_SIMILAR_PRESETS) {
+		dnafx_preset *preset = NULL;
+		if(task->number[0] > 0)
+			preset = dnafx_preset_find_byid(task->number[0]);
+		else
+			preset = dnafx_preset_find_byname(task->text[0]);
+		json_t *result = preset ? dnafx_query_similar(preset->handle, task->number[1], task->text[1]) : NULL;
+		if(preset == NULL) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "No such preset\n");
+			dnafx_usb_task_notify_error(task, 404, "No such preset");
+		} else if(result == NULL) {
+			dnafx_usb_task_notify_error(task, 400, "Invalid weights");
+		} else if(task->context == NULL && task->callback == NULL) {
+			/* Just print the results */
+			DNAFX_LOG(DNAFX_LOG_INFO, "Presets similar to '%s' (%"JSON_INTEGER_FORMAT"us):\n",
+				json_string_value(json_object_get(result, "preset")),
+				json_integer_value(json_object_get(result, "elapsed-us")));
+			dnafx_usb_print_presets(json_object_get(result, "presets"), "distance");
+			json_decref(result);
+		} else {
+			dnafx_usb_task_notify(task, 200, result);
+		}
+		dnafx_usb_task_done(task);
+	} else if(task->type == DNAFX_TASK_HISTORY) {
+		json_t *history = dnafx_journal_history(task->number[0], task->number[1]);
+		if(history == NULL) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "No journal\n");
+			dnafx_usb_task_notify_error(task, 400, "No journal");
+		} else if(task->context == NULL && task->callback == NULL) {
+			/* Just print the results */
+			size_t i = 0;
+			json_t *change = NULL;
+			char when[32];
+			DNAFX_LOG(DNAFX_LOG_INFO, "Journal (most recent first):\n");
+			json_array_foreach(history, i, change) {
+				GDateTime *dt = g_date_time_new_from_unix_local(json_integer_value(json_object_get(change, "time")));
+				gchar *date = dt ? g_date_time_format(dt, "%Y-%m-%dT%H:%M:%S") : NULL;
+				g_snprintf(when, sizeof(when), "%s", date ? date : "??");
+				g_free(date);
+				if(dt != NULL)
+					g_date_time_unref(dt);
+				DNAFX_LOG(DNAFX_LOG_INFO, "   %s [%03d] %-14s %s\n", when,
+					(int)json_integer_value(json_object_get(change, "slot")),
+					json_string_value(json_object_get(change, "name")),
+					json_string_value(json_object_get(change, "change")));
+			}
+			json_decref(history);
+		} else {
+			dnafx_usb_task_notify(task, 200, history);
+		}
+		dnafx_usb_task_done(task);
+	} else if(task->type == DNAFX_TASK_API_STATS) {
+		json_t *stats = dnafx_httpws_stats();
+		if(task->context == NULL && task->callback == NULL) {
+			/* Just print the results */
+			char *text = json_dumps(stats, JSON_INDENT(4));
+			DNAFX_LOG(DNAFX_LOG_INFO, "%s\n", text);
+			free(text);
+			json_decref(stats);
+		} else {
+			dnafx_usb_task_notify(task, 200, stats);
+		}
+		dnafx_usb_task_done(task);
+	} else if(task->type == DNAFX_TASK_PARSE_PRESET) {
+		dnafx_preset *preset = NULL;
+		if(task->number[0] > 0)
+			preset = dnafx_session_find_byid(task->number[0]);
+		else
+			preset = dnafx_session_find_byname(task->text[0]);
+		if(preset == NULL) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "No such preset\n");
+			dnafx_usb_task_notify_error(task, 404, "No such preset");
+		} else {
+			dnafx_preset_print_debug(preset);
+		}
+		dnafx_usb_task_done(task);
+	} else if(task->type == DNAFX_TASK_EXPORT_PRESET) {
+		dnafx_preset *preset = NULL;
+		if(task->number[0] > 0)
+			preset = dnafx_session_find_byid(task->number[0]);
+		else
+			preset = dnafx_session_find_byname(task->text[0]);
+		if(preset == NULL) {
+			DNAFX_LOG(DNAFX_LOG_WARN, "No such preset\n");
+			dnafx_usb_task_notify_error(task, 404, "No such preset");
+		} else {
+			gboolean phb = !strncasecmp(task->text[1], "phb", 3);
+			gboolean compact = !strcasecmp(task->text[1], "phb-compact");
+			if(task->text[2] != NULL) {
+				/* We have a target filename */
+				if(dnafx_preset_export(preset, task->text[2], phb) == 0) {
+					DNAFX_LOG(DNAFX_LOG_INFO, "  -- Successfully exported preset '%s'\n", preset->name);
+				} else {
+					dnafx_usb_task_notify_error(task, 400, "Error exporting preset");
+				}
+			} else {
+				/* No target filename, if this is coming from an API call send it there */
+				if(task->context != NULL && task->callback != NULL) {
+					json_t *json = NULL;
+					if(compact) {
+						/* Return the compact PHB text, rather than a JSON object */
+						GString *text = g_string_sized_new(1024);
+						if(dnafx_preset_write_phb(preset, text, TRUE) > 0) {
+							json = json_object();
+							json_object_set_new(json, "phb", json_stringn(text->str, text->len));
+						}
+						g_string_free(text, TRUE);
+					} else if(phb) {
+						json = dnafx_preset_to_phb_json(preset);
+					} else {
+						char *base64 = dnafx_preset_to_bytes_base64(preset);
+						if(base64 != NULL) {
+							json = json_object();
+							json_object_set_new(json, "base64", json_string(base64));
+							g_free(base64);
+						}
+					}
+					if(json != NULL) {
+						dnafx_usb_task_notify(task, 200, json);
+					} else {
+						dnafx_usb_task_notify_error(task, 400, "Error exporting preset");
+					}
+				} else {
+					DNAFX_LOG(DNAFX_LOG_WARN, "Missing target filename\n");
+				}
+			}
+		}
+		dnafx_usb_task_done(task);
+	} else if(task->type == DNAFX_TASK_CACHE_STATUS) {
+		json_t *status = dnafx_cache_status();
+		if(task->context == NULL && task->callback == NULL) {
+			/* Just print the results */
+			DNAFX_LOG(DNAFX_LOG_INFO, "Device cache: %s%s\n",
+				json_is_true(json_object_get(status, "warm")) ? "warm" : "not in use",
+				json_is_true(json_object_get(status, "invalidated")) ? " (invalidated)" : "");
+			json_t *changes = json_object_get(status, "changes");
+			if(changes == NULL) {
+				DNAFX_LOG(DNAFX_LOG_INFO, "  -- Not revalidated yet\n");
+			} else if(json_array_size(changes) == 0) {
+				DNAFX_LOG(DNAFX_LOG_INFO, "  -- Presets on the device match the cached ones\n");
+			}
+			size_t i = 0;
+			json_t *change = NULL;
+			json_array_foreach(changes, i, change) {
+				DNAFX_LOG(DNAFX_LOG_INFO, "   [%03d] %-14s %s\n",
+					(int)json_integer_value(json_object_get(change, "slot")),
+					json_string_value(json_object_get(change, "name")),
+					json_string_value(json_object_get(change, "change")));
+			}
+			if(json_is_true(json_object_get(status, "extras-changed")))
+				DNAFX_LOG(DNAFX_LOG_INFO, "  -- Extras changed since they were cached\n");
+			json_decref(status);
+		} else {
+			dnafx_usb_task_notify(task, 200, status);
+		}
+		dnafx_usb_task_done(task);
+	} else {
+		DNAFX_LOG(DNAFX_LOG_WARN, "Task '%s' currently unsupported\n",
+			dnafx_task_type_str(task->type));
+		dnafx_usb_task_notify_error(task, 400, "Task unsupported");
+		dnafx_usb_task_done(task);
+	}
+}
+
 void dnafx_usb_step(void) {
 	if(ctx != NULL) {
 		struct timeval tv = { 0 };
@@ -181,27 +448,17 @@ void dnafx_usb_step(void) {
 	if(g_atomic_int_compare_and_exchange(&in_flight, 0, 1)) {
 		buf_size = 0;
 		task = dnafx_tasks_next();
+		refreshing = (task != NULL && dnafx_task_is_refresh(task->type));
 		if(task == NULL) {
 			/* Nothing to do */
 			dnafx_usb_task_done(task);
 		} else {
 			/* Perform the new activity */
-			if(task->type == DNAFX_TASK_CLI) {
-				dnafx_cli();
-				dnafx_usb_task_done(task);
+			if(dnafx_task_is_local(task->type)) {
+				dnafx_usb_local_task(task);
 			} else if(task->type == DNAFX_TASK_QUIT) {
 				dnafx_usb_task_done(task);
 				dnafx_quit();
-			} else if(task->type == DNAFX_TASK_HELP) {
-				if(task->context == NULL && task->callback == NULL) {
-					/* Just print the help instrunctions */
-					dnafx_task_show_help();
-				} else {
-					/* Return the list as a JSON object */
-					json_t *help = dnafx_task_show_help_json();
-					dnafx_usb_task_notify(task, 200, help);
-				}
-				dnafx_usb_task_done(task);
 			} else if(task->type == DNAFX_TASK_INIT_1) {
 				if(ctx == NULL)
 					goto disconnected;
@@ -230,77 +487,268 @@ void dnafx_usb_step(void) {
 				if(ctx == NULL)
 					goto disconnected;
 				dnafx_send_interrupt(task);
-			} else if(task->type == DNAFX_TASK_LIST_PRESETS) {
-				if(task->context == NULL && task->callback == NULL) {
-					/* Just print the results */
-					dnafx_presets_print();
+			} else if(task->type == DNAFX_TASK_DIFF) {
+				json_t *diff = dnafx_diff(task->text[0], task->text[1]);
+				if(diff == NULL) {
+					dnafx_usb_task_notify_error(task, 400, "Error comparing presets");
+				} else if(task->context == NULL && task->callback == NULL) {
+					dnafx_diff_print(diff);
+					json_decref(diff);
 				} else {
-					/* Return the list as a JSON object */
-					json_t *list = dnafx_presets_list();
-					dnafx_usb_task_notify(task, 200, list);
+					dnafx_usb_task_notify(task, 200, diff);
 				}
 				dnafx_usb_task_done(task);
-			} else if(task->type == DNAFX_TASK_IMPORT_PRESET) {
-				gboolean phb = !strcasecmp(task->text[0], "phb");
-				dnafx_preset *preset = dnafx_preset_import(task->text[1], phb);
-				if(preset != NULL)
-					DNAFX_LOG(DNAFX_LOG_INFO, "  -- Successfully imported preset '%s'\n", preset->name);
+			} else if(task->type == DNAFX_TASK_SAVE_BANK) {
+				if(dnafx_bank_save(task->text[0]) < 0)
+					dnafx_usb_task_notify_error(task, 500, "Error saving bank");
 				dnafx_usb_task_done(task);
-			} else if(task->type == DNAFX_TASK_PARSE_PRESET) {
-				dnafx_preset *preset = NULL;
-				if(task->number[0] > 0)
-					preset = dnafx_preset_find_byid(task->number[0]);
-				else
-					preset = dnafx_preset_find_byname(task->text[0]);
-				if(preset == NULL) {
-					DNAFX_LOG(DNAFX_LOG_WARN, "No such preset\n");
-					dnafx_usb_task_notify_error(task, 404, "No such preset");
+			} else if(task->type == DNAFX_TASK_LOAD_BANK) {
+				if(dnafx_bank_load(task->text[0]) < 0)
+					dnafx_usb_task_notify_error(task, 400, "Error loading bank");
+				dnafx_usb_task_done(task);
+			} else if(task->type == DNAFX_TASK_SAVE_ARCHIVE) {
+				if(dnafx_archive_save(task->text[0]) < 0)
+					dnafx_usb_task_notify_error(task, 500, "Error saving archive");
+				dnafx_usb_task_done(task);
+			} else if(task->type == DNAFX_TASK_LOAD_ARCHIVE) {
+				if(dnafx_archive_load(task->text[0]) < 0)
+					dnafx_usb_task_notify_error(task, 400, "Error loading archive");
+				dnafx_usb_task_done(task);
+			} else if(task->type == DNAFX_TASK_UPLOAD_BANK) {
+				if(ctx == NULL)
+					goto disconnected;
+				GByteArray *uploads = dnafx_bank_images(task->text[0]);
+				if(uploads == NULL || uploads->len == 0) {
+					DNAFX_LOG(DNAFX_LOG_WARN, "Nothing to upload\n");
+					if(uploads != NULL)
+						g_byte_array_unref(uploads);
+					dnafx_usb_task_notify_error(task, 400, "Error loading bank");
+					dnafx_usb_task_done(task);
 				} else {
-					dnafx_preset_print_debug(preset);
+					json_t *report = json_object();
+					json_object_set_new(report, "bank", json_string(task->text[0]));
+					dnafx_usb_upload_batch(task, uploads, report);
 				}
-				dnafx_usb_task_done(task);
-			} else if(task->type == DNAFX_TASK_EXPORT_PRESET) {
-				dnafx_preset *preset = NULL;
-				if(task->number[0] > 0)
-					preset = dnafx_preset_find_byid(task->number[0]);
+			} else if(task->type == DNAFX_TASK_SYNC) {
+				gboolean dry_run = task->number[0];
+				if(!dry_run && ctx == NULL)
+					goto disconnected;
+				GByteArray *uploads = NULL;
+				json_t *report = dnafx_diff_sync(task->text[0], &uploads);
+				guint count = uploads ? uploads->len / DNAFX_PRESET_SIZE : 0;
+				if(report == NULL) {
+					dnafx_usb_task_notify_error(task, 400, "Error loading presets to sync");
+				} else {
+					json_object_set_new(report, "dry-run", json_boolean(dry_run));
+					DNAFX_LOG(DNAFX_LOG_INFO, "%s %u slots to sync with %s (%"JSON_INTEGER_FORMAT" unchanged)\n",
+						dry_run ? "Would upload" : "Uploading", count, task->text[0],
+						json_integer_value(json_object_get(report, "unchanged")));
+					size_t i = 0;
+					json_t *slot = NULL, *replaces = NULL;
+					json_array_foreach(json_object_get(report, "uploads"), i, slot) {
+						replaces = json_object_get(slot, "replaces");
+						DNAFX_LOG(DNAFX_LOG_INFO, "   [%03d] %-14s%s%s%s\n", (int)json_integer_value(json_object_get(slot, "slot")),
+							json_string_value(json_object_get(slot, "name")), replaces ? " (was '" : "",
+							replaces ? json_string_value(replaces) : "", replaces ? "')" : "");
+					}
+				}
+				if(report == NULL || dry_run || count == 0) {
+					if(report != NULL)
+						dnafx_usb_task_notify(task, 200, report);
+					if(uploads != NULL)
+						g_byte_array_unref(uploads);
+					dnafx_usb_task_done(task);
+				} else {
+					/* Upload all the images that changed, one after the other */
+					dnafx_usb_upload_batch(task, uploads, report);
+				}
+			} else if(task->type == DNAFX_TASK_MOVE || task->type == DNAFX_TASK_SWAP ||
+					task->type == DNAFX_TASK_REORDER) {
+				if(ctx == NULL)
+					goto disconnected;
+				int target[DNAFX_PRESETS_NUM];
+				int res = 0;
+				if(task->type == DNAFX_TASK_MOVE)
+					res = dnafx_diff_move(target, task->number[0], task->number[1], task->number[2]);
+				else if(task->type == DNAFX_TASK_SWAP)
+					res = dnafx_diff_swap(target, task->number[0], task->number[1]);
 				else
-					preset = dnafx_preset_find_byname(task->text[0]);
-				if(preset == NULL) {
-					DNAFX_LOG(DNAFX_LOG_WARN, "No such preset\n");
-					dnafx_usb_task_notify_error(task, 404, "No such preset");
+					res = dnafx_diff_reorder(target, task->text[0]);
+				GByteArray *uploads = NULL;
+				json_t *report = (res == 0 ? dnafx_diff_permute(target, &uploads) : NULL);
+				guint count = uploads ? uploads->len / DNAFX_PRESET_SIZE : 0;
+				if(report == NULL) {
+					dnafx_usb_task_notify_error(task, 400, "Invalid slots to reorder");
+				} else {
+					DNAFX_LOG(DNAFX_LOG_INFO, "Reordering presets: %u uploads in %zu cycles\n",
+						count, json_array_size(json_object_get(report, "cycles")));
+					size_t i = 0;
+					json_t *slot = NULL;
+					json_array_foreach(json_object_get(report, "uploads"), i, slot) {
+						DNAFX_LOG(DNAFX_LOG_INFO, "   [%03d] %-14s (from %03d, was '%s')\n",
+							(int)json_integer_value(json_object_get(slot, "slot")),
+							json_string_value(json_object_get(slot, "name")),
+							(int)json_integer_value(json_object_get(slot, "from")),
+							json_string_value(json_object_get(slot, "replaces")));
+					}
+				}
+				if(report == NULL || count == 0) {
+					if(report != NULL)
+						dnafx_usb_task_notify(task, 200, report);
+					if(uploads != NULL)
+						g_byte_array_unref(uploads);
+					dnafx_usb_task_done(task);
+				} else {
+					/* Upload the whole plan as a single batch */
+					dnafx_usb_upload_batch(task, uploads, report);
+				}
+			} else if(task->type == DNAFX_TASK_PATCH) {
+				gboolean dry_run = task->number[0];
+				gboolean session = dnafx_session_is_open();
+				if(!dry_run && !session && ctx == NULL)
+					goto disconnected;
+				GByteArray *uploads = NULL;
+				json_t *report = dnafx_presets_patch(task->text[0], task->text[1], &uploads);
+				guint count = uploads ? uploads->len / DNAFX_PRESET_SIZE : 0;
+				if(report == NULL) {
+					dnafx_usb_task_notify_error(task, 400, "Invalid patch");
+				} else {
+					json_object_set_new(report, "dry-run", json_boolean(dry_run));
+					json_object_set_new(report, "session", json_boolean(session));
+					DNAFX_LOG(DNAFX_LOG_INFO, "%s %u of %"JSON_INTEGER_FORMAT" selected presets%s (%"JSON_INTEGER_FORMAT"us)\n",
+						dry_run ? "Would patch" : "Patching", count, session ? " in the edit session" : "",
+						json_integer_value(json_object_get(report, "matched")),
+						json_integer_value(json_object_get(report, "elapsed-us")));
+					size_t i = 0;
+					json_t *slot = NULL;
+					json_array_foreach(json_object_get(report, "uploads"), i, slot) {
+						DNAFX_LOG(DNAFX_LOG_INFO, "   [%03d] %-14s %"JSON_INTEGER_FORMAT" -> %"JSON_INTEGER_FORMAT"\n",
+							(int)json_integer_value(json_object_get(slot, "slot")),
+							json_string_value(json_object_get(slot, "name")),
+							json_integer_value(json_object_get(slot, "from")),
+							json_integer_value(json_object_get(slot, "to")));
+					}
+				}
+				if(report != NULL && !dry_run && session) {
+					/* Keep the changes in the session, nothing to upload yet */
+					guint offset = 0;
+					for(offset=0; offset<uploads->len; offset += DNAFX_PRESET_SIZE)
+						dnafx_session_put(uploads->data + offset);
+					count = 0;
+				}
+				if(report == NULL || dry_run || count == 0) {
+					if(report != NULL)
+						dnafx_usb_task_notify(task, 200, report);
+					if(uploads != NULL)
+						g_byte_array_unref(uploads);
+					dnafx_usb_task_done(task);
 				} else {
-					gboolean phb = !strcasecmp(task->text[1], "phb");
-					if(task->text[2] != NULL) {
-						/* We have a target filename */
-						if(dnafx_preset_export(preset, task->text[2], phb) == 0) {
-							DNAFX_LOG(DNAFX_LOG_INFO, "  -- Successfully exported preset '%s'\n", preset->name);
-						} else {
-							dnafx_usb_task_notify_error(task, 400, "Error exporting preset");
+					/* Upload all the patched images, one after the other */
+					dnafx_usb_upload_batch(task, uploads, report);
+				}
+			} else if(task->type == DNAFX_TASK_SESSION) {
+				if(!strcmp(task->text[0], "begin")) {
+					if(dnafx_session_begin() < 0)
+						dnafx_usb_task_notify_error(task, 400, "Session already open");
+					dnafx_usb_task_done(task);
+				} else if(!strcmp(task->text[0], "discard")) {
+					dnafx_session_discard();
+					DNAFX_LOG(DNAFX_LOG_INFO, "Edit session discarded\n");
+					dnafx_usb_task_done(task);
+				} else if(!strcmp(task->text[0], "status")) {
+					json_t *status = dnafx_session_status();
+					if(task->context == NULL && task->callback == NULL) {
+						/* Just print the results */
+						json_t *dirty = json_object_get(status, "dirty");
+						DNAFX_LOG(DNAFX_LOG_INFO, "Edit session %s, %zu dirty slots\n",
+							dnafx_session_is_open() ? "open" : "closed", json_array_size(dirty));
+						size_t i = 0;
+						json_t *slot = NULL, *name = NULL;
+						json_array_foreach(dirty, i, slot) {
+							name = json_object_get(slot, "name");
+							DNAFX_LOG(DNAFX_LOG_INFO, "   [%03d] %-14s %zu sections%s%s\n",
+								(int)json_integer_value(json_object_get(slot, "slot")),
+								json_string_value(json_is_object(name) ? json_object_get(name, "to") : name),
+								json_array_size(json_object_get(slot, "sections")),
+								json_object_get(slot, "expressions") ? ", expressions" : "",
+								json_is_object(name) ? ", name" : "");
 						}
+						json_decref(status);
 					} else {
-						/* No target filename, if this is coming from an API call send it there */
-						if(task->context != NULL && task->callback != NULL) {
-							json_t *json = NULL;
-							if(phb) {
-								json = dnafx_preset_to_phb_json(preset);
-							} else {
-								char *base64 = dnafx_preset_to_bytes_base64(preset);
-								if(base64 != NULL) {
-									json = json_object();
-									json_object_set_new(json, "base64", json_string(base64));
-									g_free(base64);
-								}
-							}
-							if(json != NULL) {
-								dnafx_usb_task_notify(task, 200, json);
-							} else {
-								dnafx_usb_task_notify_error(task, 400, "Error exporting preset");
-							}
-						} else {
-							DNAFX_LOG(DNAFX_LOG_WARN, "Missing target filename\n");
-						}
+						dnafx_usb_task_notify(task, 200, status);
+					}
+					dnafx_usb_task_done(task);
+				} else {
+					if(ctx == NULL)
+						goto disconnected;
+					GByteArray *uploads = dnafx_session_commit();
+					guint count = uploads ? uploads->len / DNAFX_PRESET_SIZE : 0;
+					json_t *report = NULL;
+					if(uploads == NULL) {
+						dnafx_usb_task_notify_error(task, 400, "No session open");
+					} else {
+						DNAFX_LOG(DNAFX_LOG_INFO, "Committing the edit session: %u slots to upload\n", count);
+						report = json_object();
+						json_object_set_new(report, "uploads", json_integer(count));
+					}
+					if(count == 0) {
+						/* Nothing to upload, the session can be closed already */
+						dnafx_session_commit_done(TRUE);
+						if(report != NULL)
+							dnafx_usb_task_notify(task, 200, report);
+						if(uploads != NULL)
+							g_byte_array_unref(uploads);
+						dnafx_usb_task_done(task);
+					} else {
+						/* Upload all the dirty slots, one after the other */
+						dnafx_usb_upload_batch(task, uploads, report);
 					}
 				}
+			} else if(task->type == DNAFX_TASK_UNDO || task->type == DNAFX_TASK_REDO ||
+					task->type == DNAFX_TASK_RESTORE) {
+				if(ctx == NULL)
+					goto disconnected;
+				GByteArray *uploads = NULL;
+				if(!dnafx_journal_enabled()) {
+					DNAFX_LOG(DNAFX_LOG_WARN, "No journal, can't %s\n", dnafx_task_type_str(task->type));
+				} else if(task->type == DNAFX_TASK_UNDO) {
+					uploads = dnafx_journal_undo();
+				} else if(task->type == DNAFX_TASK_REDO) {
+					uploads = dnafx_journal_redo();
+				} else {
+					gint64 when = dnafx_journal_parse_time(task->text[0]);
+					if(when < 0)
+						DNAFX_LOG(DNAFX_LOG_WARN, "Invalid time '%s'\n", task->text[0]);
+					else
+						uploads = dnafx_journal_restore(task->number[0], when);
+				}
+				if(uploads == NULL || uploads->len == 0) {
+					if(uploads == NULL)
+						dnafx_usb_task_notify_error(task, 400, "Nothing to upload");
+					else
+						g_byte_array_unref(uploads);
+					dnafx_usb_task_done(task);
+				} else {
+					/* Upload the images from the journal */
+					json_t *report = json_object();
+					json_object_set_new(report, "change", json_string(dnafx_task_type_str(task->type)));
+					dnafx_usb_upload_batch(task, uploads, report);
+				}
+			} else if(task->type == DNAFX_TASK_IMPORT_PRESET) {
+				gboolean phb = !strcasecmp(task->text[0], "phb");
+				dnafx_preset *preset = dnafx_preset_import(task->text[1], phb);
+				if(preset != NULL)
+					DNAFX_LOG(DNAFX_LOG_INFO, "  -- Successfully imported preset '%s'\n", preset->name);
+				dnafx_usb_task_done(task);
+			} else if(task->type == DNAFX_TASK_IMPORT_DIR) {
+				json_t *summary = dnafx_presets_import_dir(task->text[0]);
+				if(summary == NULL) {
+					dnafx_usb_task_notify_error(task, 400, "Error importing folder");
+				} else if(task->context == NULL && task->callback == NULL) {
+					json_decref(summary);
+				} else {
+					dnafx_usb_task_notify(task, 200, summary);
+				}
 				dnafx_usb_task_done(task);
 			} else {
 				DNAFX_LOG(DNAFX_LOG_WARN, "Task '%s' currently unsupported\n",
@@ -309,6 +757,12 @@ void dnafx_usb_step(void) {
 				dnafx_usb_task_done(task);
 			}
 		}
+	} else if(refreshing && dnafx_cache_is_warm()) {
+		/* We're serving the cached state while the device is queried
+		 * again: whatever only needs local state can be served now */
+		local_task = dnafx_tasks_next_local();
+		if(local_task != NULL)
+			dnafx_usb_local_task(local_task);
 	}
 	return;
 
@@ -488,7 +942,13 @@ void dnafx_send_rename_preset(dnafx_task *task) {
 void dnafx_send_upload_preset(dnafx_task *task) {
 	if(task == NULL)
 		return;
-	if(task->type == DNAFX_TASK_UPLOAD_PRESET_1) {
+	if(task->type == DNAFX_TASK_UPLOAD_PRESET_1 && task->images != NULL) {
+		/* We're uploading a batch of images, pick the next one */
+		cur_preset = NULL;
+		memcpy(cur_preset_bytes, task->images->data + task->number[1] * DNAFX_PRESET_SIZE,
+			sizeof(cur_preset_bytes));
+		cur_slot = cur_preset_bytes[0];
+	} else if(task->type == DNAFX_TASK_UPLOAD_PRESET_1) {
 		cur_preset = dnafx_preset_find_byname(task->text[0]);
 		if(cur_preset == NULL) {
 			DNAFX_LOG(DNAFX_LOG_WARN, "Can't upload preset named '%s' (no such preset)\n", task->text[0]);
@@ -497,15 +957,24 @@ void dnafx_send_upload_preset(dnafx_task *task) {
 			dnafx_usb_task_done(task);
 			return;
 		} else {
-			cur_preset->id = task->number[0];
-			dnafx_preset_to_bytes(cur_preset, cur_preset_bytes, sizeof(cur_preset_bytes));
+			/* Send the stored image as it is, just targeting the new slot */
+			cur_slot = task->number[0];
+			memcpy(cur_preset_bytes, dnafx_store_image(cur_preset->handle), sizeof(cur_preset_bytes));
+			cur_preset_bytes[0] = (uint8_t)cur_slot;
 		}
 	}
 	size_t len = 64;
 	uint8_t *buffer = g_malloc0(len);
 	if(task->type == DNAFX_TASK_UPLOAD_PRESET_1) {
 		/* First request */
-		DNAFX_LOG(DNAFX_LOG_INFO, "Uploading preset '%s' to slot %d\n", cur_preset->name, cur_preset->id);
+		if(task->images != NULL) {
+			char name[DNAFX_PRESET_NAME_SIZE+1];
+			dnafx_preset_image_name(cur_preset_bytes, name, sizeof(name));
+			DNAFX_LOG(DNAFX_LOG_INFO, "Uploading preset '%s' to slot %d (%d/%u)\n", name, cur_slot,
+				task->number[1] + 1, task->images->len / DNAFX_PRESET_SIZE);
+		} else {
+			DNAFX_LOG(DNAFX_LOG_INFO, "Uploading preset '%s' to slot %d\n", cur_preset->name, cur_slot);
+		}
 		dnafx_print_hex(DNAFX_LOG_HUGE, NULL, cur_preset_bytes, sizeof(cur_preset_bytes));
 		memcpy(buffer, send_preset, sizeof(send_preset));
 	} else if(task->type == DNAFX_TASK_UPLOAD_PRESET_2) {
@@ -646,6 +1115,7 @@ static void dnafx_usb_cb(struct libusb_transfer *transfer) {
 			DNAFX_LOG(DNAFX_LOG_INFO, "  -- %.*s\n", 6, info);
 			info += 7;
 			DNAFX_LOG(DNAFX_LOG_INFO, "  -- %.*s\n", 6, info);
+			dnafx_cache_update_info(buf, buf_size);
 		}
 		/* This transaction is over, we're ready for another task */
 		dnafx_usb_task_done(task);
@@ -716,27 +1186,38 @@ static void dnafx_usb_cb(struct libusb_transfer *transfer) {
 			uint8_t *preset = NULL;
 			size_t offset = 0;
 			size_t count = 0;
-			dnafx_preset *p = NULL;
+			dnafx_store_handle handle = DNAFX_STORE_INVALID;
+			char name[DNAFX_PRESET_NAME_SIZE+1];
 			while(offset + DNAFX_PRESET_SIZE < buf_size && count < DNAFX_PRESETS_NUM) {
 				preset = &buf[offset];
-				p = dnafx_preset_from_bytes(preset, DNAFX_PRESET_SIZE);
-				if(p != NULL) {
-					/* Keep track of the preset */
-					if(dnafx_preset_add(p) == 0) {
-						dnafx_preset_set_id(p, p->id);
-						/* Check if we need to also save it locally */
-						if(dnafx_presets_folder() != NULL) {
-							/* FIXME */
-							char filename[256];
-							g_snprintf(filename, sizeof(filename), "%s/%03d-%s.bhb", dnafx_presets_folder(), p->id, p->name);
-							dnafx_write_file(filename, FALSE, preset, DNAFX_PRESET_SIZE);
-						}
+				/* Keep track of the preset, no need to decode it */
+				handle = dnafx_preset_add_image(preset, TRUE);
+				if(handle != DNAFX_STORE_INVALID) {
+					/* Check if we need to also save it locally */
+					if(dnafx_presets_folder() != NULL) {
+						/* FIXME */
+						uint8_t *image = dnafx_store_image(handle);
+						dnafx_preset_image_name(image, name, sizeof(name));
+						char filename[256];
+						g_snprintf(filename, sizeof(filename), "%s/%03d-%s.bhb", dnafx_presets_folder(), image[0], name);
+						dnafx_write_file(filename, FALSE, image, DNAFX_PRESET_SIZE);
 					}
 				}
 				offset += DNAFX_PRESET_SIZE;
 				count++;
 			}
 			DNAFX_LOG(DNAFX_LOG_INFO, "  -- Received %zu presets\n", count);
+			json_t *changes = dnafx_cache_update_presets();
+			if(task->context != NULL && task->callback != NULL) {
+				/* On a warm start, also report what changed since it was cached */
+				json_t *result = json_object();
+				json_object_set_new(result, "count", json_integer(count));
+				if(changes != NULL)
+					json_object_set(result, "changes", changes);
+				dnafx_usb_task_notify(task, 200, result);
+			}
+			if(changes != NULL)
+				json_decref(changes);
 			/* This transaction is over, we're ready for another task */
 			dnafx_usb_task_done(task);
 		}
@@ -805,6 +1286,7 @@ static void dnafx_usb_cb(struct libusb_transfer *transfer) {
 				offset += 16;
 				count++;
 			}
+			dnafx_cache_update_extras(&buf[5], count);
 			/* This transaction is over, we're ready for another task */
 			dnafx_usb_task_done(task);
 		}
@@ -922,12 +1404,41 @@ static void dnafx_usb_cb(struct libusb_transfer *transfer) {
 			if(transfer->actual_length > 0) {
 				dnafx_print_hex(DNAFX_LOG_HUGE, NULL, transfer->buffer, transfer->actual_length);
 			}
-			/* Update the local view of presets */
-			dnafx_preset_set_id(cur_preset, cur_preset->id);
-			cur_preset = 0;
+			/* Keep track of the change, and update the local view of presets */
+			dnafx_journal_record(cur_slot, dnafx_preset_slot_image(cur_slot), cur_preset_bytes);
+			if(cur_preset != NULL)
+				dnafx_preset_set_id(cur_preset, cur_slot);
+			else
+				dnafx_preset_put_image(cur_slot, cur_preset_bytes);
+			dnafx_session_uploaded(cur_slot);
+			if(task->report != NULL) {
+				/* Keep track of how the batch is going */
+				char name[DNAFX_PRESET_NAME_SIZE+1];
+				dnafx_preset_image_name(cur_preset_bytes, name, sizeof(name));
+				json_t *result = json_object();
+				json_object_set_new(result, "slot", json_integer(cur_slot));
+				json_object_set_new(result, "name", json_string(name));
+				json_object_set_new(result, "result", json_string("uploaded"));
+				json_array_append_new(json_object_get(task->report, "results"), result);
+			}
+			cur_preset = NULL;
+			cur_slot = 0;
+			if(task->images != NULL &&
+					(guint)(task->number[1] + 1) * DNAFX_PRESET_SIZE < task->images->len) {
+				/* Move on to the next image in the batch */
+				task->number[1]++;
+				task->type = DNAFX_TASK_UPLOAD_PRESET_1;
+				dnafx_send_upload_preset(task);
+				g_free(transfer->buffer);
+				libusb_free_transfer(transfer);
+				return;
+			}
 		} else {
 			dnafx_usb_task_notify_error(task, 500, "libusb error");
 		}
+		/* Batches update the cache when they're over, single uploads here */
+		if(task->report == NULL)
+			dnafx_cache_update_uploads();
 		/* This transaction is over, we're ready for another task */
 		dnafx_usb_task_done(task);
 	} else if(what == DNAFX_TASK_INTERRUPT) {
@@ -954,6 +1465,11 @@ static void dnafx_usb_task_notify(dnafx_task *task, int code, json_t *result) {
 }
 
 static void dnafx_usb_task_notify_error(dnafx_task *task, int code, char *text) {
+	if(task && task->report != NULL) {
+		/* A batch of uploads failed midway, report how far we got */
+		dnafx_usb_upload_batch_done(task, code, text);
+		return;
+	}
 	if(task && task->context && task->callback) {
 		json_t *body = NULL;
 		if(text != NULL) {
@@ -964,12 +1480,89 @@ static void dnafx_usb_task_notify_error(dnafx_task *task, int code, char *text)
 	}
 }
 
+static void dnafx_usb_print_presets(json_t *presets, const char *score) {
+	/* Each preset is an object with a name, and an id if it's in a slot */
+	size_t i = 0;
+	json_t *p = NULL, *id = NULL;
+	char slot[4];
+	json_array_foreach(presets, i, p) {
+		id = json_object_get(p, "id");
+		g_snprintf(slot, sizeof(slot), "%03d", id ? (int)json_integer_value(id) : 0);
+		if(score != NULL) {
+			DNAFX_LOG(DNAFX_LOG_INFO, "   [%s] %-14s (%"JSON_INTEGER_FORMAT")\n", id ? slot : "XXX",
+				json_string_value(json_object_get(p, "name")),
+				json_integer_value(json_object_get(p, score)));
+		} else {
+			DNAFX_LOG(DNAFX_LOG_INFO, "   [%s] %s\n", id ? slot : "XXX",
+				json_string_value(json_object_get(p, "name")));
+		}
+	}
+}
+
+static void dnafx_usb_upload_batch(dnafx_task *task, GByteArray *images, json_t *report) {
+	task->images = images;
+	task->report = report ? report : json_object();
+	dnafx_journal_batch_begin();
+	json_object_set_new(task->report, "results", json_array());
+	task->type = DNAFX_TASK_UPLOAD_PRESET_1;
+	task->number[1] = 0;
+	dnafx_send_upload_preset(task);
+}
+
+static void dnafx_usb_upload_batch_done(dnafx_task *task, int code, const char *reason) {
+	json_t *report = task->report;
+	task->report = NULL;
+	/* Whatever made it to the device is in the cache now */
+	dnafx_cache_update_uploads();
+	dnafx_journal_batch_end(code == 200);
+	if(dnafx_session_is_committing()) {
+		/* Tasks are serialized, so this batch was the session commit */
+		dnafx_session_commit_done(code == 200);
+		json_object_set_new(report, "session", json_string(dnafx_session_is_open() ? "open" : "closed"));
+	}
+	json_t *results = json_object_get(report, "results");
+	guint uploaded = json_array_size(results), total = task->images ? task->images->len / DNAFX_PRESET_SIZE : 0, i = 0;
+	const uint8_t *image = NULL;
+	char name[DNAFX_PRESET_NAME_SIZE+1];
+	for(i=uploaded; i<total; i++) {
+		/* The one we were uploading failed, and we didn't get to the others */
+		image = task->images->data + i*DNAFX_PRESET_SIZE;
+		dnafx_preset_image_name(image, name, sizeof(name));
+		json_t *result = json_object();
+		json_object_set_new(result, "slot", json_integer(image[0]));
+		json_object_set_new(result, "name", json_string(name));
+		json_object_set_new(result, "result", json_string(i == uploaded ? "failed" : "skipped"));
+		json_array_append_new(results, result);
+	}
+	json_object_set_new(report, "uploaded", json_integer(uploaded));
+	if(code != 200) {
+		json_object_set_new(report, "reason", json_string(reason ? reason : "Upload failed"));
+		DNAFX_LOG(DNAFX_LOG_ERR, "Upload to slot %d failed, %u/%u presets uploaded\n",
+			uploaded < total ? task->images->data[uploaded*DNAFX_PRESET_SIZE] : 0, uploaded, total);
+	} else {
+		DNAFX_LOG(DNAFX_LOG_INFO, "Uploaded %u/%u presets\n", uploaded, total);
+	}
+	if(task->context == NULL && task->callback == NULL)
+		json_decref(report);
+	else
+		dnafx_usb_task_notify(task, code, report);
+}
+
 static void dnafx_usb_task_done(dnafx_task *task) {
+	if(task && task->report != NULL) {
+		/* The batch of uploads is over, and it went fine */
+		dnafx_usb_upload_batch_done(task, 200, NULL);
+	}
 	if(task && task->context && task->callback) {
 		/* If there's a callback and it hasn't been triggered yet, it
 		 * means we can just report a success with no further info */
 		dnafx_usb_task_notify(task, 200, NULL);
 	}
+	gboolean local = (task != NULL && task == local_task);
+	if(local)
+		local_task = NULL;
 	dnafx_task_free(task);
-	g_atomic_int_set(&in_flight, 0);
+	/* A local task served in the meanwhile doesn't end the one in flight */
+	if(!local)
+		g_atomic_int_set(&in_flight, 0);
 }
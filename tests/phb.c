@@ -0,0 +1,68 @@
+/* The direct PHB writer must produce, byte by byte, the same text jansson
+ * would produce for the same preset, with JSON_INDENT(4) | JSON_SORT_KEYS
+ * or, in compact mode, JSON_COMPACT | JSON_SORT_KEYS */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "../src/presets.h"
+#include "../src/debug.h"
+
+int dnafx_log_level = DNAFX_LOG_ERR;
+gboolean dnafx_log_timestamps = FALSE;
+gboolean dnafx_log_colors = FALSE;
+gboolean dnafx_lock_debug = FALSE;
+
+static void dnafx_test_image(uint8_t *image, const char *name, int seed) {
+	memset(image, 0, DNAFX_PRESET_SIZE);
+	dnafx_preset_image_set_name(image, name);
+	int i = 0, j = 0;
+	for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+		dnafx_preset_image_set_active(image, i, (seed + i) % 2);
+		dnafx_preset_image_set_effect(image, i, (seed + i) % 3);
+		for(j=0; j<6; j++)
+			dnafx_preset_image_set_param(image, i, j, (seed * 7 + i * 6 + j) % 100);
+	}
+}
+
+static int dnafx_test_phb(dnafx_preset *preset, gboolean compact) {
+	json_t *json = dnafx_preset_to_phb_json(preset);
+	char *expected = json ? json_dumps(json, (compact ? JSON_COMPACT : JSON_INDENT(4)) | JSON_SORT_KEYS) : NULL;
+	if(json != NULL)
+		json_decref(json);
+	GString *text = g_string_new(NULL);
+	int ret = 0;
+	if(expected == NULL || dnafx_preset_write_phb(preset, text, compact) < 0) {
+		fprintf(stderr, "phb: couldn't convert preset '%s'\n", preset->name);
+		ret = -1;
+	} else if(strcmp(text->str, expected)) {
+		fprintf(stderr, "phb: %s text of preset '%s' differs from jansson's:\n%s\n--\n%s\n",
+			compact ? "compact" : "indented", preset->name, text->str, expected);
+		ret = -1;
+	}
+	g_string_free(text, TRUE);
+	free(expected);
+	return ret;
+}
+
+int main(void) {
+	const char *names[] = { "US Clean", "Lead \"Q\"", "Back\\slash", "", "ABCDEFGHIJKLMN" };
+	uint8_t image[DNAFX_PRESET_SIZE];
+	size_t i = 0;
+	int ret = 0;
+	for(i=0; i<sizeof(names)/sizeof(*names); i++) {
+		dnafx_test_image(image, names[i], i);
+		dnafx_preset *preset = dnafx_preset_from_bytes(image, sizeof(image));
+		if(preset == NULL) {
+			fprintf(stderr, "phb: couldn't parse preset '%s'\n", names[i]);
+			ret = 1;
+			continue;
+		}
+		if(dnafx_test_phb(preset, FALSE) < 0 || dnafx_test_phb(preset, TRUE) < 0)
+			ret = 1;
+		dnafx_preset_free(preset);
+	}
+	if(ret == 0)
+		printf("phb: ok\n");
+	return ret;
+}
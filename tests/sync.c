@@ -0,0 +1,97 @@
+/* Syncing a folder to the device must converge: once the slots that
+ * differ have been uploaded, syncing again must upload nothing, and the
+ * device slots must keep the exact names they have on the device */
+#include <stdio.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
+
+#include "../src/presets.h"
+#include "../src/diff.h"
+#include "../src/utils.h"
+#include "../src/debug.h"
+
+int dnafx_log_level = DNAFX_LOG_ERR;
+gboolean dnafx_log_timestamps = FALSE;
+gboolean dnafx_log_colors = FALSE;
+gboolean dnafx_lock_debug = FALSE;
+
+#define DNAFX_TEST_SLOTS	10
+
+static void dnafx_test_image(uint8_t *image, int slot, const char *name, int seed) {
+	memset(image, 0, DNAFX_PRESET_SIZE);
+	image[0] = slot;
+	dnafx_preset_image_set_name(image, name);
+	int i = 0, j = 0;
+	for(i=0; i<DNAFX_PRESET_EFFECTS; i++) {
+		dnafx_preset_image_set_active(image, i, (seed + i) % 2);
+		dnafx_preset_image_set_effect(image, i, (seed + i) % 3);
+		for(j=0; j<6; j++)
+			dnafx_preset_image_set_param(image, i, j, (seed * 7 + i * 6 + j) % 100);
+	}
+}
+
+/* Pretend the device accepted all uploads, as the USB code does */
+static int dnafx_test_sync(const char *folder) {
+	GByteArray *uploads = NULL;
+	json_t *report = dnafx_diff_sync(folder, &uploads);
+	if(report == NULL || uploads == NULL)
+		return -1;
+	json_decref(report);
+	int i = 0, count = uploads->len / DNAFX_PRESET_SIZE;
+	for(i=0; i<count; i++) {
+		uint8_t *image = uploads->data + i*DNAFX_PRESET_SIZE;
+		dnafx_preset_put_image(image[0], image);
+	}
+	g_byte_array_unref(uploads);
+	return count;
+}
+
+int main(void) {
+	char *folder = g_dir_make_tmp("dnafx-sync-XXXXXX", NULL);
+	if(folder == NULL || dnafx_presets_init(NULL) < 0)
+		return 1;
+	uint8_t image[DNAFX_PRESET_SIZE];
+	char name[DNAFX_PRESET_NAME_SIZE+1], *filename = NULL;
+	int i = 0, ret = 0;
+	for(i=1; i<=DNAFX_TEST_SLOTS; i++) {
+		/* The folder changes the content of a few slots, not their names */
+		g_snprintf(name, sizeof(name), "PRESET%d", i);
+		dnafx_test_image(image, i, name, i);
+		dnafx_preset_put_image(i, image);
+		if(i % 3 == 0)
+			dnafx_test_image(image, i, name, 100 + i);
+		image[0] = 0;
+		filename = g_strdup_printf("%s/%03d-%s.bhb", folder, i, name);
+		dnafx_write_file(filename, FALSE, image, DNAFX_PRESET_SIZE);
+		g_free(filename);
+	}
+	int first = dnafx_test_sync(folder);
+	int second = dnafx_test_sync(folder);
+	if(first != DNAFX_TEST_SLOTS / 3 || second != 0) {
+		fprintf(stderr, "sync: expected %d and 0 uploads, got %d and %d\n",
+			DNAFX_TEST_SLOTS / 3, first, second);
+		ret = 1;
+	}
+	for(i=1; i<=DNAFX_TEST_SLOTS; i++) {
+		char expected[DNAFX_PRESET_NAME_SIZE+1];
+		g_snprintf(expected, sizeof(expected), "PRESET%d", i);
+		dnafx_preset_image_name(dnafx_preset_slot_image(i), name, sizeof(name));
+		if(strcmp(name, expected)) {
+			fprintf(stderr, "sync: slot %d is '%s', expected '%s'\n", i, name, expected);
+			ret = 1;
+		}
+	}
+	dnafx_presets_deinit();
+	for(i=1; i<=DNAFX_TEST_SLOTS; i++) {
+		g_snprintf(name, sizeof(name), "PRESET%d", i);
+		filename = g_strdup_printf("%s/%03d-%s.bhb", folder, i, name);
+		g_remove(filename);
+		g_free(filename);
+	}
+	g_rmdir(folder);
+	g_free(folder);
+	if(ret == 0)
+		printf("sync: ok\n");
+	return ret;
+}